@@ -75,15 +75,25 @@ void *mdlx_device_open(const char *mod_name, struct pci_dev *pdev,
 void mdlx_device_close(struct pci_dev *pdev, void *dev_handle);
 
 /* 
- * mdlx_device_restart - restart the fpga
+ * mdlx_device_restart - restart all dma engines in place
+ *	stops and reprograms every engine and re-arms the interrupts without
+ *	releasing IRQs or DMA memory, see mdlx_engine_restart()
  * @pdev: ptr to struct pci_dev
- * TODO:
- *	may need more refining on the parameter list
- * return < 0 in case of error
- * TODO: exact error code will be defined later
+ * return < 0 in case of error, -EBUSY if offline or an engine runs a
+ *	cyclic or perf transfer
  */
 int mdlx_device_restart(struct pci_dev *pdev, void *dev_handle);
 
+/*
+ * mdlx_engine_restart - restart one dma engine in place
+ *	transfers of the interrupted run complete as far as the engine got
+ *	and fail from there, queued transfers run on the restarted engine
+ * @channel: channel number (< channel_max)
+ * @write: true for the h2c engine
+ * return < 0 in case of error
+ */
+int mdlx_engine_restart(void *dev_hndl, int channel, bool write);
+
 /*
  * mdlx_user_isr_register - register a user ISR handler
  * It is expected that the mdlx will register the ISR, and for the user
@@ -116,18 +126,63 @@ int mdlx_user_isr_register(void *dev_hndl, unsigned int mask,
 int mdlx_user_isr_enable(void *dev_hndl, unsigned int mask);
 int mdlx_user_isr_disable(void *dev_hndl, unsigned int mask);
 
+/*
+ * mdlx_user_isr_coalesce - coalesce the wakeups of user interrupt events
+ *	every interrupt is still counted, but readers of the events device are
+ *	woken only once @count interrupts are pending or @usecs after the first
+ *	pending one, whichever comes first. 0 disables either condition, both
+ *	0 wakes on every interrupt.
+ * @mask: bitmask of user interrupts (0 ~ 15) to be configured
+ * return < 0 in case of error
+ */
+int mdlx_user_isr_coalesce(void *dev_hndl, unsigned int mask,
+			unsigned int count, unsigned int usecs);
+
+/*
+ * mdlx_user_irq_count - user interrupts @user raised since probe, 0 when
+ *	@dev_hndl or @user is invalid
+ * mdlx_user_irq_wait - wait until that count differs from @count, i.e.
+ *	until an interrupt after mdlx_user_irq_count() returned @count
+ * @user: user interrupt number (< user_max)
+ * return < 0 in case of error, -ETIMEDOUT after @timeout_ms
+ */
+u64 mdlx_user_irq_count(void *dev_hndl, unsigned int user);
+int mdlx_user_irq_wait(void *dev_hndl, unsigned int user, u64 count,
+		       int timeout_ms);
+
+/*
+ * mdlx_user_isr_eventfd - signal an eventfd on every user interrupt
+ * @user: user interrupt number (0 ~ 15)
+ * @fd: eventfd of the calling process, < 0 to unbind
+ * return < 0 in case of error
+ */
+int mdlx_user_isr_eventfd(void *dev_hndl, unsigned int user, int fd);
+
+/*
+ * mdlx_engine_eventfd - signal an eventfd when a request completes on the
+ *	engine, from the completion bottom half
+ * @channel: channel number (< channel_max)
+ * @write: true for H2C, false for C2H
+ * @fd: eventfd of the calling process, < 0 to unbind
+ * return < 0 in case of error
+ */
+int mdlx_engine_eventfd(void *dev_hndl, int channel, bool write, int fd);
+
 /*
  * mdlx_xfer_submit - submit data for dma operation (for both read and write)
  *	This is a blocking call
  * @channel: channle number (< channel_max)
- *	== channel_max means libmdlx can pick any channel available:q
-
+ *	== channel_max means libmdlx picks the least loaded channel, see
+ *	the xfer_cpu_affinity module parameter
  * @dir: DMA_FROM/TO_DEVICE
  * @offset: offset into the DDR/BRAM memory to read from or write to
  * @sg_tbl: the scatter-gather list of data buffers
- * @timeout: timeout in mili-seconds, *currently ignored
+ * @timeout: timeout in mili-seconds, interrupt mode only; a transfer that
+ *	times out is cancelled on its engine and -ETIMEDOUT is returned
  * return # of bytes transfered or
- *	 < 0 in case of error
+ *	 < 0 in case of error, -EREMOTEIO if the engine did not stop: the
+ *	device still owns @sg_tbl, its pages must stay pinned and it must
+ *	not be freed
  * TODO: exact error code will be defined later
  */
 ssize_t mdlx_xfer_submit(void *dev_hndl, int channel, bool write, u64 ep_addr,
@@ -141,6 +196,23 @@ ssize_t mdlx_xfer_completion(void *cb_hndl, void *dev_hndl, int channel, bool wr
 			struct sg_table *sgt, bool dma_mapped, int timeout_ms);
 
 			
+/*
+ * mdlx_pool_xfer_submit - blocking transfer on the least loaded engine of
+ *	all online cards
+ * @write: true for H2C, false for C2H
+ * @card: mdlx index of the card to use, < 0 for any card
+ * @ep_addr: card address, same on every card
+ * @sgt: host buffer, not yet dma mapped
+ * @card_used, @channel_used: if not NULL, set to the engine that served the
+ *	request
+ * return # of bytes transfered or
+ *	 < 0 in case of error, -ENODEV if no card is online, -EREMOTEIO as
+ *	for mdlx_xfer_submit()
+ */
+ssize_t mdlx_pool_xfer_submit(bool write, int card, u64 ep_addr,
+			      struct sg_table *sgt, int timeout_ms,
+			      int *card_used, int *channel_used);
+
 
 /////////////////////missing API////////////////////
 
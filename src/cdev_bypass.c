@@ -19,40 +19,35 @@
 
 #include "libmdlx_api.h"
 #include "mdlx_cdev.h"
+#include "cdev_sgdma.h"
 
-#define write_register(v, mem, off) iowrite32(v, mem)
+/* bytes moved through the bounce buffer per bypass burst */
+#define BYPASS_BURST_MAX	PAGE_SIZE
+/* writes up to this size, two descriptors, avoid the bounce allocation */
+#define BYPASS_BURST_SMALL	64
 
-static int copy_desc_data(struct mdlx_transfer *transfer, char __user *buf,
+static int copy_desc_data(struct mdlx_transfer *transfer, char *buf,
 		size_t *buf_offset, size_t buf_size)
 {
 	int i;
-	int copy_err;
 	int rc = 0;
 
 	if (!buf) {
-		pr_err("Invalid user buffer\n");
+		pr_err("Invalid buffer\n");
 		return -EINVAL;
 	}
 
 	if (!buf_offset) {
-		pr_err("Invalid user buffer offset\n");
+		pr_err("Invalid buffer offset\n");
 		return -EINVAL;
 	}
 
-	/* Fill user buffer with descriptor data */
+	/* Fill buffer with descriptor data */
 	for (i = 0; i < transfer->desc_num; i++) {
 		if (*buf_offset + sizeof(struct mdlx_desc) <= buf_size) {
-			copy_err = copy_to_user(&buf[*buf_offset],
-				transfer->desc_virt + i,
+			memcpy(&buf[*buf_offset], transfer->desc_virt + i,
 				sizeof(struct mdlx_desc));
-
-			if (copy_err) {
-				dbg_sg("Copy to user buffer failed\n");
-				*buf_offset = buf_size;
-				rc = -EINVAL;
-			} else {
-				*buf_offset += sizeof(struct mdlx_desc);
-			}
+			*buf_offset += sizeof(struct mdlx_desc);
 		} else {
 			rc = -ENOMEM;
 		}
@@ -70,6 +65,8 @@ static ssize_t char_bypass_read(struct file *file, char __user *buf,
 	struct mdlx_transfer *transfer;
 	struct list_head *idx;
 	size_t buf_offset = 0;
+	unsigned long flags;
+	char *kbuf;
 	int rc = 0;
 
 	rc = xcdev_check(__func__, xcdev, 1);
@@ -95,17 +92,31 @@ static ssize_t char_bypass_read(struct file *file, char __user *buf,
 		return -ENODEV;
 	}
 
-	spin_lock(&engine->lock);
+	/* the queued descriptors never exceed one ring */
+	count = min_t(size_t, count,
+		      MDLX_TRANSFER_MAX_DESC * sizeof(struct mdlx_desc));
+	kbuf = kmalloc(count, GFP_KERNEL);
+	if (!kbuf)
+		return -ENOMEM;
+
+	/* snapshot under the lock, copy_to_user() may fault and sleep */
+	spin_lock_irqsave(&engine->lock, flags);
 
 	if (!list_empty(&engine->transfer_list)) {
 		list_for_each(idx, &engine->transfer_list) {
 			transfer = list_entry(idx, struct mdlx_transfer, entry);
 
-			rc = copy_desc_data(transfer, buf, &buf_offset, count);
+			rc = copy_desc_data(transfer, kbuf, &buf_offset, count);
 		}
 	}
 
-	spin_unlock(&engine->lock);
+	spin_unlock_irqrestore(&engine->lock, flags);
+
+	if (buf_offset && copy_to_user(buf, kbuf, buf_offset)) {
+		dbg_sg("Copy to user buffer failed\n");
+		rc = -EFAULT;
+	}
+	kfree(kbuf);
 
 	if (rc < 0)
 		return rc;
@@ -113,18 +124,38 @@ static ssize_t char_bypass_read(struct file *file, char __user *buf,
 		return buf_offset;
 }
 
+/* bypass descriptor port of the engine, a single register written as a FIFO */
+static void __iomem *bypass_port(struct mdlx_dev *mdev,
+		struct mdlx_engine *engine)
+{
+	return (u32 __iomem *)mdev->bar[mdev->bypass_bar_idx] +
+		engine->bypass_offset;
+}
+
+/*
+ * push a burst of descriptor words into the bypass port, the engine lock is
+ * not needed here as the port is independent of the SGDMA completion path
+ */
+static void bypass_burst_write(struct mdlx_engine *engine,
+		void __iomem *port, const void *data, size_t len)
+{
+	spin_lock(&engine->bypass_lock);
+	iowrite32_rep(port, data, len / sizeof(u32));
+	spin_unlock(&engine->bypass_lock);
+}
+
 static ssize_t char_bypass_write(struct file *file, const char __user *buf,
 		size_t count, loff_t *pos)
 {
 	struct mdlx_dev *mdev;
 	struct mdlx_engine *engine;
 	struct mdlx_cdev *xcdev = (struct mdlx_cdev *)file->private_data;
-
-	u32 desc_data;
+	u32 small[BYPASS_BURST_SMALL / sizeof(u32)];
+	void *bounce = small;
 	void __iomem *bypass_addr;
 	size_t buf_offset = 0;
+	size_t len;
 	int rc = 0;
-	int copy_err;
 
 	rc = xcdev_check(__func__, xcdev, 1);
 	if (rc < 0)
@@ -149,34 +180,124 @@ static ssize_t char_bypass_write(struct file *file, const char __user *buf,
 
 	dbg_sg("In %s()\n", __func__);
 
-	spin_lock(&engine->lock);
+	if (count > BYPASS_BURST_SMALL) {
+		bounce = kmalloc(min_t(size_t, count, BYPASS_BURST_MAX),
+				GFP_KERNEL);
+		if (!bounce)
+			return -ENOMEM;
+	}
 
 	/* Write descriptor data to the bypass BAR */
-	bypass_addr = mdev->bar[mdev->bypass_bar_idx];
-	bypass_addr = (void __iomem *)(
-			(u32 __iomem *)bypass_addr + engine->bypass_offset
-			);
+	bypass_addr = bypass_port(mdev, engine);
 	while (buf_offset < count) {
-		copy_err = copy_from_user(&desc_data, &buf[buf_offset],
-			sizeof(u32));
-		if (!copy_err) {
-			write_register(desc_data, bypass_addr,
-					bypass_addr - engine->bypass_offset);
-			buf_offset += sizeof(u32);
-			rc = buf_offset;
-		} else {
+		len = min_t(size_t, count - buf_offset, BYPASS_BURST_MAX);
+		if (copy_from_user(bounce, &buf[buf_offset], len)) {
 			dbg_sg("Error reading data from userspace buffer\n");
 			rc = -EINVAL;
 			break;
 		}
+		bypass_burst_write(engine, bypass_addr, bounce, len);
+		buf_offset += len;
 	}
 
-	spin_unlock(&engine->lock);
+	if (bounce != small)
+		kfree(bounce);
 
+	return buf_offset ? buf_offset : rc;
+}
 
-	return rc;
+/*
+ * validate and format a batch of bypass descriptors, then write all of them
+ * to the bypass port in one burst
+ */
+static long bypass_submit_ioctl(struct mdlx_dev *mdev,
+		struct mdlx_engine *engine, unsigned long arg)
+{
+	struct mdlx_bypass_ioctl batch;
+	struct mdlx_bypass_desc *ents;
+	struct mdlx_desc *desc;
+	u32 i;
+	long rv = 0;
+
+	if (copy_from_user(&batch, (void __user *)arg, sizeof(batch)))
+		return -EFAULT;
+	if (!batch.count || batch.count > MDLX_BYPASS_BATCH_MAX) {
+		pr_err("bypass batch count %u invalid, max %u.\n",
+			batch.count, MDLX_BYPASS_BATCH_MAX);
+		return -EINVAL;
+	}
+
+	ents = memdup_user((void __user *)(unsigned long)batch.desc,
+			batch.count * sizeof(*ents));
+	if (IS_ERR(ents))
+		return PTR_ERR(ents);
+
+	desc = kmalloc_array(batch.count, sizeof(*desc), GFP_KERNEL);
+	if (!desc) {
+		rv = -ENOMEM;
+		goto free_ents;
+	}
+
+	for (i = 0; i < batch.count; i++) {
+		if (!ents[i].len || ents[i].len > MDLX_DESC_BLEN_MAX ||
+		    (ents[i].control & ~MDLX_BYPASS_CTRL_MASK)) {
+			pr_err("%s, bypass desc %u invalid, len 0x%x, ctrl 0x%x.\n",
+				engine->name, i, ents[i].len, ents[i].control);
+			/* the batch is checked whole before any write */
+			batch.done = 0;
+			rv = -EINVAL;
+			goto out;
+		}
+		desc[i].control = cpu_to_le32(DESC_MAGIC | ents[i].control);
+		desc[i].bytes = cpu_to_le32(ents[i].len);
+		desc[i].src_addr_lo = cpu_to_le32(PCI_DMA_L(ents[i].src_addr));
+		desc[i].src_addr_hi = cpu_to_le32(PCI_DMA_H(ents[i].src_addr));
+		desc[i].dst_addr_lo = cpu_to_le32(PCI_DMA_L(ents[i].dst_addr));
+		desc[i].dst_addr_hi = cpu_to_le32(PCI_DMA_H(ents[i].dst_addr));
+		desc[i].next_lo = 0;
+		desc[i].next_hi = 0;
+	}
+
+	bypass_burst_write(engine, bypass_port(mdev, engine), desc,
+			batch.count * sizeof(*desc));
+	batch.done = batch.count;
+
+out:
+	if (copy_to_user((void __user *)arg, &batch, sizeof(batch)))
+		rv = -EFAULT;
+	kfree(desc);
+free_ents:
+	kfree(ents);
+	return rv;
 }
 
+static long char_bypass_ioctl(struct file *file, unsigned int cmd,
+		unsigned long arg)
+{
+	struct mdlx_cdev *xcdev = (struct mdlx_cdev *)file->private_data;
+	struct mdlx_dev *mdev;
+	struct mdlx_engine *engine;
+	int rv;
+
+	rv = xcdev_check(__func__, xcdev, 1);
+	if (rv < 0)
+		return rv;
+	mdev = xcdev->mdev;
+	engine = xcdev->engine;
+
+	if (mdev->bypass_bar_idx < 0) {
+		dbg_sg("Bypass BAR not present - unsupported operation\n");
+		return -ENODEV;
+	}
+
+	switch (cmd) {
+	case IOCTL_MDLX_BYPASS_SUBMIT:
+		return bypass_submit_ioctl(mdev, engine, arg);
+	default:
+		dbg_perf("Unsupported operation\n");
+		return -EINVAL;
+	}
+}
 
 /*
  * character device file operations for bypass operation
@@ -188,6 +309,7 @@ static const struct file_operations bypass_fops = {
 	.release = char_close,
 	.read = char_bypass_read,
 	.write = char_bypass_write,
+	.unlocked_ioctl = char_bypass_ioctl,
 	.mmap = bridge_mmap,
 };
 
@@ -20,7 +20,9 @@
 #define pr_fmt(fmt)     KBUILD_MODNAME ":%s: " fmt, __func__
 
 #include <linux/ioctl.h>
+#include <linux/ktime.h>
 #include "version.h"
+#include "libmdlx_api.h"
 #include "mdlx_cdev.h"
 #include "cdev_ctrl.h"
 
@@ -30,6 +32,124 @@
 #define xlx_access_ok(X,Y,Z) access_ok(X,Y,Z)
 #endif
 
+static unsigned int ctrl_wide_access;
+module_param(ctrl_wide_access, uint, 0644);
+MODULE_PARM_DESC(ctrl_wide_access,
+	"Set 1 to use 64-bit accesses for aligned bulk user BAR I/O, default 0");
+
+/* bytes moved through the bounce buffer per iteration */
+#define CTRL_BURST_MAX		PAGE_SIZE
+/* transfers up to this size avoid the bounce buffer allocation */
+#define CTRL_BURST_SMALL	64
+
+/*
+ * validate a register window against the BAR, returns the number of bytes
+ * that can be accessed from pos, 0 at the end of the BAR
+ */
+static ssize_t ctrl_window(struct mdlx_cdev *xcdev, loff_t pos, size_t count)
+{
+	resource_size_t len = xcdev->mdev->bar_len[xcdev->bar];
+
+	/* only 32-bit aligned and 32-bit multiples */
+	if ((pos & 3) || (count & 3))
+		return -EPROTO;
+	if (pos < 0)
+		return -EINVAL;
+	if (pos >= len)
+		return 0;
+	return min_t(resource_size_t, count, len - pos);
+}
+
+/*
+ * config BAR registers only accept 32-bit accesses, the user BAR may accept
+ * 64-bit ones when both the address and the length allow it
+ */
+static bool ctrl_access_wide(struct mdlx_cdev *xcdev, loff_t pos, size_t len)
+{
+#ifdef CONFIG_64BIT
+	return ctrl_wide_access && xcdev->bar == xcdev->mdev->user_bar_idx &&
+		!(pos & 7) && !(len & 7);
+#else
+	return false;
+#endif
+}
+
+static void ctrl_burst_read(void *buf, void __iomem *reg, size_t len,
+			bool wide)
+{
+#ifdef CONFIG_64BIT
+	if (wide) {
+		u64 *q = buf;
+
+		for (; len; len -= 8, reg += 8)
+			*q++ = readq(reg);
+		return;
+	}
+#endif
+	__ioread32_copy(buf, reg, len >> 2);
+}
+
+static void ctrl_burst_write(void __iomem *reg, const void *buf, size_t len,
+			bool wide)
+{
+	if (wide)
+		__iowrite64_copy(reg, buf, len >> 3);
+	else
+		__iowrite32_copy(reg, buf, len >> 2);
+}
+
+static long eventfd_ioctl(struct mdlx_cdev *xcdev, void __user *arg)
+{
+	struct mdlx_ioc_eventfd obj;
+	struct mdlx_dev *mdev = xcdev->mdev;
+
+	if (copy_from_user(&obj, arg, sizeof(obj)))
+		return -EFAULT;
+	if (obj.base.magic != MDLX_XCL_MAGIC) {
+		pr_err("magic 0x%x !=  MDLX_XCL_MAGIC (0x%x).\n",
+			obj.base.magic, MDLX_XCL_MAGIC);
+		return -ENOTTY;
+	}
+
+	switch (obj.type) {
+	case MDLX_EVENTFD_USER:
+		return mdlx_user_isr_eventfd(mdev, obj.index, obj.fd);
+	case MDLX_EVENTFD_H2C:
+	case MDLX_EVENTFD_C2H:
+		return mdlx_engine_eventfd(mdev, obj.index,
+				obj.type == MDLX_EVENTFD_H2C, obj.fd);
+	default:
+		pr_err("unknown eventfd type %u.\n", obj.type);
+		return -EINVAL;
+	}
+}
+
+static long restart_ioctl(struct mdlx_cdev *xcdev, void __user *arg)
+{
+	struct mdlx_ioc_restart obj;
+	struct mdlx_dev *mdev = xcdev->mdev;
+
+	if (copy_from_user(&obj, arg, sizeof(obj)))
+		return -EFAULT;
+	if (obj.base.magic != MDLX_XCL_MAGIC) {
+		pr_err("magic 0x%x !=  MDLX_XCL_MAGIC (0x%x).\n",
+			obj.base.magic, MDLX_XCL_MAGIC);
+		return -ENOTTY;
+	}
+
+	switch (obj.type) {
+	case MDLX_RESTART_DEVICE:
+		return mdlx_device_restart(mdev->pdev, mdev);
+	case MDLX_RESTART_H2C:
+	case MDLX_RESTART_C2H:
+		return mdlx_engine_restart(mdev, obj.index,
+				obj.type == MDLX_RESTART_H2C);
+	default:
+		pr_err("unknown restart type %u.\n", obj.type);
+		return -EINVAL;
+	}
+}
+
 /*
  * character device file operations for control bus (through control bridge)
  */
@@ -39,7 +159,11 @@ static ssize_t char_ctrl_read(struct file *fp, char __user *buf, size_t count,
 	struct mdlx_cdev *xcdev = (struct mdlx_cdev *)fp->private_data;
 	struct mdlx_dev *mdev;
 	void __iomem *reg;
-	u32 w;
+	u64 small[CTRL_BURST_SMALL / sizeof(u64)];
+	void *bounce = small;
+	size_t done = 0;
+	ssize_t len;
+	bool wide;
 	int rv;
 
 	rv = xcdev_check(__func__, xcdev, 0);
@@ -47,21 +171,38 @@ static ssize_t char_ctrl_read(struct file *fp, char __user *buf, size_t count,
 		return rv;
 	mdev = xcdev->mdev;
 
-	/* only 32-bit aligned and 32-bit multiples */
-	if (*pos & 3)
-		return -EPROTO;
+	len = ctrl_window(xcdev, *pos, count);
+	if (len <= 0)
+		return len;
+	count = len;
+	wide = ctrl_access_wide(xcdev, *pos, count);
+
+	if (count > CTRL_BURST_SMALL) {
+		bounce = kmalloc(min_t(size_t, count, CTRL_BURST_MAX),
+				GFP_KERNEL);
+		if (!bounce)
+			return -ENOMEM;
+	}
+
 	/* first address is BAR base plus file position offset */
 	reg = mdev->bar[xcdev->bar] + *pos;
-	//w = read_register(reg);
-	w = ioread32(reg);
-	dbg_sg("%s(@%p, count=%ld, pos=%d) value = 0x%08x\n",
-			__func__, reg, (long)count, (int)*pos, w);
-	rv = copy_to_user(buf, &w, 4);
-	if (rv)
-		dbg_sg("Copy to userspace failed but continuing\n");
+	while (done < count) {
+		len = min_t(size_t, count - done, CTRL_BURST_MAX);
+		ctrl_burst_read(bounce, reg + done, len, wide);
+		if (copy_to_user(buf + done, bounce, len)) {
+			rv = -EFAULT;
+			break;
+		}
+		done += len;
+	}
+	dbg_sg("%s(@%p, count=%ld, pos=%d) done %ld\n",
+			__func__, reg, (long)count, (int)*pos, (long)done);
 
-	*pos += 4;
-	return 4;
+	if (bounce != small)
+		kfree(bounce);
+
+	*pos += done;
+	return done ? done : rv;
 }
 
 static ssize_t char_ctrl_write(struct file *file, const char __user *buf,
@@ -70,7 +211,11 @@ static ssize_t char_ctrl_write(struct file *file, const char __user *buf,
 	struct mdlx_cdev *xcdev = (struct mdlx_cdev *)file->private_data;
 	struct mdlx_dev *mdev;
 	void __iomem *reg;
-	u32 w;
+	u64 small[CTRL_BURST_SMALL / sizeof(u64)];
+	void *bounce = small;
+	size_t done = 0;
+	ssize_t len;
+	bool wide;
 	int rv;
 
 	rv = xcdev_check(__func__, xcdev, 0);
@@ -78,22 +223,140 @@ static ssize_t char_ctrl_write(struct file *file, const char __user *buf,
 		return rv;
 	mdev = xcdev->mdev;
 
-	/* only 32-bit aligned and 32-bit multiples */
-	if (*pos & 3)
-		return -EPROTO;
+	len = ctrl_window(xcdev, *pos, count);
+	if (len < 0)
+		return len;
+	if (!len)
+		return count ? -ENOSPC : 0;
+	count = len;
+	wide = ctrl_access_wide(xcdev, *pos, count);
+
+	if (count > CTRL_BURST_SMALL) {
+		bounce = kmalloc(min_t(size_t, count, CTRL_BURST_MAX),
+				GFP_KERNEL);
+		if (!bounce)
+			return -ENOMEM;
+	}
 
 	/* first address is BAR base plus file position offset */
 	reg = mdev->bar[xcdev->bar] + *pos;
-	rv = copy_from_user(&w, buf, 4);
-	if (rv)
-		pr_info("copy from user failed %d/4, but continuing.\n", rv);
-
-	dbg_sg("%s(0x%08x @%p, count=%ld, pos=%d)\n",
-			__func__, w, reg, (long)count, (int)*pos);
-	//write_register(w, reg);
-	iowrite32(w, reg);
-	*pos += 4;
-	return 4;
+	while (done < count) {
+		len = min_t(size_t, count - done, CTRL_BURST_MAX);
+		if (copy_from_user(bounce, buf + done, len)) {
+			rv = -EFAULT;
+			break;
+		}
+		ctrl_burst_write(reg + done, bounce, len, wide);
+		done += len;
+	}
+	dbg_sg("%s(@%p, count=%ld, pos=%d) done %ld\n",
+			__func__, reg, (long)count, (int)*pos, (long)done);
+
+	if (bounce != small)
+		kfree(bounce);
+
+	*pos += done;
+	return done ? done : rv;
+}
+
+/* poll until (reg & mask) == (value & mask), *last is the final read */
+static int ctrl_reg_wait(void __iomem *reg, u32 mask, u32 value,
+		unsigned int timeout_us, u32 *last)
+{
+	ktime_t expires = ktime_add_us(ktime_get(), timeout_us);
+
+	for (;;) {
+		*last = ioread32(reg);
+		if ((*last & mask) == (value & mask))
+			return 0;
+		if (ktime_after(ktime_get(), expires))
+			return -ETIMEDOUT;
+		if (signal_pending(current))
+			return -ERESTARTSYS;
+		usleep_range(2, 10);
+	}
+}
+
+static int reg_op_wait(void __iomem *reg, struct mdlx_ioc_reg_op *op,
+			unsigned int timeout_us)
+{
+	return ctrl_reg_wait(reg, op->mask, op->value, timeout_us, &op->value);
+}
+
+/* apply a list of register operations to the BAR in a single call */
+static long reg_batch_ioctl(struct mdlx_cdev *xcdev, void __user *arg)
+{
+	struct mdlx_ioc_reg_batch batch;
+	struct mdlx_ioc_reg_op *ops;
+	struct mdlx_dev *mdev = xcdev->mdev;
+	void __user *uops;
+	void __iomem *base = mdev->bar[xcdev->bar];
+	resource_size_t bar_len = mdev->bar_len[xcdev->bar];
+	unsigned int i;
+	long rv = 0;
+
+	if (copy_from_user(&batch, arg, sizeof(batch)))
+		return -EFAULT;
+	if (batch.base.magic != MDLX_XCL_MAGIC) {
+		pr_err("magic 0x%x !=  MDLX_XCL_MAGIC (0x%x).\n",
+			batch.base.magic, MDLX_XCL_MAGIC);
+		return -ENOTTY;
+	}
+	if (!batch.count || batch.count > MDLX_REG_BATCH_MAX) {
+		pr_err("invalid batch count %u, max %u.\n",
+			batch.count, MDLX_REG_BATCH_MAX);
+		return -EINVAL;
+	}
+
+	uops = (void __user *)(unsigned long)batch.ops;
+	ops = memdup_user(uops, batch.count * sizeof(*ops));
+	if (IS_ERR(ops))
+		return PTR_ERR(ops);
+
+	for (i = 0; i < batch.count; i++) {
+		struct mdlx_ioc_reg_op *op = ops + i;
+		void __iomem *reg = base + op->offset;
+		u32 w;
+
+		if ((op->offset & 3) || (u64)op->offset + 4 > bar_len) {
+			pr_err("op %u, bad offset 0x%x, BAR len 0x%llx.\n",
+				i, op->offset, (u64)bar_len);
+			rv = -EINVAL;
+			break;
+		}
+
+		switch (op->op) {
+		case MDLX_REG_OP_READ:
+			op->value = ioread32(reg);
+			break;
+		case MDLX_REG_OP_WRITE:
+			iowrite32(op->value, reg);
+			break;
+		case MDLX_REG_OP_RMW:
+			w = ioread32(reg);
+			w = (w & ~op->mask) | (op->value & op->mask);
+			iowrite32(w, reg);
+			op->value = w;
+			break;
+		case MDLX_REG_OP_WAIT:
+			rv = reg_op_wait(reg, op, batch.timeout_us);
+			break;
+		default:
+			pr_err("op %u, unknown op %u.\n", i, op->op);
+			rv = -EINVAL;
+			break;
+		}
+		if (rv)
+			break;
+	}
+	batch.done = i;
+
+	if (copy_to_user(uops, ops, batch.count * sizeof(*ops)) ||
+	    copy_to_user(arg, &batch, sizeof(batch)))
+		rv = -EFAULT;
+
+	kfree(ops);
+	return rv;
 }
 
 static long version_ioctl(struct mdlx_cdev *xcdev, void __user *arg)
@@ -124,6 +387,218 @@ static long version_ioctl(struct mdlx_cdev *xcdev, void __user *arg)
 	return 0;
 }
 
+/*
+ * write, wait, read jobs
+ *
+ * The ioctl thread writes job N, waits for its completion condition and pins
+ * its read back buffer; the read back itself runs on a worker, so it overlaps
+ * the write of job N + 1 on the other direction's channels.
+ */
+struct mdlx_job_read {
+	struct work_struct work;
+	struct mdlx_dev *mdev;
+	struct mdlx_io_cb cb;
+	unsigned int timeout_ms;
+	ssize_t res;
+};
+
+/*
+ * job->timeout_ms covers each transfer and the wait of a job, clamped so the
+ * register wait still counts it in unsigned int microseconds
+ */
+static unsigned int job_timeout_ms(struct mdlx_job *job)
+{
+	unsigned int ms = job->timeout_ms ? job->timeout_ms :
+					    sgdma_timeout * 1000;
+
+	return min_t(unsigned int, ms, UINT_MAX / USEC_PER_MSEC);
+}
+
+static void job_read_work(struct work_struct *work)
+{
+	struct mdlx_job_read *jr = container_of(work, struct mdlx_job_read,
+						work);
+
+	jr->res = mdlx_xfer_submit(jr->mdev, jr->mdev->c2h_channel_max, false,
+				   jr->cb.ep_addr, &jr->cb.sgt, false,
+				   jr->timeout_ms);
+	/* -EREMOTEIO: the engine did not stop and still owns the pages */
+	if (jr->res != -EREMOTEIO)
+		char_sgdma_unmap_user_buf(&jr->cb, false);
+}
+
+static ssize_t job_xfer(struct mdlx_dev *mdev, struct mdlx_io_cb *cb, u64 buf,
+			u64 len, u64 ep_addr, bool write,
+			unsigned int timeout_ms)
+{
+	int rv;
+
+	memset(cb, 0, sizeof(struct mdlx_io_cb));
+	cb->buf = (char __user *)(unsigned long)buf;
+	cb->len = len;
+	cb->ep_addr = ep_addr;
+	cb->write = write;
+	rv = char_sgdma_map_user_buf_to_sgl(cb, write);
+	if (rv < 0)
+		return rv;
+	if (!write)
+		return 0;
+
+	/* channel_max picks the least loaded channel */
+	rv = mdlx_xfer_submit(mdev, mdev->h2c_channel_max, true, ep_addr,
+			      &cb->sgt, false, timeout_ms);
+	if (rv != -EREMOTEIO)
+		char_sgdma_unmap_user_buf(cb, true);
+	return rv;
+}
+
+static int job_wait(struct mdlx_dev *mdev, struct mdlx_job *job,
+		    u64 irq_count)
+{
+	unsigned int timeout_ms = job_timeout_ms(job);
+	u32 last;
+
+	switch (job->wait) {
+	case MDLX_JOB_WAIT_NONE:
+		return 0;
+	case MDLX_JOB_WAIT_IRQ:
+		return mdlx_user_irq_wait(mdev, job->irq, irq_count,
+					  timeout_ms);
+	case MDLX_JOB_WAIT_REG:
+		return ctrl_reg_wait(mdev->bar[mdev->user_bar_idx] +
+				     job->reg_offset, job->reg_mask,
+				     job->reg_value, timeout_ms * 1000, &last);
+	}
+	return -EINVAL;
+}
+
+static int job_check(struct mdlx_dev *mdev, struct mdlx_job *job)
+{
+	if (job->wait == MDLX_JOB_WAIT_IRQ && job->irq >= mdev->user_max)
+		return -EINVAL;
+	if (job->wait == MDLX_JOB_WAIT_REG &&
+	    (mdev->user_bar_idx < 0 || (job->reg_offset & 3) ||
+	     (u64)job->reg_offset + 4 > mdev->bar_len[mdev->user_bar_idx]))
+		return -EINVAL;
+	if (job->wait > MDLX_JOB_WAIT_REG)
+		return -EINVAL;
+	if (job->h2c_len > MAX_RW_COUNT || job->c2h_len > MAX_RW_COUNT)
+		return -EINVAL;
+	return 0;
+}
+
+static long job_ioctl(struct mdlx_dev *mdev, void __user *arg)
+{
+	struct mdlx_ioc_job ioc;
+	struct mdlx_job *jobs;
+	struct mdlx_job_read *reads;
+	void __user *ujobs;
+	unsigned int i, issued = 0;
+	long rv = 0;
+
+	if (copy_from_user(&ioc, arg, sizeof(ioc)))
+		return -EFAULT;
+	if (ioc.base.magic != MDLX_XCL_MAGIC) {
+		pr_err("magic 0x%x !=  MDLX_XCL_MAGIC (0x%x).\n",
+			ioc.base.magic, MDLX_XCL_MAGIC);
+		return -ENOTTY;
+	}
+	if (!ioc.count || ioc.count > MDLX_JOB_BATCH_MAX) {
+		pr_err("invalid job count %u, max %u.\n",
+			ioc.count, MDLX_JOB_BATCH_MAX);
+		return -EINVAL;
+	}
+	if (!mdev->h2c_channel_max || !mdev->c2h_channel_max)
+		return -ENODEV;
+
+	ujobs = (void __user *)(unsigned long)ioc.jobs;
+	jobs = memdup_user(ujobs, ioc.count * sizeof(*jobs));
+	if (IS_ERR(jobs))
+		return PTR_ERR(jobs);
+
+	reads = kcalloc(ioc.count, sizeof(*reads), GFP_KERNEL);
+	if (!reads) {
+		kfree(jobs);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < ioc.count; i++) {
+		struct mdlx_job *job = jobs + i;
+		struct mdlx_job_read *jr = reads + i;
+		u64 irq_count = 0;
+		ssize_t res;
+
+		INIT_WORK(&jr->work, job_read_work);
+		jr->mdev = mdev;
+		jr->timeout_ms = job_timeout_ms(job);
+		job->result = 0;
+
+		rv = job_check(mdev, job);
+		if (rv < 0) {
+			pr_err("job %u, bad wait %u, irq %u, reg 0x%x.\n",
+				i, job->wait, job->irq, job->reg_offset);
+			job->result = rv;
+			issued = i + 1;
+			break;
+		}
+		if (job->wait == MDLX_JOB_WAIT_IRQ)
+			irq_count = mdlx_user_irq_count(mdev, job->irq);
+
+		if (job->h2c_len) {
+			res = job_xfer(mdev, &jr->cb, job->h2c_buf,
+				       job->h2c_len, job->h2c_addr, true,
+				       jr->timeout_ms);
+			job->result = res;
+			if (res < 0) {
+				issued = i + 1;
+				rv = res;
+				break;
+			}
+		}
+
+		rv = job_wait(mdev, job, irq_count);
+		if (rv < 0) {
+			pr_info("job %u, wait %u failed %ld.\n", i, job->wait,
+				rv);
+			job->result = rv;
+			issued = i + 1;
+			break;
+		}
+
+		issued = i + 1;
+		if (!job->c2h_len)
+			continue;
+
+		/* pin in the caller's context, transfer on the worker */
+		rv = job_xfer(mdev, &jr->cb, job->c2h_buf, job->c2h_len,
+			      job->c2h_addr, false, jr->timeout_ms);
+		if (rv < 0) {
+			job->result = rv;
+			break;
+		}
+		queue_work(system_unbound_wq, &jr->work);
+	}
+
+	/* collect the read backs still in flight */
+	for (i = 0; i < issued; i++) {
+		if (!jobs[i].c2h_len || jobs[i].result < 0)
+			continue;
+		flush_work(&reads[i].work);
+		jobs[i].result = reads[i].res;
+		if (reads[i].res < 0 && !rv)
+			rv = reads[i].res;
+	}
+	kfree(reads);
+
+	ioc.done = issued;
+	if (copy_to_user(ujobs, jobs, issued * sizeof(*jobs)) ||
+	    copy_to_user(arg, &ioc, sizeof(ioc)))
+		rv = -EFAULT;
+	kfree(jobs);
+
+	return rv;
+}
+
 long char_ctrl_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
 	struct mdlx_cdev *xcdev = (struct mdlx_cdev *)filp->private_data;
@@ -181,6 +656,14 @@ long char_ctrl_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	case MDLX_IOCONLINE:
 		mdlx_device_online(mdev->pdev, mdev);
 		break;
+	case MDLX_IOCREGBATCH:
+		return reg_batch_ioctl(xcdev, (void __user *)arg);
+	case MDLX_IOCEVENTFD:
+		return eventfd_ioctl(xcdev, (void __user *)arg);
+	case MDLX_IOCJOB:
+		return job_ioctl(mdev, (void __user *)arg);
+	case MDLX_IOCRESTART:
+		return restart_ioctl(xcdev, (void __user *)arg);
 	default:
 		pr_err("UNKNOWN ioctl cmd 0x%x.\n", cmd);
 		return -ENOTTY;
@@ -227,9 +710,13 @@ int bridge_mmap(struct file *file, struct vm_area_struct *vma)
 		return -EINVAL;
 	/*
 	 * pages must not be cached as this would result in cache line sized
-	 * accesses to the end point
+	 * accesses to the end point. The write-combining node lets stores be
+	 * merged into full TLP payloads, user space orders them with a fence.
 	 */
-	vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+	if (xcdev->wc)
+		vma->vm_page_prot = pgprot_writecombine(vma->vm_page_prot);
+	else
+		vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
 	/*
 	 * prevent touching the pages (byte access) for swap-in,
 	 * and prevent the pages from being swapped out
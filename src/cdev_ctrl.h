@@ -51,6 +51,11 @@ enum MDLX_IOC_TYPES {
 	MDLX_IOC_INFO,
 	MDLX_IOC_OFFLINE,
 	MDLX_IOC_ONLINE,
+	MDLX_IOC_REG_BATCH,
+	MDLX_IOC_EVENT_COALESCE,
+	MDLX_IOC_EVENTFD,
+	MDLX_IOC_JOB,
+	MDLX_IOC_RESTART,
 	MDLX_IOC_MAX
 };
 
@@ -74,11 +79,128 @@ struct mdlx_ioc_info {
 	unsigned char		func;
 };
 
+/* register batch operations, applied in order */
+enum mdlx_reg_ops {
+	MDLX_REG_OP_READ,	/* value = reg */
+	MDLX_REG_OP_WRITE,	/* reg = value */
+	MDLX_REG_OP_RMW,	/* reg = (reg & ~mask) | (value & mask) */
+	MDLX_REG_OP_WAIT,	/* wait until (reg & mask) == (value & mask) */
+};
+
+struct mdlx_ioc_reg_op {
+	unsigned int		offset;	/* byte offset into the BAR */
+	unsigned int		value;	/* value read back for READ/RMW/WAIT */
+	unsigned int		mask;
+	unsigned int		op;	/* enum mdlx_reg_ops */
+};
+
+#define MDLX_REG_BATCH_MAX	1024
+
+struct mdlx_ioc_reg_batch {
+	struct mdlx_ioc_base	base;
+	unsigned int		count;		/* number of ops */
+	unsigned int		done;		/* ops completed on return */
+	unsigned int		timeout_us;	/* per MDLX_REG_OP_WAIT */
+	unsigned int		reserved;
+	unsigned long long	ops;		/* struct mdlx_ioc_reg_op[] */
+};
+
+/*
+ * returned by read() on the events device when the buffer is large enough,
+ * a 4-byte read returns the event count only
+ */
+struct mdlx_event_info {
+	unsigned long long	count;		/* IRQs since the last read */
+	unsigned long long	first_ns;	/* CLOCK_MONOTONIC, first IRQ */
+	unsigned long long	last_ns;	/* CLOCK_MONOTONIC, last IRQ */
+};
+
+struct mdlx_ioc_event_coalesce {
+	struct mdlx_ioc_base	base;
+	unsigned int		count;	/* wake after this many IRQs */
+	unsigned int		usecs;	/* or this long after the first */
+};
+
+enum mdlx_eventfd_types {
+	MDLX_EVENTFD_USER,	/* user interrupt, index is the irq number */
+	MDLX_EVENTFD_H2C,	/* request completion, index is the channel */
+	MDLX_EVENTFD_C2H,
+};
+
+struct mdlx_ioc_eventfd {
+	struct mdlx_ioc_base	base;
+	int			fd;	/* eventfd, < 0 to unbind */
+	unsigned int		type;	/* enum mdlx_eventfd_types */
+	unsigned int		index;
+};
+
+enum mdlx_restart_types {
+	MDLX_RESTART_DEVICE,	/* all engines, index is ignored */
+	MDLX_RESTART_H2C,	/* one engine, index is the channel */
+	MDLX_RESTART_C2H,
+};
+
+struct mdlx_ioc_restart {
+	struct mdlx_ioc_base	base;
+	unsigned int		type;	/* enum mdlx_restart_types */
+	unsigned int		index;
+};
+
+/* what a job waits for between its card write and its read back */
+enum mdlx_job_waits {
+	MDLX_JOB_WAIT_NONE,
+	MDLX_JOB_WAIT_IRQ,	/* a user interrupt raised after the write */
+	MDLX_JOB_WAIT_REG,	/* (user BAR reg & mask) == (value & mask) */
+};
+
+/*
+ * one write, wait, read round trip; the write and read use the least loaded
+ * SGDMA channel of their direction
+ */
+struct mdlx_job {
+	unsigned long long	h2c_buf;	/* written to the card */
+	unsigned long long	h2c_len;	/* 0 skips the write */
+	unsigned long long	h2c_addr;
+	unsigned long long	c2h_buf;	/* read back from the card */
+	unsigned long long	c2h_len;	/* 0 skips the read */
+	unsigned long long	c2h_addr;
+	unsigned int		wait;		/* enum mdlx_job_waits */
+	unsigned int		irq;		/* user interrupt, WAIT_IRQ */
+	unsigned int		reg_offset;	/* user BAR offset, WAIT_REG */
+	unsigned int		reg_mask;
+	unsigned int		reg_value;
+	unsigned int		timeout_ms;	/* per transfer and wait */
+	long long		result;		/* out: bytes read, written if no
+						 * read, or -errno */
+};
+
+#define MDLX_JOB_BATCH_MAX	64
+
+/*
+ * jobs run in order, the read back of a job overlaps the write of the next
+ */
+struct mdlx_ioc_job {
+	struct mdlx_ioc_base	base;
+	unsigned int		count;		/* number of jobs */
+	unsigned int		done;		/* out: jobs with a result */
+	unsigned long long	jobs;		/* struct mdlx_job[] */
+};
+
 /* IOCTL codes */
 #define MDLX_IOCINFO		_IOWR(MDLX_IOC_MAGIC, MDLX_IOC_INFO, \
 					struct mdlx_ioc_info)
 #define MDLX_IOCOFFLINE		_IO(MDLX_IOC_MAGIC, MDLX_IOC_OFFLINE)
 #define MDLX_IOCONLINE		_IO(MDLX_IOC_MAGIC, MDLX_IOC_ONLINE)
+#define MDLX_IOCREGBATCH	_IOWR(MDLX_IOC_MAGIC, MDLX_IOC_REG_BATCH, \
+					struct mdlx_ioc_reg_batch)
+#define MDLX_IOCEVENTCOAL	_IOW(MDLX_IOC_MAGIC, MDLX_IOC_EVENT_COALESCE, \
+					struct mdlx_ioc_event_coalesce)
+#define MDLX_IOCEVENTFD		_IOW(MDLX_IOC_MAGIC, MDLX_IOC_EVENTFD, \
+					struct mdlx_ioc_eventfd)
+#define MDLX_IOCJOB		_IOWR(MDLX_IOC_MAGIC, MDLX_IOC_JOB, \
+					struct mdlx_ioc_job)
+#define MDLX_IOCRESTART		_IOW(MDLX_IOC_MAGIC, MDLX_IOC_RESTART, \
+					struct mdlx_ioc_restart)
 
 #define IOCTL_MDLX_ADDRMODE_SET	_IOW('q', 4, int)
 #define IOCTL_MDLX_ADDRMODE_GET	_IOR('q', 5, int)
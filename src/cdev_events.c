@@ -19,7 +19,9 @@
 
 #define pr_fmt(fmt)     KBUILD_MODNAME ":%s: " fmt, __func__
 
+#include "libmdlx_api.h"
 #include "mdlx_cdev.h"
+#include "cdev_ctrl.h"
 
 /*
  * character device file operations for events
@@ -30,6 +32,7 @@ static ssize_t char_events_read(struct file *file, char __user *buf,
 	int rv;
 	struct mdlx_user_irq *user_irq;
 	struct mdlx_cdev *xcdev = (struct mdlx_cdev *)file->private_data;
+	struct mdlx_event_info info;
 	u32 events_user;
 	unsigned long flags;
 
@@ -42,7 +45,7 @@ static ssize_t char_events_read(struct file *file, char __user *buf,
 		return -EINVAL;
 	}
 
-	if (count != 4)
+	if (count != 4 && count < sizeof(info))
 		return -EPROTO;
 
 	if (*pos & 3)
@@ -63,15 +66,52 @@ static ssize_t char_events_read(struct file *file, char __user *buf,
 
 	/* atomically decide which events are passed to the user */
 	spin_lock_irqsave(&user_irq->events_lock, flags);
-	events_user = user_irq->events_irq;
+	info.count = user_irq->events_cnt;
+	info.first_ns = user_irq->events_first;
+	info.last_ns = user_irq->events_last;
+	user_irq->events_cnt = 0;
 	user_irq->events_irq = 0;
 	spin_unlock_irqrestore(&user_irq->events_lock, flags);
 
-	rv = copy_to_user(buf, &events_user, 4);
+	if (count == 4) {
+		events_user = min_t(u64, info.count, U32_MAX);
+		rv = copy_to_user(buf, &events_user, 4);
+	} else {
+		count = sizeof(info);
+		rv = copy_to_user(buf, &info, count);
+	}
 	if (rv)
 		dbg_sg("Copy to user failed but continuing\n");
 
-	return 4;
+	return count;
+}
+
+static long char_events_ioctl(struct file *file, unsigned int cmd,
+		unsigned long arg)
+{
+	struct mdlx_cdev *xcdev = (struct mdlx_cdev *)file->private_data;
+	struct mdlx_ioc_event_coalesce coal;
+	int rv;
+
+	rv = xcdev_check(__func__, xcdev, 0);
+	if (rv < 0)
+		return rv;
+
+	switch (cmd) {
+	case MDLX_IOCEVENTCOAL:
+		if (copy_from_user(&coal, (void __user *)arg, sizeof(coal)))
+			return -EFAULT;
+		if (coal.base.magic != MDLX_XCL_MAGIC) {
+			pr_err("magic 0x%x !=  MDLX_XCL_MAGIC (0x%x).\n",
+				coal.base.magic, MDLX_XCL_MAGIC);
+			return -ENOTTY;
+		}
+		return mdlx_user_isr_coalesce(xcdev->mdev, 1 << xcdev->bar,
+					coal.count, coal.usecs);
+	default:
+		pr_err("UNKNOWN ioctl cmd 0x%x.\n", cmd);
+		return -ENOTTY;
+	}
 }
 
 static unsigned int char_events_poll(struct file *file, poll_table *wait)
@@ -111,6 +151,7 @@ static const struct file_operations events_fops = {
 	.release = char_close,
 	.read = char_events_read,
 	.poll = char_events_poll,
+	.unlocked_ioctl = char_events_ioctl,
 };
 
 void cdev_event_init(struct mdlx_cdev *xcdev)
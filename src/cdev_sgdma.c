@@ -40,9 +40,16 @@ unsigned int sgdma_timeout = 10;
 module_param(sgdma_timeout, uint, 0644);
 MODULE_PARM_DESC(sgdma_timeout, "timeout in seconds for sgdma, default is 10 sec.");
 
+/* transfer timeout of a node, IOCTL_MDLX_TIMEOUT_SET or sgdma_timeout */
+static unsigned int xcdev_timeout_ms(struct mdlx_cdev *xcdev)
+{
+	unsigned int timeout_ms = READ_ONCE(xcdev->timeout_ms);
+
+	return timeout_ms ? timeout_ms : sgdma_timeout * 1000;
+}
+
 
 extern struct kmem_cache *cdev_cache;
-static void char_sgdma_unmap_user_buf(struct mdlx_io_cb *cb, bool write);
 
 
 static void async_io_handler(unsigned long  cb_hndl, int err)
@@ -86,7 +93,7 @@ static void async_io_handler(unsigned long  cb_hndl, int err)
 
 	if (!err)
 		numbytes = mdlx_xfer_completion((void *)cb, mdev, engine->channel, cb->write, cb->ep_addr, &cb->sgt,
-				0, sgdma_timeout * 1000);
+				0, xcdev_timeout_ms(xcdev));
 
 	char_sgdma_unmap_user_buf(cb, cb->write);
 
@@ -245,7 +252,7 @@ static inline void mdlx_io_cb_release(struct mdlx_io_cb *cb)
 	memset(cb, 0, sizeof(*cb));
 }
 
-static void char_sgdma_unmap_user_buf(struct mdlx_io_cb *cb, bool write)
+void char_sgdma_unmap_user_buf(struct mdlx_io_cb *cb, bool write)
 {
 	int i;
 
@@ -270,7 +277,7 @@ static void char_sgdma_unmap_user_buf(struct mdlx_io_cb *cb, bool write)
 	cb->pages = NULL;
 }
 
-static int char_sgdma_map_user_buf_to_sgl(struct mdlx_io_cb *cb, bool write)
+int char_sgdma_map_user_buf_to_sgl(struct mdlx_io_cb *cb, bool write)
 {
 	struct sg_table *sgt = &cb->sgt;
 	unsigned long len = cb->len;
@@ -351,6 +358,17 @@ err_out:
 	return rv;
 }
 
+/* channel to submit on, channel_max lets libmdlx pick for the "any" nodes */
+static int sgdma_channel(struct mdlx_cdev *xcdev)
+{
+	struct mdlx_engine *engine = xcdev->engine;
+
+	if (!xcdev->any_channel)
+		return engine->channel;
+	return engine->dir == DMA_TO_DEVICE ? xcdev->mdev->h2c_channel_max :
+					      xcdev->mdev->c2h_channel_max;
+}
+
 static ssize_t char_sgdma_read_write(struct file *file, const char __user *buf,
 		size_t count, loff_t *pos, bool write)
 {
@@ -393,10 +411,12 @@ static ssize_t char_sgdma_read_write(struct file *file, const char __user *buf,
 	if (rv < 0)
 		return rv;
 
-	res = mdlx_xfer_submit(mdev, engine->channel, write, *pos, &cb.sgt,
-				0, sgdma_timeout * 1000);					// transfer
+	res = mdlx_xfer_submit(mdev, sgdma_channel(xcdev), write, *pos,
+				&cb.sgt, 0, xcdev_timeout_ms(xcdev));		// transfer
 
-	char_sgdma_unmap_user_buf(&cb, write);					// unmap
+	/* a wedged engine still owns the pages, they stay pinned */
+	if (res != -EREMOTEIO)
+		char_sgdma_unmap_user_buf(&cb, write);				// unmap
 
 	return res;
 }
@@ -474,7 +494,7 @@ static ssize_t cdev_aio_write(struct kiocb *iocb, const struct iovec *io,
 		}
 
 		rv = mdlx_xfer_submit_nowait((void *)&caio->cb[i], mdev, engine->channel, caio->cb[i].write, caio->cb[i].ep_addr, &caio->cb[i].sgt,
-									0, sgdma_timeout * 1000);
+									0, xcdev_timeout_ms(xcdev));
  	}
 
 	if (engine->cmplthp)
@@ -546,7 +566,7 @@ static ssize_t cdev_aio_read(struct kiocb *iocb, const struct iovec *io,
 		}
 
 		rv = mdlx_xfer_submit_nowait((void *)&caio->cb[i], mdev, engine->channel, caio->cb[i].write, caio->cb[i].ep_addr, &caio->cb[i].sgt,
-											0, sgdma_timeout * 1000);
+											0, xcdev_timeout_ms(xcdev));
 	}
 
 	if (engine->cmplthp)
@@ -567,6 +587,14 @@ static ssize_t cdev_read_iter(struct kiocb *iocb, struct iov_iter *io)
 }
 #endif
 
+/* number of bytes exchanged with user space for the caller's ioctl version */
+static size_t perf_ioctl_size(struct mdlx_performance_ioctl *perf)
+{
+	if (perf->version == IOCTL_MDLX_PERF_V1)
+		return MDLX_PERF_V1_SIZE;
+	return sizeof(*perf);
+}
+
 static int ioctl_do_perf_start(struct mdlx_engine *engine, unsigned long arg)
 {
 	int rv;
@@ -595,18 +623,22 @@ static int ioctl_do_perf_start(struct mdlx_engine *engine, unsigned long arg)
 	if (!engine->mdlx_perf)
 		return -ENOMEM;
 
-	rv = copy_from_user(engine->mdlx_perf,
-		(struct mdlx_performance_ioctl __user *)arg,
-		sizeof(struct mdlx_performance_ioctl));
-
-	if (rv < 0) {
+	rv = -EINVAL;
+	if (get_user(engine->mdlx_perf->version, (u32 __user *)arg)) {
 		dbg_perf("Failed to copy from user space 0x%lx\n", arg);
-		return -EINVAL;
+		goto err_out;
 	}
-	if (engine->mdlx_perf->version != IOCTL_MDLX_PERF_V1) {
+	if (engine->mdlx_perf->version != IOCTL_MDLX_PERF_V1 &&
+	    engine->mdlx_perf->version != IOCTL_MDLX_PERF_V2) {
 		dbg_perf("Unsupported IOCTL version %d\n",
 			engine->mdlx_perf->version);
-		return -EINVAL;
+		goto err_out;
+	}
+	if (copy_from_user(engine->mdlx_perf,
+			(struct mdlx_performance_ioctl __user *)arg,
+			perf_ioctl_size(engine->mdlx_perf))) {
+		dbg_perf("Failed to copy from user space 0x%lx\n", arg);
+		goto err_out;
 	}
 
 	enable_perf(engine);
@@ -618,8 +650,20 @@ static int ioctl_do_perf_start(struct mdlx_engine *engine, unsigned long arg)
 	init_waitqueue_head(&engine->mdlx_perf_wq);
 #endif
 	rv = mdlx_performance_submit(mdev, engine);
-	if (rv < 0)
+	if (rv < 0) {
 		pr_err("Failed to submit dma performance\n");
+		goto err_out;
+	}
+
+	/* report the descriptor count actually used back to V2 callers */
+	if (copy_to_user((void __user *)arg, engine->mdlx_perf,
+			perf_ioctl_size(engine->mdlx_perf)))
+		dbg_perf("Error copying result to user\n");
+	return 0;
+
+err_out:
+	kfree(engine->mdlx_perf);
+	engine->mdlx_perf = NULL;
 	return rv;
 }
 
@@ -652,10 +696,10 @@ static int ioctl_do_perf_stop(struct mdlx_engine *engine, unsigned long arg)
 	get_perf_stats(engine);
 
 	rv = copy_to_user((void __user *)arg, engine->mdlx_perf,
-			sizeof(struct mdlx_performance_ioctl));
+			perf_ioctl_size(engine->mdlx_perf));
 	if (rv) {
 		dbg_perf("Error copying result to user\n");
-		return rv;
+		rv = -EFAULT;
 	}
 
 	kfree(transfer);
@@ -663,7 +707,7 @@ static int ioctl_do_perf_stop(struct mdlx_engine *engine, unsigned long arg)
 	kfree(engine->mdlx_perf);
 	engine->mdlx_perf = NULL;
 
-	return 0;
+	return rv;
 }
 
 static int ioctl_do_perf_get(struct mdlx_engine *engine, unsigned long arg)
@@ -681,10 +725,10 @@ static int ioctl_do_perf_get(struct mdlx_engine *engine, unsigned long arg)
 		get_perf_stats(engine);
 
 		rc = copy_to_user((void __user *)arg, engine->mdlx_perf,
-			sizeof(struct mdlx_performance_ioctl));
+			perf_ioctl_size(engine->mdlx_perf));
 		if (rc) {
 			dbg_perf("Error copying result to user\n");
-			return rc;
+			return -EFAULT;
 		}
 	} else {
 		dbg_perf("engine->mdlx_perf == NULL?\n");
@@ -727,6 +771,109 @@ static int ioctl_do_align_get(struct mdlx_engine *engine, unsigned long arg)
 	return put_user(engine->addr_align, (int __user *)arg);
 }
 
+static int ioctl_do_timeout_set(struct mdlx_cdev *xcdev, unsigned long arg)
+{
+	int timeout_ms;
+	int rv;
+
+	rv = get_user(timeout_ms, (int __user *)arg);
+	if (rv < 0)
+		return rv;
+	if (timeout_ms < 0)
+		return -EINVAL;
+
+	dbg_perf("IOCTL_MDLX_TIMEOUT_SET %d\n", timeout_ms);
+	WRITE_ONCE(xcdev->timeout_ms, timeout_ms);
+	return 0;
+}
+
+static int ioctl_do_timeout_get(struct mdlx_cdev *xcdev, unsigned long arg)
+{
+	dbg_perf("IOCTL_MDLX_TIMEOUT_GET\n");
+	return put_user((int)xcdev_timeout_ms(xcdev), (int __user *)arg);
+}
+
+static void persist_cb_free(struct mdlx_io_cb *cb)
+{
+	char_sgdma_unmap_user_buf(cb, cb->write);
+	kfree(cb);
+}
+
+static int ioctl_do_persist_create(struct mdlx_cdev *xcdev,
+				   struct file *file, unsigned long arg)
+{
+	struct mdlx_engine *engine = xcdev->engine;
+	struct mdlx_persist_ioctl pi;
+	struct mdlx_io_cb *cb;
+	bool write = engine->dir == DMA_TO_DEVICE;
+	int rv;
+
+	if (copy_from_user(&pi, (void __user *)arg, sizeof(pi)))
+		return -EFAULT;
+	if (!pi.len || pi.len > MAX_RW_COUNT)
+		return -EINVAL;
+
+	rv = check_transfer_align(engine, (char __user *)(unsigned long)pi.buf,
+				  pi.len, pi.ep_addr, 1);
+	if (rv) {
+		pr_info("Invalid transfer alignment detected\n");
+		return rv;
+	}
+
+	cb = kzalloc(sizeof(*cb), GFP_KERNEL);
+	if (!cb)
+		return -ENOMEM;
+	cb->buf = (char __user *)(unsigned long)pi.buf;
+	cb->len = pi.len;
+	cb->ep_addr = pi.ep_addr;
+	cb->write = write;
+	rv = char_sgdma_map_user_buf_to_sgl(cb, write);
+	if (rv < 0) {
+		kfree(cb);
+		return rv;
+	}
+
+	rv = mdlx_persist_create(engine, cb, file);
+	if (rv < 0) {
+		persist_cb_free(cb);
+		return rv;
+	}
+
+	dbg_perf("IOCTL_MDLX_PERSIST_CREATE %d\n", rv);
+	pi.id = rv;
+	if (copy_to_user((void __user *)arg, &pi, sizeof(pi))) {
+		cb = mdlx_persist_destroy(engine, pi.id, file);
+		if (!IS_ERR(cb))
+			persist_cb_free(cb);
+		return -EFAULT;
+	}
+	return 0;
+}
+
+static long ioctl_do_persist_wait(struct mdlx_cdev *xcdev, struct file *file,
+				  unsigned long arg)
+{
+	struct mdlx_persist_ioctl pi;
+
+	if (copy_from_user(&pi, (void __user *)arg, sizeof(pi)))
+		return -EFAULT;
+
+	return mdlx_persist_wait(xcdev->engine, pi.id, file, pi.timeout_ms);
+}
+
+static int ioctl_do_persist_destroy(struct mdlx_cdev *xcdev,
+				    struct file *file, unsigned long arg)
+{
+	struct mdlx_io_cb *cb;
+
+	cb = mdlx_persist_destroy(xcdev->engine, (int)arg, file);
+	if (IS_ERR(cb))
+		return PTR_ERR(cb);
+
+	persist_cb_free(cb);
+	return 0;
+}
+
 static long char_sgdma_ioctl(struct file *file, unsigned int cmd,
 		unsigned long arg)
 {
@@ -743,6 +890,14 @@ static long char_sgdma_ioctl(struct file *file, unsigned int cmd,
 	mdev = xcdev->mdev;
 	engine = xcdev->engine;
 
+	/* engine controls and perf runs need a channel node */
+	if (xcdev->any_channel && cmd != IOCTL_MDLX_ALIGN_GET &&
+	    cmd != IOCTL_MDLX_ADDRMODE_GET && cmd != IOCTL_MDLX_TIMEOUT_SET &&
+	    cmd != IOCTL_MDLX_TIMEOUT_GET) {
+		dbg_perf("Unsupported operation on any channel node\n");
+		return -EINVAL;
+	}
+
 	switch (cmd) {
 	case IOCTL_MDLX_PERF_START:
 		rv = ioctl_do_perf_start(engine, arg);
@@ -762,6 +917,23 @@ static long char_sgdma_ioctl(struct file *file, unsigned int cmd,
 	case IOCTL_MDLX_ALIGN_GET:
 		rv = ioctl_do_align_get(engine, arg);
 		break;
+	case IOCTL_MDLX_TIMEOUT_SET:
+		rv = ioctl_do_timeout_set(xcdev, arg);
+		break;
+	case IOCTL_MDLX_TIMEOUT_GET:
+		rv = ioctl_do_timeout_get(xcdev, arg);
+		break;
+	case IOCTL_MDLX_PERSIST_CREATE:
+		rv = ioctl_do_persist_create(xcdev, file, arg);
+		break;
+	case IOCTL_MDLX_PERSIST_START:
+		rv = mdlx_persist_start(engine, (int)arg, file);
+		break;
+	case IOCTL_MDLX_PERSIST_WAIT:
+		return ioctl_do_persist_wait(xcdev, file, arg);
+	case IOCTL_MDLX_PERSIST_DESTROY:
+		rv = ioctl_do_persist_destroy(xcdev, file, arg);
+		break;
 	default:
 		dbg_perf("Unsupported operation\n");
 		rv = -EINVAL;
@@ -802,6 +974,14 @@ static int char_sgdma_close(struct inode *inode, struct file *file)
 
 	engine = xcdev->engine;
 
+	if (!xcdev->any_channel) {
+		struct mdlx_io_cb *cb;
+
+		/* the persistent transfers created through this file */
+		while (!IS_ERR(cb = mdlx_persist_destroy(engine, -1, file)))
+			persist_cb_free(cb);
+	}
+
 	if (engine->streaming && engine->dir == DMA_FROM_DEVICE) {
 		engine->device_open = 0;
 		if (engine->cyclic_req)
@@ -834,3 +1014,61 @@ void cdev_sgdma_init(struct mdlx_cdev *xcdev)
 {
 	cdev_init(&xcdev->cdev, &sgdma_fops);
 }
+
+/*
+ * card pool: one node for the module whose transfers go to the least loaded
+ * engine of all online cards, see mdlx_pool_xfer_submit()
+ */
+static long char_pool_ioctl(struct file *file, unsigned int cmd,
+		unsigned long arg)
+{
+	struct mdlx_pool_xfer px;
+	struct mdlx_io_cb cb;
+	int card = -1, channel = -1;
+	ssize_t res;
+	int rv;
+
+	if (cmd != IOCTL_MDLX_POOL_XFER) {
+		dbg_perf("Unsupported operation\n");
+		return -EINVAL;
+	}
+
+	if (copy_from_user(&px, (void __user *)arg, sizeof(px)))
+		return -EFAULT;
+	if (!px.len || px.len > MAX_RW_COUNT)
+		return -EINVAL;
+
+	memset(&cb, 0, sizeof(struct mdlx_io_cb));
+	cb.buf = (char __user *)(unsigned long)px.buf;
+	cb.len = px.len;
+	cb.ep_addr = px.ep_addr;
+	cb.write = !!px.write;
+	rv = char_sgdma_map_user_buf_to_sgl(&cb, cb.write);
+	if (rv < 0)
+		return rv;
+
+	res = mdlx_pool_xfer_submit(cb.write, px.card, px.ep_addr, &cb.sgt,
+				    px.timeout_ms ? px.timeout_ms :
+				    sgdma_timeout * 1000, &card, &channel);
+
+	/* pinned for good, like in char_sgdma_read_write() */
+	if (res != -EREMOTEIO)
+		char_sgdma_unmap_user_buf(&cb, cb.write);
+
+	px.card = card;
+	px.channel = channel;
+	if (copy_to_user((void __user *)arg, &px, sizeof(px)))
+		return -EFAULT;
+
+	return res;
+}
+
+static const struct file_operations pool_fops = {
+	.owner = THIS_MODULE,
+	.unlocked_ioctl = char_pool_ioctl,
+};
+
+void cdev_pool_init(struct cdev *cdev)
+{
+	cdev_init(cdev, &pool_fops);
+}
@@ -24,6 +24,7 @@
 
 
 #define IOCTL_MDLX_PERF_V1 (1)
+#define IOCTL_MDLX_PERF_V2 (2)
 #define MDLX_ADDRMODE_MEMORY (0)
 #define MDLX_ADDRMODE_FIXED (1)
 
@@ -56,9 +57,63 @@ struct mdlx_performance_ioctl {
 	uint64_t clock_cycle_count;
 	uint64_t data_cycle_count;
 	uint64_t pending_count;
+	/* IOCTL_MDLX_PERF_V2 and later */
+	uint32_t desc_count;	/* descriptors in the loop, 0 for default */
+	uint32_t reserved;
+	uint64_t elapsed_ns;	/* measurement: time since PERF_START */
+	uint64_t bytes;		/* measurement: bytes moved */
 };
 
+/* size of the V1 layout, V1 callers only exchange this much */
+#define MDLX_PERF_V1_SIZE	\
+	offsetof(struct mdlx_performance_ioctl, desc_count)
 
+/* control bits accepted in struct mdlx_bypass_desc */
+#define MDLX_BYPASS_CTRL_STOPPED	(1 << 0)
+#define MDLX_BYPASS_CTRL_COMPLETED	(1 << 1)
+#define MDLX_BYPASS_CTRL_EOP		(1 << 4)
+#define MDLX_BYPASS_CTRL_MASK		(MDLX_BYPASS_CTRL_STOPPED | \
+		MDLX_BYPASS_CTRL_COMPLETED | MDLX_BYPASS_CTRL_EOP)
+
+/* max. descriptors per IOCTL_MDLX_BYPASS_SUBMIT call */
+#define MDLX_BYPASS_BATCH_MAX		256
+
+struct mdlx_bypass_desc {
+	uint64_t src_addr;
+	uint64_t dst_addr;
+	uint32_t len;
+	uint32_t control;	/* MDLX_BYPASS_CTRL_* */
+};
+
+struct mdlx_bypass_ioctl {
+	uint32_t count;		/* entries in desc */
+	uint32_t done;		/* out: entries written to the bypass port */
+	uint64_t desc;		/* user pointer to struct mdlx_bypass_desc[] */
+};
+
+/* IOCTL_MDLX_POOL_XFER on /dev/mdlx_pool, served by any online card */
+struct mdlx_pool_xfer {
+	uint64_t buf;		/* user buffer */
+	uint64_t len;		/* bytes to transfer */
+	uint64_t ep_addr;	/* card address */
+	uint32_t write;		/* 1 for H2C, 0 for C2H */
+	int32_t card;		/* in: card index, -1 for any; out: card used */
+	int32_t channel;	/* out: channel used */
+	uint32_t timeout_ms;	/* 0 for the sgdma_timeout default */
+};
+
+/*
+ * IOCTL_MDLX_PERSIST_* on an SGDMA channel node: a transfer over a pinned
+ * buffer built once, then started and waited for any number of times. It
+ * belongs to the file it was created on and goes away when that is closed.
+ */
+struct mdlx_persist_ioctl {
+	uint64_t buf;		/* CREATE: user buffer, pinned until DESTROY */
+	uint64_t len;		/* CREATE: bytes to transfer */
+	uint64_t ep_addr;	/* CREATE: card address */
+	int32_t id;		/* out of CREATE, in for WAIT */
+	uint32_t timeout_ms;	/* WAIT: 0 polls, -EAGAIN while in flight */
+};
 
 /* IOCTL codes */
 
@@ -68,5 +123,15 @@ struct mdlx_performance_ioctl {
 #define IOCTL_MDLX_ADDRMODE_SET _IOW('q', 4, int)
 #define IOCTL_MDLX_ADDRMODE_GET _IOR('q', 5, int)
 #define IOCTL_MDLX_ALIGN_GET    _IOR('q', 6, int)
+#define IOCTL_MDLX_BYPASS_SUBMIT _IOWR('q', 7, struct mdlx_bypass_ioctl *)
+#define IOCTL_MDLX_POOL_XFER    _IOWR('q', 8, struct mdlx_pool_xfer *)
+/* transfer timeout of the node in ms, 0 for the sgdma_timeout default */
+#define IOCTL_MDLX_TIMEOUT_SET  _IOW('q', 9, int)
+#define IOCTL_MDLX_TIMEOUT_GET  _IOR('q', 10, int)
+/* WAIT returns the bytes transferred, START and DESTROY take the id */
+#define IOCTL_MDLX_PERSIST_CREATE _IOWR('q', 11, struct mdlx_persist_ioctl *)
+#define IOCTL_MDLX_PERSIST_START  _IOW('q', 12, int)
+#define IOCTL_MDLX_PERSIST_WAIT   _IOW('q', 13, struct mdlx_persist_ioctl *)
+#define IOCTL_MDLX_PERSIST_DESTROY _IOW('q', 14, int)
 
 #endif /* _MDLX_IOCALLS_POSIX_H_ */
@@ -25,12 +25,15 @@
 #include <linux/mm.h>
 #include <linux/errno.h>
 #include <linux/sched.h>
+#include <linux/delay.h>
+#include <linux/iopoll.h>
 #include <linux/vmalloc.h>
 
 #include "libmdlx.h"
 #include "libmdlx_api.h"
 #include "cdev_sgdma.h"
 #include "mdlx_thread.h"
+#include "mdlx_emu.h"
 
 /* SECTION: Module licensing */
 
@@ -71,8 +74,59 @@ module_param(desc_blen_max, uint, 0644);
 MODULE_PARM_DESC(desc_blen_max,
 		 "per descriptor max. buffer length, default is (1 << 28) - 1");
 
+static unsigned int xfer_cpu_affinity = 1;
+module_param(xfer_cpu_affinity, uint, 0644);
+MODULE_PARM_DESC(xfer_cpu_affinity,
+	"Set 0 to rotate, instead of preferring the submitting CPU's channel, among equally loaded channels when any channel may be used, default 1");
+
+static unsigned int irq_affinity = 1;
+module_param(irq_affinity, uint, 0444);
+MODULE_PARM_DESC(irq_affinity,
+	"Set 0 to leave the engine MSI-X vectors to irqbalance, default 1 (spread over the CPUs of the device's node)");
+
+static unsigned int perf_free_run = 1;
+module_param(perf_free_run, uint, 0644);
+MODULE_PARM_DESC(perf_free_run,
+	"Set 0 to leave the engine performance counters stopped outside of perf tests, default 1 (counting in auto mode)");
+
+static unsigned int pio_mbox_size;
+module_param(pio_mbox_size, uint, 0444);
+MODULE_PARM_DESC(pio_mbox_size,
+	"Bytes of the user BAR mailbox for small H2C writes, default 0 (no mailbox, always DMA)");
+
+static unsigned int pio_mbox_offset;
+module_param(pio_mbox_offset, uint, 0444);
+MODULE_PARM_DESC(pio_mbox_offset,
+	"User BAR offset of the mailbox, 64 byte aligned");
+
+static unsigned int pio_doorbell_offset;
+module_param(pio_doorbell_offset, uint, 0444);
+MODULE_PARM_DESC(pio_doorbell_offset,
+	"User BAR offset of the mailbox doorbell: card address low, high, then the length, whose write hands the mailbox to the card");
+
+static int pio_irq = -1;
+module_param(pio_irq, int, 0444);
+MODULE_PARM_DESC(pio_irq,
+	"User interrupt raised when the card has consumed the mailbox, default -1 (poll the length register until it reads 0)");
+
+static unsigned int pio_threshold = 4096;
+module_param(pio_threshold, uint, 0644);
+MODULE_PARM_DESC(pio_threshold,
+	"H2C writes up to this many bytes go through the mailbox when there is one, default 4096");
+
+#define PIO_DB_ADDR_LO	0x0
+#define PIO_DB_ADDR_HI	0x4
+#define PIO_DB_LEN	0x8
+/* doorbell poll interval without pio_irq, sleeps between reads */
+#define PIO_DB_POLL_US	10
+
 #define MDLX_PERF_NUM_DESC 128
 
+/* how long transfer_cancel() lets a stopped engine finish its descriptor */
+#define ENGINE_STOP_POLL_US 100
+/* a MDLX_DESC_BLEN_MAX descriptor takes about 1s on a Gen1 x1 link */
+#define ENGINE_STOP_TIMEOUT_MS 1000
+
 /* Kernel version adaptative code */
 #if KERNEL_VERSION(4, 19, 0) <= LINUX_VERSION_CODE
 /* since 4.18, using simple wait queues is not recommended 
@@ -100,6 +154,12 @@ static DEFINE_MUTEX(mdev_mutex);
 static LIST_HEAD(mdev_rcu_list);
 static DEFINE_SPINLOCK(mdev_rcu_lock);
 
+/* woken when the last pool request of a card completes */
+static DECLARE_WAIT_QUEUE_HEAD(mdev_pool_wq);
+/* rotates the pick among equally loaded engines */
+static atomic_t mdev_pool_rotor = ATOMIC_INIT(0);
+static atomic_t engine_pick_rotor = ATOMIC_INIT(0);
+
 #ifndef list_last_entry
 #define list_last_entry(ptr, type, member) list_entry((ptr)->prev, type, member)
 #endif
@@ -179,22 +239,31 @@ static inline int debug_check_dev_hndl(const char *fname, struct pci_dev *pdev,
 	return 0;
 }
 
+/* emulated devices model the config BAR registers in software */
+#ifdef __MDLX_EMU__
+#define reg_write32(v, mem)	mdlx_emu_write32(v, mem)
+#define reg_read32(mem)		mdlx_emu_read32(mem)
+#else
+#define reg_write32(v, mem)	iowrite32(v, mem)
+#define reg_read32(mem)		ioread32(mem)
+#endif
+
 #ifdef __LIBMDLX_DEBUG__
 /* SECTION: Function definitions */
 inline void __write_register(const char *fn, u32 value, void *iomem,
 			     unsigned long off)
 {
 	pr_err("%s: w reg 0x%lx(0x%p), 0x%x.\n", fn, off, iomem, value);
-	iowrite32(value, iomem);
+	reg_write32(value, iomem);
 }
 #define write_register(v, mem, off) __write_register(__func__, v, mem, off)
 #else
-#define write_register(v, mem, off) iowrite32(v, mem)
+#define write_register(v, mem, off) reg_write32(v, mem)
 #endif
 
 inline u32 read_register(void *iomem)
 {
-	return ioread32(iomem);
+	return reg_read32(iomem);
 }
 
 static inline u32 build_u32(u32 hi, u32 lo)
@@ -319,6 +388,8 @@ void enable_perf(struct mdlx_engine *engine)
 			       (unsigned long)(&engine->regs));
 	read_register(&engine->regs->identifier);
 
+	engine->perf_start_ns = ktime_get_ns();
+
 	dbg_perf("IOCTL_MDLX_PERF_START\n");
 }
 EXPORT_SYMBOL_GPL(enable_perf);
@@ -354,9 +425,53 @@ void get_perf_stats(struct mdlx_engine *engine)
 	hi = read_register(&engine->regs->perf_pnd_hi);
 	lo = read_register(&engine->regs->perf_pnd_lo);
 	engine->mdlx_perf->pending_count = build_u64(hi, lo);
+
+	if (engine->mdlx_perf->version < IOCTL_MDLX_PERF_V2)
+		return;
+
+	engine->mdlx_perf->elapsed_ns = ktime_get_ns() - engine->perf_start_ns;
+	engine->mdlx_perf->bytes = (u64)engine->mdlx_perf->iterations *
+				   engine->mdlx_perf->transfer_size;
 }
 EXPORT_SYMBOL_GPL(get_perf_stats);
 
+/*
+ * mdlx_engine_perf_sample - engine performance counters since the previous
+ * sample, for an engine counting in auto mode
+ *
+ * The counters only run while the engine is busy; a perf test clears them,
+ * the sample then restarts from zero.
+ */
+void mdlx_engine_perf_sample(struct mdlx_engine *engine,
+			     struct mdlx_perf_sample *sample)
+{
+	struct mdlx_perf_sample now;
+	unsigned long flags;
+
+	now.cycles = build_u64(read_register(&engine->regs->perf_cyc_hi),
+			       read_register(&engine->regs->perf_cyc_lo));
+	now.data = build_u64(read_register(&engine->regs->perf_dat_hi),
+			     read_register(&engine->regs->perf_dat_lo));
+	now.pending = build_u64(read_register(&engine->regs->perf_pnd_hi),
+				read_register(&engine->regs->perf_pnd_lo));
+	now.elapsed_ns = ktime_get_ns();
+
+	spin_lock_irqsave(&engine->perf_lock, flags);
+	if (now.cycles < engine->perf_last.cycles) {
+		/* cleared since the last sample */
+		engine->perf_last.cycles = 0;
+		engine->perf_last.data = 0;
+		engine->perf_last.pending = 0;
+	}
+	sample->cycles = now.cycles - engine->perf_last.cycles;
+	sample->data = now.data - engine->perf_last.data;
+	sample->pending = now.pending - engine->perf_last.pending;
+	sample->elapsed_ns = now.elapsed_ns - engine->perf_last.elapsed_ns;
+	engine->perf_last = now;
+	spin_unlock_irqrestore(&engine->perf_lock, flags);
+}
+EXPORT_SYMBOL_GPL(mdlx_engine_perf_sample);
+
 static int engine_reg_dump(struct mdlx_engine *engine)
 {
 	u32 w;
@@ -544,12 +659,12 @@ static int mdlx_engine_stop(struct mdlx_engine *engine)
 	w |= (u32)MDLX_CTRL_IE_READ_ERROR;
 	w |= (u32)MDLX_CTRL_IE_DESC_ERROR;
 
-	if (poll_mode) {
+	/* interrupt mode takes the completion count from the writeback too */
+	if (engine->poll_mode_addr_virt)
 		w |= (u32)MDLX_CTRL_POLL_MODE_WB;
-	} else {
+	if (!poll_mode) {
 		w |= (u32)MDLX_CTRL_IE_DESC_STOPPED;
 		w |= (u32)MDLX_CTRL_IE_DESC_COMPLETED;
-
 	}
 
 	dbg_tfr("Stopping SG DMA %s engine; writing 0x%08x to 0x%p.\n",
@@ -594,9 +709,9 @@ static int engine_start_mode_config(struct mdlx_engine *engine)
 	w |= (u32)MDLX_CTRL_IE_DESC_ALIGN_MISMATCH;
 	w |= (u32)MDLX_CTRL_IE_MAGIC_STOPPED;
 
-	if (poll_mode) {
+	if (engine->poll_mode_addr_virt)
 		w |= (u32)MDLX_CTRL_POLL_MODE_WB;
-	} else {
+	if (!poll_mode) {
 		w |= (u32)MDLX_CTRL_IE_DESC_STOPPED;
 		w |= (u32)MDLX_CTRL_IE_DESC_COMPLETED;
 	}
@@ -620,6 +735,59 @@ static int engine_start_mode_config(struct mdlx_engine *engine)
 	return 0;
 }
 
+/*
+ * engine_prefetch_account() - Count a chain the engine starts fetching with
+ * a first block of @adjacent descriptors, short of a full block if degraded
+ *
+ * must be called with engine->lock already acquired
+ */
+static void engine_prefetch_account(struct mdlx_engine *engine,
+				    int adjacent, int count)
+{
+	engine->prefetch_chains++;
+	if (adjacent < min(count, MDLX_DESC_SLOT_ALIGN))
+		engine->prefetch_degraded++;
+}
+
+/*
+ * engine_chain_batch() - Link up to coal_count queued transfers behind the
+ * head, so the engine runs them back to back and stops with one interrupt at
+ * the end of the last. engine_service() completes the earlier ones from the
+ * completed descriptor count.
+ *
+ * Relinks every run, a transfer may have ended an earlier, aborted batch.
+ */
+static struct mdlx_transfer *engine_chain_batch(struct mdlx_engine *engine,
+						struct mdlx_transfer *transfer)
+{
+	struct mdlx_transfer *next;
+	struct mdlx_desc *last;
+	unsigned int n = 1;
+
+	while (n < engine->coal_count &&
+	       !list_is_last(&transfer->entry, &engine->transfer_list)) {
+		next = list_next_entry(transfer, entry);
+		if (next->cyclic)
+			break;
+		last = transfer->desc_virt + transfer->desc_num - 1;
+		mdlx_desc_control_clear(last, MDLX_DESC_STOPPED |
+					MDLX_DESC_COMPLETED);
+		mdlx_desc_link(last, next->desc_virt, next->desc_bus);
+		/* fetch the next chain's first block along with it */
+		mdlx_desc_adjacent(last, next->desc_adjacent);
+		engine_prefetch_account(engine, next->desc_adjacent,
+					next->desc_num);
+		transfer = next;
+		n++;
+	}
+
+	last = transfer->desc_virt + transfer->desc_num - 1;
+	mdlx_desc_link(last, NULL, 0);
+	mdlx_desc_control_set(last, MDLX_DESC_STOPPED | MDLX_DESC_EOP |
+			      MDLX_DESC_COMPLETED);
+	return transfer;
+}
+
 /**
  * engine_start() - start an idle engine with its first transfer on queue
  *
@@ -639,6 +807,8 @@ static int engine_start_mode_config(struct mdlx_engine *engine)
 static struct mdlx_transfer *engine_start(struct mdlx_engine *engine)
 {
 	struct mdlx_transfer *transfer;
+	dma_addr_t desc_bus;
+	int desc_adjacent;
 	u32 w;
 	int extra_adj = 0;
 	int rv;
@@ -673,6 +843,12 @@ static struct mdlx_transfer *engine_start(struct mdlx_engine *engine)
 	/* engine is no longer shutdown */
 	engine->shutdown = ENGINE_SHUTDOWN_NONE;
 
+	/* interrupt mode only, the pollers read the writeback per transfer */
+	engine->run_last = transfer;
+	if (!poll_mode && !engine->cyclic_req && !engine->mdlx_perf &&
+	    !transfer->cyclic)
+		engine->run_last = engine_chain_batch(engine, transfer);
+
 	dbg_tfr("%s(%s): transfer=0x%p.\n", __func__, engine->name, transfer);
 
 	/* Add credits for Streaming mode C2H */
@@ -683,12 +859,17 @@ static struct mdlx_transfer *engine_start(struct mdlx_engine *engine)
 			}
 	}
 
-	/* initialize number of descriptors of dequeued transfers */
-	engine->desc_dequeued = 0;
+	/*
+	 * initialize number of descriptors of dequeued transfers, a transfer
+	 * restarted by transfer_cancel() resumes after its done descriptors
+	 */
+	engine->desc_dequeued = -transfer->desc_skip;
+	desc_bus = transfer->desc_bus +
+		   transfer->desc_skip * sizeof(struct mdlx_desc);
 
 	/* write lower 32-bit of bus address of transfer first descriptor */
 	// 0x4080 H2C SGDMA Descriptor Low Address	
-	w = cpu_to_le32(PCI_DMA_L(transfer->desc_bus));				// byte order change
+	w = cpu_to_le32(PCI_DMA_L(desc_bus));				// byte order change
 	dbg_tfr("iowrite32(0x%08x to 0x%p) (first_desc_lo)\n", w,
 		(void *)&engine->sgdma_regs->first_desc_lo);
 	write_register(w, &engine->sgdma_regs->first_desc_lo,
@@ -697,7 +878,7 @@ static struct mdlx_transfer *engine_start(struct mdlx_engine *engine)
 	
 	/* write upper 32-bit of bus address of transfer first descriptor */
 	// 0x4084 H2C SGDMA Descriptor High Address			   
-	w = cpu_to_le32(PCI_DMA_H(transfer->desc_bus));				// byte order change
+	w = cpu_to_le32(PCI_DMA_H(desc_bus));				// byte order change
 	dbg_tfr("iowrite32(0x%08x to 0x%p) (first_desc_hi)\n", w,
 		(void *)&engine->sgdma_regs->first_desc_hi);
 	write_register(w, &engine->sgdma_regs->first_desc_hi,
@@ -705,11 +886,18 @@ static struct mdlx_transfer *engine_start(struct mdlx_engine *engine)
 			       (unsigned long)(&engine->sgdma_regs));
 
 	// next adjacent descriptor
-	if (transfer->desc_adjacent > 0) {
-		extra_adj = transfer->desc_adjacent - 1;
+	desc_adjacent = transfer->desc_adjacent;
+	if (transfer->desc_skip)
+		desc_adjacent = mdlx_desc_ring_adjacent(
+			transfer->desc_index + transfer->desc_skip,
+			transfer->desc_num - transfer->desc_skip);
+	if (desc_adjacent > 0) {
+		extra_adj = desc_adjacent - 1;
 		if (extra_adj > MAX_EXTRA_ADJ)
 			extra_adj = MAX_EXTRA_ADJ;
 	}
+	engine_prefetch_account(engine, desc_adjacent,
+				transfer->desc_num - transfer->desc_skip);
 	dbg_tfr("iowrite32(0x%08x to 0x%p) (first_desc_adjacent)\n", extra_adj,
 		(void *)&engine->sgdma_regs->first_desc_adjacent);
 	write_register(
@@ -767,6 +955,27 @@ static int engine_service_shutdown(struct mdlx_engine *engine)
 	return 0;
 }
 
+static inline void mdlx_eventfd_signal(struct eventfd_ctx *ctx)
+{
+#if KERNEL_VERSION(6, 8, 0) <= LINUX_VERSION_CODE
+	eventfd_signal(ctx);
+#else
+	eventfd_signal(ctx, 1);
+#endif
+}
+
+/* transfer_ring_release - give the ring slots of a finished transfer back */
+static void transfer_ring_release(struct mdlx_engine *engine,
+				  struct mdlx_transfer *xfer)
+{
+	unsigned long flags;
+
+	/* also called from the aio completion, under engine->lock */
+	spin_lock_irqsave(&engine->ring_lock, flags);
+	engine->desc_used -= xfer->desc_num;
+	spin_unlock_irqrestore(&engine->ring_lock, flags);
+}
+
 static struct mdlx_transfer *engine_transfer_completion(
 		struct mdlx_engine *engine,
 		struct mdlx_transfer *transfer)
@@ -785,10 +994,17 @@ static struct mdlx_transfer *engine_transfer_completion(
 	/* awake task on transfer's wait queue */
 	xlx_wake_up(&transfer->wq);
 
+	/* its waiter is gone, nobody else gives the ring slots back */
+	if (transfer->flags & XFER_FLAG_ORPHAN)
+		transfer_ring_release(engine, transfer);
+
 	/* Send completion notification for Last transfer */
 	if (transfer->cb && transfer->last_in_request)
 		transfer->cb->io_done((unsigned long)transfer->cb, 0);
 
+	if (engine->trigger && transfer->last_in_request)
+		mdlx_eventfd_signal(engine->trigger);
+
 	return transfer;
 }
 
@@ -1305,6 +1521,16 @@ static int engine_service(struct mdlx_engine *engine, int desc_writeback)
 			pr_err("Failed to read engine status\n");
 			return rv;
 		}
+	} else if (!poll_mode) {
+		/*
+		 * the completion came from the writeback, clear the status
+		 * bits raising the interrupt with a posted write instead
+		 */
+		write_register(MDLX_STAT_DESC_STOPPED |
+			       MDLX_STAT_DESC_COMPLETED |
+			       MDLX_STAT_IDLE_STOPPED, &engine->regs->status,
+			       (unsigned long)(&engine->regs->status) -
+				       (unsigned long)(&engine->regs));
 	}
 
 	/*
@@ -1362,7 +1588,7 @@ static int engine_service(struct mdlx_engine *engine, int desc_writeback)
 	transfer = engine_service_final_transfer(engine, transfer, &desc_count);
 
 	/* Before starting engine again, clear the writeback data */
-	if (poll_mode) {
+	if (engine->poll_mode_addr_virt) {
 		wb_data = (struct mdlx_poll_wb *)engine->poll_mode_addr_virt;
 		wb_data->completed_desc_count = 0;
 	}
@@ -1375,6 +1601,30 @@ static int engine_service(struct mdlx_engine *engine, int desc_writeback)
 	return rv;
 }
 
+/*
+ * engine_irq_writeback - completed descriptor count the engine wrote back
+ * before interrupting, or 0 to have engine_service() read the registers when
+ * it does not cover the head transfer
+ */
+static u32 engine_irq_writeback(struct mdlx_engine *engine)
+{
+	struct mdlx_poll_wb *wb_data =
+		(struct mdlx_poll_wb *)engine->poll_mode_addr_virt;
+	struct mdlx_transfer *transfer;
+	u32 desc_wb;
+
+	if (!wb_data || list_empty(&engine->transfer_list))
+		return 0;
+
+	transfer = list_first_entry(&engine->transfer_list,
+				    struct mdlx_transfer, entry);
+	desc_wb = READ_ONCE(wb_data->completed_desc_count);
+	if (!(desc_wb & WB_ERR_MASK) &&
+	    (desc_wb & WB_COUNT_MASK) < transfer->desc_num - transfer->desc_skip)
+		return 0;
+	return desc_wb;
+}
+
 /* engine_service_work */
 static void engine_service_work(struct work_struct *work)
 {
@@ -1400,7 +1650,7 @@ static void engine_service_work(struct work_struct *work)
 			goto unlock;
 		}
 	} else {
-		rv = engine_service(engine, 0);
+		rv = engine_service(engine, engine_irq_writeback(engine));
 		if (rv < 0) {
 			pr_err("Failed to service engine\n");
 			goto unlock;
@@ -1524,9 +1774,88 @@ int engine_service_poll(struct mdlx_engine *engine,
 	return rv;
 }
 
+/*
+ * engine_service_poll_try - service the engine if the writeback shows its
+ * head transfer complete or failed, without waiting for it
+ *
+ * A transfer still pending after POLL_TIMEOUT_SECONDS is serviced as is, and
+ * fails like it would in engine_service_poll().
+ *
+ * @return 1 if the engine was serviced, 0 if nothing is complete yet
+ */
+int engine_service_poll_try(struct mdlx_engine *engine)
+{
+	struct mdlx_poll_wb *wb_data =
+		(struct mdlx_poll_wb *)engine->poll_mode_addr_virt;
+	struct mdlx_transfer *transfer;
+	unsigned long flags;
+	u32 desc_wb;
+	int rv;
+
+	if (!mdlx_engine_poll_pending(engine))
+		return 0;
+
+	spin_lock_irqsave(&engine->lock, flags);
+	if (list_empty(&engine->transfer_list)) {
+		engine->poll_expires = 0;
+		if (engine->mdev->wb_area)
+			clear_bit(engine->wb_slot,
+				  &engine->mdev->wb_area->pending);
+		spin_unlock_irqrestore(&engine->lock, flags);
+		return 0;
+	}
+
+	transfer = list_first_entry(&engine->transfer_list,
+				    struct mdlx_transfer, entry);
+	desc_wb = READ_ONCE(wb_data->completed_desc_count);
+	if (!engine->cyclic_req && !(desc_wb & WB_ERR_MASK) &&
+	    desc_wb < transfer->desc_num - transfer->desc_skip) {
+		if (!engine->poll_expires) {
+			engine->poll_expires = jiffies +
+					       POLL_TIMEOUT_SECONDS * HZ;
+		} else if (time_after(jiffies, engine->poll_expires)) {
+			dbg_tfr("%s polling timeout, wb 0x%08x/0x%08x.\n",
+				engine->name, desc_wb, transfer->desc_num);
+			goto service;
+		}
+		spin_unlock_irqrestore(&engine->lock, flags);
+		return 0;
+	}
+
+service:
+	engine->poll_expires = 0;
+	if (engine->cyclic_req)
+		rv = engine_service_cyclic(engine);
+	else
+		rv = engine_service(engine, desc_wb);
+	if (list_empty(&engine->transfer_list) && engine->mdev->wb_area)
+		clear_bit(engine->wb_slot, &engine->mdev->wb_area->pending);
+	spin_unlock_irqrestore(&engine->lock, flags);
+
+	return rv < 0 ? rv : 1;
+}
+
+/* coalescing window expired, hand the pending events to the reader */
+static enum hrtimer_restart user_irq_coal_timeout(struct hrtimer *timer)
+{
+	struct mdlx_user_irq *user_irq =
+		container_of(timer, struct mdlx_user_irq, coal_timer);
+	unsigned long flags;
+
+	spin_lock_irqsave(&user_irq->events_lock, flags);
+	if (user_irq->events_cnt && !user_irq->events_irq) {
+		user_irq->events_irq = 1;
+		wake_up_interruptible(&user_irq->events_wq);
+	}
+	spin_unlock_irqrestore(&user_irq->events_lock, flags);
+
+	return HRTIMER_NORESTART;
+}
+
 static irqreturn_t user_irq_service(int irq, struct mdlx_user_irq *user_irq)
 {
 	unsigned long flags;
+	u64 now;
 
 	if (!user_irq) {
 		pr_err("Invalid user_irq\n");
@@ -1536,10 +1865,30 @@ static irqreturn_t user_irq_service(int irq, struct mdlx_user_irq *user_irq)
 	if (user_irq->handler)
 		return user_irq->handler(user_irq->user_idx, user_irq->dev);
 
+	now = ktime_get_ns();
 	spin_lock_irqsave(&(user_irq->events_lock), flags);
+	if (!user_irq->events_cnt++)
+		user_irq->events_first = now;
+	user_irq->events_last = now;
+	user_irq->events_total++;
+	wake_up_interruptible(&user_irq->total_wq);
+
+	if (user_irq->trigger)
+		mdlx_eventfd_signal(user_irq->trigger);
+
 	if (!user_irq->events_irq) {
-		user_irq->events_irq = 1;
-		wake_up_interruptible(&(user_irq->events_wq));
+		if (user_irq->coal_count ?
+		    user_irq->events_cnt >= user_irq->coal_count :
+		    !user_irq->coal_usecs) {
+			user_irq->events_irq = 1;
+			if (user_irq->coal_usecs)
+				hrtimer_try_to_cancel(&user_irq->coal_timer);
+			wake_up_interruptible(&(user_irq->events_wq));
+		} else if (user_irq->coal_usecs && user_irq->events_cnt == 1) {
+			hrtimer_start(&user_irq->coal_timer,
+				ns_to_ktime((u64)user_irq->coal_usecs *
+					NSEC_PER_USEC), HRTIMER_MODE_REL);
+		}
 	}
 	spin_unlock_irqrestore(&(user_irq->events_lock), flags);
 
@@ -1674,7 +2023,6 @@ static irqreturn_t mdlx_channel_irq(int irq, void *dev_id)
 {
 	struct mdlx_dev *mdev;
 	struct mdlx_engine *engine;
-	struct interrupt_regs *irq_regs;
 
 	dbg_irq("(irq=%d) <<<< INTERRUPT service ROUTINE\n", irq);
 	if (!dev_id) {
@@ -1691,17 +2039,16 @@ static irqreturn_t mdlx_channel_irq(int irq, void *dev_id)
 		return IRQ_NONE;
 	}
 
-	irq_regs = (struct interrupt_regs *)(mdev->bar[mdev->config_bar_idx] +
-					     MDLX_OFS_INT_CTRL);
-
-	/* Disable the interrupt for this engine */
+	/*
+	 * Disable the interrupt for this engine. The write is not flushed with
+	 * a read, an MSI-X vector is edge triggered and the bottom half is
+	 * only queued once while the write is in flight.
+	 */
 	write_register(
 		engine->interrupt_enable_mask_value,
 		&engine->regs->interrupt_enable_mask_w1c,
 		(unsigned long)(&engine->regs->interrupt_enable_mask_w1c) -
 			(unsigned long)(&engine->regs));
-	/* Dummy read to flush the above write */
-	read_register(&irq_regs->channel_int_pending);
 	/* Schedule the bottom half */
 	schedule_work(&engine->work);
 
@@ -1720,6 +2067,13 @@ static void unmap_bars(struct mdlx_dev *mdev, struct pci_dev *dev)
 {
 	int i;
 
+#ifdef __MDLX_EMU__
+	if (mdlx_emu_pdev(dev)) {
+		mdlx_emu_unmap_bars(mdev);
+		return;
+	}
+#endif
+
 	for (i = 0; i < MDLX_BAR_NUM; i++) {
 		/* is this BAR mapped? */
 		if (mdev->bar[i]) {
@@ -1727,6 +2081,7 @@ static void unmap_bars(struct mdlx_dev *mdev, struct pci_dev *dev)
 			pci_iounmap(dev, mdev->bar[i]);
 			/* mark as unmapped */
 			mdev->bar[i] = NULL;
+			mdev->bar_len[i] = 0;
 		}
 	}
 }
@@ -1742,6 +2097,7 @@ static int map_single_bar(struct mdlx_dev *mdev, struct pci_dev *dev, int idx)
 	map_len = bar_len;
 
 	mdev->bar[idx] = NULL;
+	mdev->bar_len[idx] = 0;
 
 	/* do not map BARs with length 0. Note that start MAY be 0! */
 	if (!bar_len) {
@@ -1767,6 +2123,7 @@ static int map_single_bar(struct mdlx_dev *mdev, struct pci_dev *dev, int idx)
 		pr_info("Could not map BAR %d.\n", idx);
 		return -1;
 	}
+	mdev->bar_len[idx] = map_len;
 
 	pr_info("BAR%d at 0x%llx mapped at 0x%p, length=%llu(/%llu)\n", idx,
 		(u64)bar_start, mdev->bar[idx], (u64)map_len, (u64)bar_len);
@@ -2155,6 +2512,55 @@ static void prog_irq_msix_channel(struct mdlx_dev *mdev, bool clear)
 	}
 }
 
+/*
+ * engine_irq_affinity - pin the MSI-X vector of the card's @idx'th engine to
+ * one CPU, spreading the engines of all cards over the CPUs of the card's
+ * node. The bottom half is queued on the CPU taking the interrupt, and a
+ * polled engine's completion thread is moved there.
+ */
+static void engine_irq_affinity(struct mdlx_engine *engine, int idx)
+{
+	struct mdlx_dev *mdev = engine->mdev;
+	int node = dev_to_node(&mdev->pdev->dev);
+	unsigned int ncpus = node == NUMA_NO_NODE ? num_online_cpus() :
+			     cpumask_weight(cpumask_of_node(node));
+	int cpu;
+	int rv;
+
+	engine->irq_cpu = -1;
+	if (!irq_affinity || !ncpus)
+		return;
+
+	cpu = cpumask_local_spread((mdev->idx * MDLX_WB_SLOTS + idx) % ncpus,
+				   node);
+#if KERNEL_VERSION(5, 17, 0) <= LINUX_VERSION_CODE
+	rv = irq_set_affinity_and_hint(engine->msix_irq_line, cpumask_of(cpu));
+#else
+	rv = irq_set_affinity_hint(engine->msix_irq_line, cpumask_of(cpu));
+#endif
+	if (rv) {
+		pr_info("engine %s, irq#%d affinity to cpu %d failed %d.\n",
+			engine->name, engine->msix_irq_line, cpu, rv);
+		return;
+	}
+	engine->irq_cpu = cpu;
+
+	if (poll_mode)
+		mdlx_thread_colocate(engine);
+}
+
+static void engine_irq_affinity_clear(struct mdlx_engine *engine)
+{
+	if (engine->irq_cpu < 0)
+		return;
+#if KERNEL_VERSION(5, 17, 0) <= LINUX_VERSION_CODE
+	irq_update_affinity_hint(engine->msix_irq_line, NULL);
+#else
+	irq_set_affinity_hint(engine->msix_irq_line, NULL);
+#endif
+	engine->irq_cpu = -1;
+}
+
 static void irq_msix_channel_teardown(struct mdlx_dev *mdev)
 {
 	struct mdlx_engine *engine;
@@ -2172,6 +2578,7 @@ static void irq_msix_channel_teardown(struct mdlx_dev *mdev)
 			break;
 		dbg_sg("Release IRQ#%d for engine %p\n", engine->msix_irq_line,
 		       engine);
+		engine_irq_affinity_clear(engine);
 		free_irq(engine->msix_irq_line, engine);
 	}
 
@@ -2181,6 +2588,7 @@ static void irq_msix_channel_teardown(struct mdlx_dev *mdev)
 			break;
 		dbg_sg("Release IRQ#%d for engine %p\n", engine->msix_irq_line,
 		       engine);
+		engine_irq_affinity_clear(engine);
 		free_irq(engine->msix_irq_line, engine);
 	}
 }
@@ -2218,6 +2626,7 @@ static int irq_msix_channel_setup(struct mdlx_dev *mdev)
 		}
 		pr_info("engine %s, irq#%d.\n", engine->name, vector);
 		engine->msix_irq_line = vector;
+		engine_irq_affinity(engine, i);
 	}
 
 	engine = mdev->engine_c2h;
@@ -2236,6 +2645,7 @@ static int irq_msix_channel_setup(struct mdlx_dev *mdev)
 		}
 		pr_info("engine %s, irq#%d.\n", engine->name, vector);
 		engine->msix_irq_line = vector;
+		engine_irq_affinity(engine, j);
 	}
 
 	return 0;
@@ -2360,6 +2770,12 @@ static int irq_legacy_setup(struct mdlx_dev *mdev, struct pci_dev *pdev)
 
 static void irq_teardown(struct mdlx_dev *mdev)
 {
+#ifdef __MDLX_EMU__
+	if (mdlx_emu_pdev(mdev->pdev)) {
+		mdlx_emu_irq_teardown(mdev);
+		return;
+	}
+#endif
 	if (mdev->msix_enabled) {
 		irq_msix_channel_teardown(mdev);
 		irq_msix_user_teardown(mdev);
@@ -2371,6 +2787,11 @@ static void irq_teardown(struct mdlx_dev *mdev)
 
 static int irq_setup(struct mdlx_dev *mdev, struct pci_dev *pdev)
 {
+#ifdef __MDLX_EMU__
+	/* the emulated device has no bus and no vectors to program */
+	if (mdlx_emu_pdev(pdev))
+		return mdlx_emu_irq_setup(mdev, mdlx_isr);
+#endif
 	pci_keep_intx_enabled(pdev);
 
 	if (mdev->msix_enabled) {
@@ -2435,216 +2856,13 @@ static void transfer_dump(struct mdlx_transfer *transfer)
 }
 #endif /* __LIBMDLX_DEBUG__ */
 
-/* transfer_desc_init() - Chains the descriptors as a singly-linked list
- *
- * Each descriptor's next * pointer specifies the bus address
- * of the next descriptor.
- * Terminates the last descriptor to form a singly-linked list
- *
- * @transfer Pointer to SG DMA transfers
- * @count Number of descriptors allocated in continuous PCI bus addressable
- * memory
- *
- * @return 0 on success, EINVAL on failure
+/* transfer_desc_init() - Chains the descriptors of a transfer, see
+ * mdlx_desc_chain_init()
  */
 static int transfer_desc_init(struct mdlx_transfer *transfer, int count)
 {
-	struct mdlx_desc *desc_virt = transfer->desc_virt;
-	dma_addr_t desc_bus = transfer->desc_bus;
-	int i;
-	int adj = count - 1;
-	int extra_adj;
-	u32 temp_control;
-
-	if (count > MDLX_TRANSFER_MAX_DESC) {
-		pr_err("Engine cannot transfer more than %d descriptors\n",
-		       MDLX_TRANSFER_MAX_DESC);
-		return -EINVAL;
-	}
-
-	/* create singly-linked list for SG DMA controller */
-	for (i = 0; i < count - 1; i++) {
-		/* increment bus address to next in array */
-		desc_bus += sizeof(struct mdlx_desc);
-
-		/* singly-linked list uses bus addresses */
-		desc_virt[i].next_lo = cpu_to_le32(PCI_DMA_L(desc_bus));
-		desc_virt[i].next_hi = cpu_to_le32(PCI_DMA_H(desc_bus));
-		desc_virt[i].bytes = cpu_to_le32(0);
-
-		/* any adjacent descriptors? */
-		if (adj > 0) {
-			extra_adj = adj - 1;
-			if (extra_adj > MAX_EXTRA_ADJ)
-				extra_adj = MAX_EXTRA_ADJ;
-
-			adj--;
-		} else {
-			extra_adj = 0;
-		}
-
-		temp_control = DESC_MAGIC | (extra_adj << 8);
-
-		desc_virt[i].control = cpu_to_le32(temp_control);
-	}
-	/* { i = number - 1 } */
-	/* zero the last descriptor next pointer */
-	desc_virt[i].next_lo = cpu_to_le32(0);
-	desc_virt[i].next_hi = cpu_to_le32(0);
-	desc_virt[i].bytes = cpu_to_le32(0);
-
-	temp_control = DESC_MAGIC;
-
-	desc_virt[i].control = cpu_to_le32(temp_control);
-
-	return 0;
-}
-
-/* mdlx_desc_link() - Link two descriptors
- *
- * Link the first descriptor to a second descriptor, or terminate the first.
- *
- * @first first descriptor
- * @second second descriptor, or NULL if first descriptor must be set as last.
- * @second_bus bus address of second descriptor
- */
-static void mdlx_desc_link(struct mdlx_desc *first, struct mdlx_desc *second,
-			   dma_addr_t second_bus)
-{
-	/*
-	 * remember reserved control in first descriptor, but zero
-	 * extra_adjacent!
-	 */
-	/* RTO - what's this about?  Shouldn't it be 0x0000c0ffUL? */
-	u32 control = le32_to_cpu(first->control) & 0x0000f0ffUL;
-	/* second descriptor given? */
-	if (second) {
-		/*
-		 * link last descriptor of 1st array to first descriptor of
-		 * 2nd array
-		 */
-		first->next_lo = cpu_to_le32(PCI_DMA_L(second_bus));
-		first->next_hi = cpu_to_le32(PCI_DMA_H(second_bus));
-		WARN_ON(first->next_hi);
-		/* no second descriptor given */
-	} else {
-		/* first descriptor is the last */
-		first->next_lo = 0;
-		first->next_hi = 0;
-	}
-	/* merge magic, extra_adjacent and control field */
-	control |= DESC_MAGIC;
-
-	/* write bytes and next_num */
-	first->control = cpu_to_le32(control);
-}
-
-/* mdlx_desc_adjacent -- Set how many descriptors are adjacent to this one */
-static void mdlx_desc_adjacent(struct mdlx_desc *desc, int next_adjacent)
-{
-	int extra_adj = 0;
-	/* remember reserved and control bits */
-	u32 control = le32_to_cpu(desc->control) & 0x0000f0ffUL;
-	u32 max_adj_4k = 0;
-
-	if (next_adjacent > 0) {
-		extra_adj = next_adjacent - 1;
-		if (extra_adj > MAX_EXTRA_ADJ)
-			extra_adj = MAX_EXTRA_ADJ;
-		max_adj_4k =
-			(0x1000 - ((le32_to_cpu(desc->next_lo)) & 0xFFF)) / 32 -
-			1;
-		if (extra_adj > max_adj_4k)
-			extra_adj = max_adj_4k;
-		if (extra_adj < 0) {
-			pr_warn("extra_adj<0, converting it to 0\n");
-			extra_adj = 0;
-		}
-	}
-	/* merge adjacent and control field */
-	control |= 0xAD4B0000UL | (extra_adj << 8);
-	/* write control and next_adjacent */
-	desc->control = cpu_to_le32(control);
-}
-
-/* mdlx_desc_control -- Set complete control field of a descriptor. */
-static int mdlx_desc_control_set(struct mdlx_desc *first, u32 control_field)
-{
-	/* remember magic and adjacent number */
-	u32 control = le32_to_cpu(first->control) & ~(LS_BYTE_MASK);
-
-	if (control_field & ~(LS_BYTE_MASK)) {
-		pr_err("Invalid control field\n");
-		return -EINVAL;
-	}
-	/* merge adjacent and control field */
-	control |= control_field;
-	/* write control and next_adjacent */
-	first->control = cpu_to_le32(control);
-	return 0;
-}
-
-/* mdlx_desc_clear -- Clear bits in control field of a descriptor. */
-static int mdlx_desc_control_clear(struct mdlx_desc *first, u32 clear_mask)
-{
-	/* remember magic and adjacent number */
-	u32 control = le32_to_cpu(first->control);
-
-	if (clear_mask & ~(LS_BYTE_MASK)) {
-		pr_err("Invalid clear mask\n");
-		return -EINVAL;
-	}
-
-	/* merge adjacent and control field */
-	control &= (~clear_mask);
-	/* write control and next_adjacent */
-	first->control = cpu_to_le32(control);
-	return 0;
-}
-
-/* mdlx_desc_done - recycle cache-coherent linked list of descriptors.
- *
- * @dev Pointer to pci_dev
- * @number Number of descriptors to be allocated
- * @desc_virt Pointer to (i.e. virtual address of) first descriptor in list
- * @desc_bus Bus address of first descriptor in list
- */
-static inline void mdlx_desc_done(struct mdlx_desc *desc_virt, int count)
-{
-	memset(desc_virt, 0, count * sizeof(struct mdlx_desc));
-}
-
-/* mdlx_desc() - Fill a descriptor with the transfer details
- *
- * @desc pointer to descriptor to be filled
- * @addr root complex address
- * @ep_addr end point address
- * @len number of bytes, must be a (non-negative) multiple of 4.
- * @dir, dma direction
- * is the end point address. If zero, vice versa.
- *
- * Does not modify the next pointer
- */
-static void mdlx_desc_set(struct mdlx_desc *desc, dma_addr_t rc_bus_addr,
-			  u64 ep_addr, int len, int dir)
-{
-	/* transfer length */
-	desc->bytes = cpu_to_le32(len);
-	if (dir == DMA_TO_DEVICE) {
-		/* read from root complex memory (source address) */
-		desc->src_addr_lo = cpu_to_le32(PCI_DMA_L(rc_bus_addr));
-		desc->src_addr_hi = cpu_to_le32(PCI_DMA_H(rc_bus_addr));
-		/* write to end point address (destination address) */
-		desc->dst_addr_lo = cpu_to_le32(PCI_DMA_L(ep_addr));
-		desc->dst_addr_hi = cpu_to_le32(PCI_DMA_H(ep_addr));
-	} else {
-		/* read from end point address (source address) */
-		desc->src_addr_lo = cpu_to_le32(PCI_DMA_L(ep_addr));
-		desc->src_addr_hi = cpu_to_le32(PCI_DMA_H(ep_addr));
-		/* write to root complex memory (destination address) */
-		desc->dst_addr_lo = cpu_to_le32(PCI_DMA_L(rc_bus_addr));
-		desc->dst_addr_hi = cpu_to_le32(PCI_DMA_H(rc_bus_addr));
-	}
+	return mdlx_desc_chain_init(transfer->desc_virt, transfer->desc_bus,
+				    count);
 }
 
 /*
@@ -2687,35 +2905,264 @@ static int transfer_abort(struct mdlx_engine *engine,
 	return 0;
 }
 
-/* transfer_queue() - Queue a DMA transfer on the engine
+/*
+ * engine_stop_run() - Stop the running engine where it is
  *
- * @engine DMA engine doing the transfer
- * @transfer DMA transfer submitted to the engine
+ * Waits for the descriptor in flight and clears the status of the stopped
+ * run, nothing is left to service. An engine still busy after
+ * ENGINE_STOP_POLL_US is left stopped but running, it still owns the memory
+ * of the descriptor.
  *
- * Takes and releases the engine spinlock
+ * must be called with engine->lock already acquired
+ *
+ * @return descriptors of the run completed, -EBUSY if still busy, < 0 on error
  */
-static int transfer_queue(struct mdlx_engine *engine,
-			  struct mdlx_transfer *transfer)
+static int engine_stop_run(struct mdlx_engine *engine)
 {
-	int rv = 0;
-	struct mdlx_transfer *transfer_started;
-	struct mdlx_dev *mdev;
-	unsigned long flags;
+	int i;
+	int rv;
 
-	if (!engine) {
-		pr_err("dma engine NULL\n");
-		return -EINVAL;
+	rv = mdlx_engine_stop(engine);
+	if (rv < 0)
+		return rv;
+	for (i = 0; i < ENGINE_STOP_POLL_US; i++) {
+		if (!(read_register(&engine->regs->status) & MDLX_STAT_BUSY))
+			break;
+		udelay(1);
 	}
+	if (i == ENGINE_STOP_POLL_US)
+		return -EBUSY;
 
-	if (!engine->mdev) {
-		pr_err("Invalid mdev\n");
-		return -EINVAL;
-	}
+	rv = engine_status_read(engine, 1, 0);
+	if (rv < 0)
+		return rv;
+	engine->running = 0;
+	if (engine->poll_mode_addr_virt)
+		((struct mdlx_poll_wb *)engine->poll_mode_addr_virt)
+			->completed_desc_count = 0;
 
-	if (!transfer) {
-		pr_err("%s Invalid DMA transfer\n", engine->name);
-		return -EINVAL;
-	}
+	return read_register(&engine->regs->completed_desc_count) -
+	       engine->desc_dequeued;
+}
+
+/*
+ * transfer_cancel() - Take a timed out or interrupted transfer off its engine
+ *
+ * A transfer the engine has not started is only unlinked. For one in the
+ * current run the engine is stopped: transfers it completed meanwhile are
+ * completed, possibly this one too, a partly done transfer ahead of it keeps
+ * its done descriptors in desc_skip, and the engine restarts on the rest of
+ * the queue. An engine that did not stop yet is not restarted and the
+ * transfer stays queued, see transfer_cancel_sync().
+ *
+ * must be called with engine->lock already acquired
+ *
+ * @return 1 if the run was stopped, 0 if not, < 0 on error
+ */
+static int transfer_cancel(struct mdlx_engine *engine,
+			   struct mdlx_transfer *xfer)
+{
+	struct mdlx_transfer *transfer;
+	bool queued = false;
+	bool in_run = engine->running;
+	int desc_count;
+	int rv;
+
+	list_for_each_entry(transfer, &engine->transfer_list, entry) {
+		if (transfer == xfer) {
+			queued = true;
+			break;
+		}
+		if (transfer == engine->run_last)
+			in_run = false;
+	}
+	if (!queued)
+		return 0;
+
+	if (!in_run || engine->cyclic_req || engine->mdlx_perf) {
+		list_del(&xfer->entry);
+		xfer->state = TRANSFER_STATE_ABORTED;
+		if (!in_run)
+			return 0;
+		/* cyclic and perf runs are stopped as a whole */
+		return mdlx_engine_stop(engine);
+	}
+
+	desc_count = engine_stop_run(engine);
+	if (desc_count < 0)
+		return desc_count;
+
+	while (!list_empty(&engine->transfer_list)) {
+		transfer = list_first_entry(&engine->transfer_list,
+					    struct mdlx_transfer, entry);
+		if (desc_count < transfer->desc_num) {
+			if (transfer != xfer)
+				transfer->desc_skip = desc_count;
+			break;
+		}
+		desc_count -= transfer->desc_num;
+		list_del(&transfer->entry);
+		transfer->state = TRANSFER_STATE_COMPLETED;
+		engine_transfer_completion(engine, transfer);
+		if (transfer == xfer)
+			break;
+	}
+
+	if (xfer->state == TRANSFER_STATE_SUBMITTED) {
+		list_del(&xfer->entry);
+		xfer->state = TRANSFER_STATE_ABORTED;
+	}
+
+	rv = engine_service_resume(engine);
+	return rv < 0 ? rv : 1;
+}
+
+/*
+ * transfer_cancel_sync() - Cancel a timed out or interrupted transfer
+ *
+ * The engine interrupt is masked and its bottom half flushed first, so a
+ * completion raised for a run transfer_cancel() stops is not serviced against
+ * the run restarted after it. A flushed bottom half for a run left alone is
+ * queued again. An engine still busy on a descriptor is waited for up to
+ * ENGINE_STOP_TIMEOUT_MS, then it is marked wedged and refuses transfers
+ * until restarted.
+ *
+ * Takes and releases the engine spinlock
+ *
+ * @return 0, -EREMOTEIO if the engine still owns the transfer, < 0 on error
+ */
+static int transfer_cancel_sync(struct mdlx_engine *engine,
+				struct mdlx_transfer *xfer)
+{
+	unsigned long timeout = jiffies +
+				msecs_to_jiffies(ENGINE_STOP_TIMEOUT_MS);
+	unsigned long flags;
+	bool pending = false;
+	int rv = 0;
+
+	if (!poll_mode) {
+		channel_interrupts_disable(engine->mdev, engine->irq_bitmask);
+		pending = cancel_work_sync(&engine->work);
+	}
+
+	spin_lock_irqsave(&engine->lock, flags);
+	while (xfer->state == TRANSFER_STATE_SUBMITTED) {
+		rv = transfer_cancel(engine, xfer);
+		if (rv != -EBUSY)
+			break;
+		rv = 0;
+		if (engine->wedged || time_after(jiffies, timeout)) {
+			if (!engine->wedged)
+				pr_err("%s does not stop, wedged until restarted.\n",
+				       engine->name);
+			engine->wedged = true;
+			rv = -EREMOTEIO;
+			break;
+		}
+		spin_unlock_irqrestore(&engine->lock, flags);
+		usleep_range(ENGINE_STOP_POLL_US, 2 * ENGINE_STOP_POLL_US);
+		spin_lock_irqsave(&engine->lock, flags);
+	}
+
+	if (!poll_mode) {
+		if (engine->mdev->msix_enabled)
+			write_register(
+				engine->interrupt_enable_mask_value,
+				&engine->regs->interrupt_enable_mask_w1s,
+				(unsigned long)(&engine->regs
+							 ->interrupt_enable_mask_w1s) -
+					(unsigned long)(&engine->regs));
+		channel_interrupts_enable(engine->mdev, engine->irq_bitmask);
+		if (pending && !rv)
+			schedule_work(&engine->work);
+	}
+	spin_unlock_irqrestore(&engine->lock, flags);
+
+	return rv < 0 ? rv : 0;
+}
+
+/* the first transfer held back on an idle engine waited coal_usecs */
+static enum hrtimer_restart engine_coal_timeout(struct hrtimer *timer)
+{
+	struct mdlx_engine *engine =
+		container_of(timer, struct mdlx_engine, coal_timer);
+	unsigned long flags;
+
+	spin_lock_irqsave(&engine->lock, flags);
+	if (!engine->running && !list_empty(&engine->transfer_list) &&
+	    !engine_start(engine))
+		pr_err("%s failed to start held back transfers\n",
+		       engine->name);
+	spin_unlock_irqrestore(&engine->lock, flags);
+
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * engine_coal_hold() - Keep an idle engine stopped until coal_count transfers
+ * are queued, or coal_usecs after the first of them
+ *
+ * Only aio and persistent transfers are held back. A synchronous submitter
+ * holds desc_lock until its transfer is done, so nothing would ever join it.
+ *
+ * must be called with engine->lock already acquired
+ *
+ * @return true if the engine is to stay idle for now
+ */
+static bool engine_coal_hold(struct mdlx_engine *engine)
+{
+	struct mdlx_transfer *transfer;
+	unsigned int n = 0;
+
+	if (poll_mode || engine->coal_count < 2 || !engine->coal_usecs ||
+	    engine->cyclic_req || engine->mdlx_perf)
+		return false;
+
+	list_for_each_entry(transfer, &engine->transfer_list, entry) {
+		if (++n >= engine->coal_count ||
+		    (transfer->flags & XFER_FLAG_SYNC)) {
+			hrtimer_try_to_cancel(&engine->coal_timer);
+			return false;
+		}
+	}
+
+	if (!hrtimer_active(&engine->coal_timer))
+		hrtimer_start(&engine->coal_timer,
+			      ns_to_ktime((u64)engine->coal_usecs *
+					  NSEC_PER_USEC),
+			      HRTIMER_MODE_REL);
+	return true;
+}
+
+/* transfer_queue() - Queue a DMA transfer on the engine
+ *
+ * @engine DMA engine doing the transfer
+ * @transfer DMA transfer submitted to the engine
+ *
+ * Takes and releases the engine spinlock
+ */
+static int transfer_queue(struct mdlx_engine *engine,
+			  struct mdlx_transfer *transfer)
+{
+	int rv = 0;
+	struct mdlx_transfer *transfer_started;
+	struct mdlx_dev *mdev;
+	unsigned long flags;
+
+	if (!engine) {
+		pr_err("dma engine NULL\n");
+		return -EINVAL;
+	}
+
+	if (!engine->mdev) {
+		pr_err("Invalid mdev\n");
+		return -EINVAL;
+	}
+
+	if (!transfer) {
+		pr_err("%s Invalid DMA transfer\n", engine->name);
+		return -EINVAL;
+	}
 
 	if (transfer->desc_num == 0) {
 		pr_err("%s void descriptors in the transfer list\n",
@@ -2745,13 +3192,26 @@ static int transfer_queue(struct mdlx_engine *engine,
 		goto shutdown;
 	}
 
+	/* a wedged engine keeps its run until restarted */
+	if (engine->wedged) {
+		pr_info("engine %s wedged, transfer 0x%p not queued.\n",
+			engine->name, transfer);
+		rv = -EIO;
+		goto shutdown;
+	}
+
 	/* mark the transfer as submitted */
 	transfer->state = TRANSFER_STATE_SUBMITTED;
 	/* add transfer to the tail of the engine transfer queue */
 	list_add_tail(&transfer->entry, &engine->transfer_list);
+	if (poll_mode && mdev->wb_area)
+		set_bit(engine->wb_slot, &mdev->wb_area->pending);
 
 	/* engine is idle? */
-	if (!engine->running) {
+	if (!engine->running && engine_coal_hold(engine)) {
+		dbg_tfr("transfer=0x%p held back on idle %s engine.\n",
+			transfer, engine->name);
+	} else if (!engine->running) {
 		/* start engine */
 		dbg_tfr("%s(): starting %s engine.\n", __func__, engine->name);
 		transfer_started = engine_start(engine);
@@ -2809,15 +3269,8 @@ static void engine_free_resource(struct mdlx_engine *engine)
 {
 	struct mdlx_dev *mdev = engine->mdev;
 
-	/* Release memory use for descriptor writebacks */
-	if (engine->poll_mode_addr_virt) {
-		dbg_sg("Releasing memory for descriptor writeback\n");
-		dma_free_coherent(&mdev->pdev->dev, sizeof(struct mdlx_poll_wb),
-				  engine->poll_mode_addr_virt,
-				  engine->poll_mode_bus);
-		dbg_sg("Released memory for descriptor writeback\n");
-		engine->poll_mode_addr_virt = NULL;
-	}
+	/* the writeback slot belongs to mdev->wb_area */
+	engine->poll_mode_addr_virt = NULL;
 
 	if (engine->desc) {
 		dbg_init("device %s, engine %s pre-alloc desc 0x%p,0x%llx.\n",
@@ -2839,6 +3292,47 @@ static void engine_free_resource(struct mdlx_engine *engine)
 	}
 }
 
+/* persist_unmap() - Unmap the buffer of a persistent transfer, hand it back */
+static struct mdlx_io_cb *persist_unmap(struct mdlx_engine *engine,
+					struct mdlx_persist *p)
+{
+	struct mdlx_io_cb *cb = p->cb;
+
+	if (cb && cb->sgt.nents) {
+		pci_unmap_sg(engine->mdev->pdev, cb->sgt.sgl,
+			     cb->sgt.orig_nents, engine->dir);
+		cb->sgt.nents = 0;
+	}
+	p->cb = NULL;
+
+	return cb;
+}
+
+/* persist_free() - Release what mdlx_persist_create() set up */
+static void persist_free(struct mdlx_engine *engine, struct mdlx_persist *p)
+{
+	struct mdlx_dev *mdev = engine->mdev;
+
+	persist_unmap(engine, p);
+	dma_free_coherent(&mdev->pdev->dev, p->size, p->xfer.desc_virt,
+			  p->xfer.desc_bus);
+	kfree(p);
+}
+
+/* the engine is stopped, drop the persistent transfers left behind */
+static void engine_persist_teardown(struct mdlx_engine *engine)
+{
+	struct mdlx_persist *p;
+	int id;
+
+	idr_for_each_entry(&engine->persist_idr, p, id) {
+		pr_warn("%s persistent xfer %d not destroyed.\n",
+			engine->name, id);
+		persist_free(engine, p);
+	}
+	idr_destroy(&engine->persist_idr);
+}
+
 static int engine_destroy(struct mdlx_dev *mdev, struct mdlx_engine *engine)
 {
 	if (!mdev) {
@@ -2870,6 +3364,12 @@ static int engine_destroy(struct mdlx_dev *mdev, struct mdlx_engine *engine)
 
 	if (poll_mode)
 		mdlx_thread_remove_work(engine);
+	hrtimer_cancel(&engine->coal_timer);
+
+	if (engine->trigger)
+		eventfd_ctx_put(engine->trigger);
+
+	engine_persist_teardown(engine);
 
 	/* Release memory use for descriptor writebacks */
 	engine_free_resource(engine);
@@ -2889,7 +3389,7 @@ struct mdlx_transfer *engine_cyclic_stop(struct mdlx_engine *engine)
 {
 	int rv;
 	struct mdlx_transfer *transfer = 0;
-	int size = engine->mdlx_perf->transfer_size;
+	size_t size = engine->perf_buf_size;
 
 	/* transfers on queue? */
 	if (!list_empty(&engine->transfer_list)) {
@@ -2950,11 +3450,7 @@ static int engine_writeback_setup(struct mdlx_engine *engine)
 		return -EINVAL;
 	}
 
-	/*
-	 * RTO - doing the allocation per engine is wasteful since a full page
-	 * is allocated each time - better to allocate one page for the whole
-	 * device during probe() and set per-engine offsets here
-	 */
+	/* the engine's cache line in the device writeback area */
 	writeback = (struct mdlx_poll_wb *)engine->poll_mode_addr_virt;
 	writeback->completed_desc_count = 0;
 
@@ -3001,15 +3497,16 @@ static int engine_init_regs(struct mdlx_engine *engine)
 	reg_value |= MDLX_CTRL_IE_READ_ERROR;
 	reg_value |= MDLX_CTRL_IE_DESC_ERROR;
 
-	/* if using polled mode, configure writeback address */
-	if (poll_mode) {
+	/* configure the writeback address, used in both modes */
+	if (engine->poll_mode_addr_virt) {
 		rv = engine_writeback_setup(engine);
 		if (rv) {
 			dbg_init("%s descr writeback setup failed.\n",
 				 engine->name);
 			goto fail_wb;
 		}
-	} else {
+	}
+	if (!poll_mode) {
 		/* enable the relevant completion interrupts */
 		reg_value |= MDLX_CTRL_IE_DESC_STOPPED;
 		reg_value |= MDLX_CTRL_IE_DESC_COMPLETED;
@@ -3055,16 +3552,12 @@ static int engine_alloc_resource(struct mdlx_engine *engine)
 		goto err_out;
 	}
 
-	if (poll_mode) {
-		engine->poll_mode_addr_virt =
-			dma_alloc_coherent(&mdev->pdev->dev,
-					   sizeof(struct mdlx_poll_wb),
-					   &engine->poll_mode_bus, GFP_KERNEL);
-		if (!engine->poll_mode_addr_virt) {
-			pr_warn("%s, %s poll pre-alloc writeback OOM.\n",
-				dev_name(&mdev->pdev->dev), engine->name);
-			goto err_out;
-		}
+	if (mdev->wb_area) {
+		struct mdlx_wb_slot *slot = &mdev->wb_area->slot[engine->wb_slot];
+
+		engine->poll_mode_addr_virt = (u8 *)&slot->wb;
+		engine->poll_mode_bus = mdev->wb_area_bus +
+			((u8 *)slot - (u8 *)mdev->wb_area);
 	}
 
 	if (engine->streaming && engine->dir == DMA_FROM_DEVICE) {
@@ -3098,7 +3591,17 @@ static int engine_init(struct mdlx_engine *engine, struct mdlx_dev *mdev,
 	/* set magic */
 	engine->magic = MAGIC_ENGINE;
 
+	/* engine_destroy() cancels it from here on */
+	hrtimer_init(&engine->coal_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	engine->coal_timer.function = engine_coal_timeout;
+	engine->coal_count = 1;
+	engine->irq_cpu = -1;
+	mutex_init(&engine->persist_lock);
+	idr_init(&engine->persist_idr);
+
 	engine->channel = channel;
+	engine->wb_slot = channel +
+		(dir == DMA_TO_DEVICE ? 0 : MDLX_CHANNEL_NUM_MAX);
 
 	/* engine interrupt request bit */
 	engine->irq_bitmask = (1 << MDLX_ENG_IRQ_NUM) - 1;
@@ -3141,6 +3644,11 @@ static int engine_init(struct mdlx_engine *engine, struct mdlx_dev *mdev,
 	if (rv)
 		return rv;
 
+	if (perf_free_run) {
+		enable_perf(engine);
+		engine->perf_last.elapsed_ns = engine->perf_start_ns;
+	}
+
 	if (poll_mode)
 		mdlx_thread_add_work(engine);
 
@@ -3168,52 +3676,41 @@ static int transfer_build(struct mdlx_engine *engine,
 			  struct mdlx_request_cb *req, struct mdlx_transfer *xfer, unsigned int desc_max)
 {
 	struct sw_desc *sdesc = &(req->sdesc[req->sw_desc_idx]);
-	int i = 0;
-	int j = 0;
+	int j;
 	dma_addr_t bus = xfer->res_bus;
 
-	for (; i < desc_max; i++, j++, sdesc++) {
-		dbg_desc("sw desc %d/%u: 0x%llx, 0x%x, ep 0x%llx.\n",
-			 i + req->sw_desc_idx, req->sw_desc_cnt, sdesc->addr,
-			 sdesc->len, req->ep_addr);
+	dbg_desc("sw desc %u+%u/%u, ep 0x%llx.\n", req->sw_desc_idx, desc_max,
+		 req->sw_desc_cnt, req->ep_addr);
 
-		/* fill in descriptor entry j with transfer details */
-		mdlx_desc_set(xfer->desc_virt + j, sdesc->addr, req->ep_addr,
-			      sdesc->len, xfer->dir);
-		xfer->len += sdesc->len;
+	/* fill in descriptor entries with transfer details */
+	xfer->len += mdlx_desc_build(xfer->desc_virt, sdesc, desc_max,
+				     &req->ep_addr, xfer->dir,
+				     !engine->non_incr_addr);
 
-		/* for non-inc-add mode don't increment ep_addr */
-		if (!engine->non_incr_addr)
-			req->ep_addr += sdesc->len;
-
-		if (engine->streaming && engine->dir == DMA_FROM_DEVICE) {
-				memset(xfer->res_virt + j, 0, sizeof(struct mdlx_result));
-				xfer->desc_virt[j].src_addr_lo = cpu_to_le32(PCI_DMA_L(bus));
-				xfer->desc_virt[j].src_addr_hi = cpu_to_le32(PCI_DMA_H(bus));
-				bus += sizeof(struct mdlx_result);
+	if (engine->streaming && engine->dir == DMA_FROM_DEVICE) {
+		for (j = 0; j < desc_max; j++) {
+			memset(xfer->res_virt + j, 0, sizeof(struct mdlx_result));
+			xfer->desc_virt[j].src_addr_lo = cpu_to_le32(PCI_DMA_L(bus));
+			xfer->desc_virt[j].src_addr_hi = cpu_to_le32(PCI_DMA_H(bus));
+			bus += sizeof(struct mdlx_result);
 		}
-
 	}
 	req->sw_desc_idx += desc_max;
 	return 0;
 }
 
 
-static int transfer_init(struct mdlx_engine *engine, struct mdlx_request_cb *req, struct mdlx_transfer *xfer)
+static int transfer_init(struct mdlx_engine *engine, struct mdlx_request_cb *req,
+			 struct mdlx_transfer *xfer, unsigned int desc_limit)
 {
 	unsigned int desc_max = min_t(unsigned int,
 				req->sw_desc_cnt - req->sw_desc_idx,
-				MDLX_TRANSFER_MAX_DESC);
-	unsigned int desc_align = 0;
-	int i = 0;
-	int last = 0;
-	u32 control;
+				desc_limit);
+	unsigned int desc_idx;
 	unsigned long flags;
 
 	memset(xfer, 0, sizeof(*xfer));
 
-	/* lock the engine state */
-	spin_lock_irqsave(&engine->lock, flags);
 	/* initialize wait queue */
 #if	LINUX_VERSION_CODE >= KERNEL_VERSION(4,6,0)
 	init_swait_queue_head(&xfer->wq);
@@ -3221,19 +3718,28 @@ static int transfer_init(struct mdlx_engine *engine, struct mdlx_request_cb *req
 	init_waitqueue_head(&xfer->wq);
 #endif
 
-	/* remember direction of transfer */
-	xfer->dir = engine->dir;
-	xfer->desc_virt = engine->desc + engine->desc_idx;
-	xfer->res_virt = engine->cyclic_result + engine->desc_idx;
-	xfer->desc_bus = engine->desc_bus + (sizeof(struct mdlx_desc) * engine->desc_idx);
-	xfer->res_bus = engine->cyclic_result_bus + (sizeof(struct mdlx_result) * engine->desc_idx);
-	xfer->desc_index = engine->desc_idx;
-
+	/*
+	 * reserve ring slots; only the producer side state is locked, the
+	 * descriptors are built without holding any lock as the engine does
+	 * not see them before transfer_queue()
+	 */
+	spin_lock_irqsave(&engine->ring_lock, flags);
 
 	/* TODO: Need to handle desc_used >= MDLX_TRANSFER_MAX_DESC for aio calls */
 
-	if ((engine->desc_idx + desc_max) >= MDLX_TRANSFER_MAX_DESC )
-		desc_max = MDLX_TRANSFER_MAX_DESC - engine->desc_idx;
+	desc_idx = mdlx_desc_ring_place(engine->desc_idx, desc_max);
+	desc_max = mdlx_desc_ring_span(desc_idx, desc_max);
+	engine->desc_idx = (desc_idx + desc_max) % MDLX_TRANSFER_MAX_DESC;
+	engine->desc_used += desc_max;
+	spin_unlock_irqrestore(&engine->ring_lock, flags);
+
+	/* remember direction of transfer */
+	xfer->dir = engine->dir;
+	xfer->desc_virt = engine->desc + desc_idx;
+	xfer->res_virt = engine->cyclic_result + desc_idx;
+	xfer->desc_bus = engine->desc_bus + (sizeof(struct mdlx_desc) * desc_idx);
+	xfer->res_bus = engine->cyclic_result_bus + (sizeof(struct mdlx_result) * desc_idx);
+	xfer->desc_index = desc_idx;
 
 	transfer_desc_init(xfer, desc_max);
 
@@ -3241,33 +3747,12 @@ static int transfer_init(struct mdlx_engine *engine, struct mdlx_request_cb *req
 	transfer_build(engine, req, xfer , desc_max);
 
 	/* Contiguous descriptors cannot cross PAGE boundry. Adjust max accordingly */
-	desc_align = engine->desc_idx + desc_max - 1;
-	desc_align = desc_align % 128;
-	if (desc_align < (desc_max - 1)) {
-		desc_align = desc_max - desc_align - 1;
-	}
-	else
-		desc_align = desc_max;
-
-	xfer->desc_adjacent = desc_align;
+	xfer->desc_adjacent = mdlx_desc_ring_adjacent(desc_idx, desc_max);
 
-	/* terminate last descriptor */
-	last = desc_max - 1;
-	/* stop engine, EOP for AXI ST, req IRQ on last descriptor */
-	control = MDLX_DESC_STOPPED;
-	control |= MDLX_DESC_EOP;
-	control |= MDLX_DESC_COMPLETED;
-	mdlx_desc_control_set(xfer->desc_virt + last, control);
+	/* terminate last descriptor, fill in adjacent numbers */
+	mdlx_desc_chain_terminate(xfer->desc_virt, desc_max);
 
 	xfer->desc_num = desc_max;
-	engine->desc_idx = (engine->desc_idx + desc_max) % MDLX_TRANSFER_MAX_DESC;
-	engine->desc_used += desc_max ;
-
-	/* fill in adjacent numbers */
-	for (i = 0; i < xfer->desc_num; i++)
-		mdlx_desc_adjacent(xfer->desc_virt + i, xfer->desc_num - i - 1);
-
-	spin_unlock_irqrestore(&engine->lock, flags);
 	return 0;
 }
 
@@ -3278,8 +3763,6 @@ static int transfer_init_cyclic(struct mdlx_engine *engine,
 	unsigned int desc_max =
 		min_t(unsigned int, req->sw_desc_cnt - req->sw_desc_idx,
 		      MDLX_TRANSFER_MAX_DESC);
-	int i = 0;
-	u32 control;
 	int rv;
 
 	memset(xfer, 0, sizeof(*xfer));
@@ -3308,10 +3791,7 @@ static int transfer_init_cyclic(struct mdlx_engine *engine,
 	transfer_build(engine, req, xfer, desc_max);
 
 	/* stop engine, EOP for AXI ST, req IRQ on last descriptor */
-	control = MDLX_DESC_STOPPED;
-	control |= MDLX_DESC_EOP;
-	control |= MDLX_DESC_COMPLETED;
-	rv = mdlx_desc_control_set(xfer->desc_virt + desc_max - 1, control);
+	rv = mdlx_desc_chain_terminate(xfer->desc_virt, desc_max);
 	if (rv < 0) {
 		pr_err("Failed to set desc control\n");
 		return rv;
@@ -3321,9 +3801,6 @@ static int transfer_init_cyclic(struct mdlx_engine *engine,
 	xfer->desc_adjacent = 1;
 
 	dbg_sg("transfer 0x%p has %d descriptors\n", xfer, xfer->desc_num);
-	/* fill in adjacent numbers */
-	for (i = 0; i < xfer->desc_num; i++)
-		mdlx_desc_adjacent(xfer->desc_virt + i, xfer->desc_num - i - 1);
 
 	return 0;
 }
@@ -3390,20 +3867,15 @@ static struct mdlx_request_cb *mdlx_init_request(struct sg_table *sgt,
 {
 	struct mdlx_request_cb *req;
 	struct scatterlist *sg = sgt->sgl;
-	int max = sgt->nents;
-	int extra = 0;
-	int i, j = 0;
-
-	for (i = 0; i < max; i++, sg = sg_next(sg)) {
-		unsigned int len = sg_dma_len(sg);
+	unsigned int max = 0;
+	unsigned int j = 0;
+	int i;
 
-		if (unlikely(len > desc_blen_max))
-			extra += (len + desc_blen_max - 1) / desc_blen_max;
-	}
+	for (i = 0; i < sgt->nents; i++, sg = sg_next(sg))
+		max += mdlx_sw_desc_count(sg_dma_len(sg), desc_blen_max);
 
-	dbg_tfr("ep 0x%llx, desc %u+%u.\n", ep_addr, max, extra);
+	dbg_tfr("ep 0x%llx, sg %u, desc %u.\n", ep_addr, sgt->nents, max);
 
-	max += extra;
 	req = mdlx_request_alloc(max);
 	if (!req)
 		return NULL;
@@ -3412,29 +3884,9 @@ static struct mdlx_request_cb *mdlx_init_request(struct sg_table *sgt,
 	req->ep_addr = ep_addr;
 
 	for (i = 0, sg = sgt->sgl; i < sgt->nents; i++, sg = sg_next(sg)) {
-		unsigned int tlen = sg_dma_len(sg);
-		dma_addr_t addr = sg_dma_address(sg);
-
-		req->total_len += tlen;
-		while (tlen) {
-			req->sdesc[j].addr = addr;
-			if (tlen > desc_blen_max) {
-				req->sdesc[j].len = desc_blen_max;
-				addr += desc_blen_max;
-				tlen -= desc_blen_max;
-			} else {
-				req->sdesc[j].len = tlen;
-				tlen = 0;
-			}
-			j++;
-		}
-	}
-
-	if (j > max) {
-		pr_err("Cannot transfer more than supported length %d\n",
-		       desc_blen_max);
-		mdlx_request_free(req);
-		return NULL;
+		req->total_len += sg_dma_len(sg);
+		j += mdlx_sw_desc_split(req->sdesc + j, sg_dma_address(sg),
+					sg_dma_len(sg), desc_blen_max);
 	}
 	req->sw_desc_cnt = j;
 #ifdef __LIBMDLX_DEBUG__
@@ -3443,342 +3895,754 @@ static struct mdlx_request_cb *mdlx_init_request(struct sg_table *sgt,
 	return req;
 }
 
-ssize_t mdlx_xfer_submit(void *dev_hndl, int channel, bool write, u64 ep_addr,
-			 struct sg_table *sgt, bool dma_mapped, int timeout_ms)
+/*
+ * transfer_queue_chunk - build the next chunk of @req, at most @desc_limit
+ * descriptors, into @xfer and queue it on the engine
+ */
+static int transfer_queue_chunk(struct mdlx_engine *engine,
+				struct mdlx_request_cb *req,
+				struct mdlx_transfer *xfer,
+				unsigned int desc_limit, struct sg_table *sgt,
+				bool dma_mapped, unsigned int *nents)
 {
-	struct mdlx_dev *mdev = (struct mdlx_dev *)dev_hndl;
-	struct mdlx_engine *engine;
-	int rv = 0, tfer_idx = 0, i;
-	ssize_t done = 0;
-	struct scatterlist *sg = sgt->sgl;
-	int nents;
-	enum dma_data_direction dir = write ? DMA_TO_DEVICE : DMA_FROM_DEVICE;
-	struct mdlx_request_cb *req = NULL;
-	struct mdlx_result *result;
-
-	if (!dev_hndl)
-		return -EINVAL;
+	int rv;
 
-	if (debug_check_dev_hndl(__func__, mdev->pdev, dev_hndl) < 0)
-		return -EINVAL;
+	/* build transfer */
+	rv = transfer_init(engine, req, xfer, desc_limit);
+	if (rv < 0)
+		return rv;
 
-	if (write == 1) {
-		if (channel >= mdev->h2c_channel_max) {
-			pr_err("H2C channel %d >= %d.\n", channel,
-				mdev->h2c_channel_max);
-			return -EINVAL;
-		}
-		engine = &mdev->engine_h2c[channel];
-	} else if (write == 0) {
-		if (channel >= mdev->c2h_channel_max) {
-			pr_err("C2H channel %d >= %d.\n", channel,
-				mdev->c2h_channel_max);
-			return -EINVAL;
-		}
-		engine = &mdev->engine_c2h[channel];
-	}
+	xfer->flags = XFER_FLAG_SYNC;
+	if (!dma_mapped)
+		xfer->flags |= XFER_FLAG_NEED_UNMAP;
 
-	if (!engine) {
-		pr_err("dma engine NULL\n");
-		return -EINVAL;
+	/* last transfer for the given request? */
+	*nents -= xfer->desc_num;
+	if (!*nents) {
+		xfer->last_in_request = 1;
+		xfer->sgt = sgt;
 	}
 
-	if (engine->magic != MAGIC_ENGINE) {
-		pr_err("%s has invalid magic number %lx\n", engine->name,
-		       engine->magic);
-		return -EINVAL;
-	}
+	dbg_tfr("xfer, %u, ep 0x%llx, sg %u/%u.\n", xfer->len,
+		req->ep_addr, req->sw_desc_idx, req->sw_desc_cnt);
 
-	mdev = engine->mdev;
-	if (mdlx_device_flag_check(mdev, MDEV_FLAG_OFFLINE)) {
-		pr_info("mdev 0x%p, offline.\n", mdev);
-		return -EBUSY;
-	}
+#ifdef __LIBMDLX_DEBUG__
+	transfer_dump(xfer);
+#endif
 
-	/* check the direction */
-	if (engine->dir != dir) {
-		pr_info("0x%p, %s, %d, W %d, 0x%x/0x%x mismatch.\n", engine,
-			engine->name, channel, write, engine->dir, dir);
-		return -EINVAL;
+	rv = transfer_queue(engine, xfer);				// send data
+	if (rv < 0) {
+		pr_info("unable to submit %s, %d.\n", engine->name, rv);
+		transfer_ring_release(engine, xfer);
+		mdlx_desc_done(xfer->desc_virt, xfer->desc_num);
 	}
+	return rv;
+}
 
-	if (!dma_mapped) {
-		nents = pci_map_sg(mdev->pdev, sg, sgt->orig_nents, dir);
-		if (!nents) {
-			pr_info("map sgl failed, sgt 0x%p.\n", sgt);
-			return -EIO;
-		}
-		sgt->nents = nents;
-	} else {
-		if (!sgt->nents) {
-			pr_err("sg table has invalid number of entries 0x%p.\n",
-			       sgt);
-			return -EIO;
+/*
+ * transfer_wait - wait for a queued transfer, abort it on timeout, and
+ * release its descriptors
+ *
+ * @return bytes transferred or < 0 in case of error
+ */
+static ssize_t transfer_wait(struct mdlx_engine *engine,
+			     struct mdlx_transfer *xfer, int timeout_ms)
+{
+	struct mdlx_result *result;
+	unsigned long flags;
+	ssize_t done = 0;
+	int rv, i;
+
+	/*
+	 * When polling, determine how many descriptors have been queued
+	 * on the engine to determine the writeback value expected
+	 */
+	if (poll_mode) {					// poll mode
+		/* desc_num is only written before the transfer is queued */
+		unsigned int desc_count = xfer->desc_num;
+
+		dbg_tfr("%s poll desc_count=%d\n", engine->name,
+			desc_count);
+		rv = engine_service_poll(engine, desc_count);
+		if (rv < 0) {
+			pr_err("Failed to service polling\n");
+			return rv;
 		}
+
+	} else {							// interrupt mode, sleep process until condition(interrupt)
+		xlx_wait_event_interruptible_timeout(
+			xfer->wq,
+			(xfer->state != TRANSFER_STATE_SUBMITTED),
+			msecs_to_jiffies(timeout_ms));
 	}
 
-	req = mdlx_init_request(sgt, ep_addr);
-	if (!req) {
-		rv = -ENOMEM;
-		goto unmap_sgl;
+	/* timed out or interrupted, the transfer can still be in-flight */
+	if (READ_ONCE(xfer->state) == TRANSFER_STATE_SUBMITTED) {
+		pr_info("xfer 0x%p,%u, %s.\n", xfer, xfer->len,
+			signal_pending(current) ? "interrupted" : "timed out");
+		rv = transfer_cancel_sync(engine, xfer);
+		if (rv < 0)
+			pr_err("%s failed to cancel xfer 0x%p, %d.\n",
+			       engine->name, xfer, rv);
 	}
 
-	dbg_tfr("%s, len %u sg cnt %u.\n", engine->name, req->total_len,
-		req->sw_desc_cnt);
+	spin_lock_irqsave(&engine->lock, flags);
 
-	sg = sgt->sgl;
-	nents = req->sw_desc_cnt;
-	mutex_lock(&engine->desc_lock);
+	/* not cancelled, the engine keeps the descriptors and the buffer */
+	if (xfer->state == TRANSFER_STATE_SUBMITTED) {
+		xfer->flags |= XFER_FLAG_ORPHAN;
+		spin_unlock_irqrestore(&engine->lock, flags);
+		return -EREMOTEIO;
+	}
 
-	while (nents) {
-		unsigned long flags;
-		struct mdlx_transfer *xfer;
+	switch (xfer->state) {
+	case TRANSFER_STATE_COMPLETED:
+		spin_unlock_irqrestore(&engine->lock, flags);
 
-		/* build transfer */
-		rv = transfer_init(engine, req, &req->tfer[0]);
-		if (rv < 0) {
-			mutex_unlock(&engine->desc_lock);
-			goto unmap_sgl;
-		}
-		xfer = &req->tfer[0];
+		result = xfer->res_virt;
 
-		if (!dma_mapped)
-			xfer->flags = XFER_FLAG_NEED_UNMAP;
+		dbg_tfr("transfer %p, %u compl.\n", xfer, xfer->len);
 
-		/* last transfer for the given request? */
-		nents -= xfer->desc_num;
-		if (!nents) {
-			xfer->last_in_request = 1;
-			xfer->sgt = sgt;
+		/* For C2H streaming use writeback results */
+		if (engine->streaming && engine->dir == DMA_FROM_DEVICE) {
+			for (i=0; i < xfer->desc_num; i++) {
+				done += result[i].length;
+			}
 		}
+		else
+			done = xfer->len;
 
-		dbg_tfr("xfer, %u, ep 0x%llx, done %lu, sg %u/%u.\n", xfer->len,
-			req->ep_addr, done, req->sw_desc_idx, req->sw_desc_cnt);
+		rv = 0;
+		break;
+	case TRANSFER_STATE_FAILED:
+		pr_info("xfer 0x%p,%u, failed.\n", xfer, xfer->len);
+		spin_unlock_irqrestore(&engine->lock, flags);
 
 #ifdef __LIBMDLX_DEBUG__
 		transfer_dump(xfer);
+		if (xfer->sgt)
+			sgt_dump(xfer->sgt);
 #endif
+		rv = -EIO;
+		break;
+	default:
+		spin_unlock_irqrestore(&engine->lock, flags);
 
-		rv = transfer_queue(engine, xfer);				// send data
-		if (rv < 0) {
-			mutex_unlock(&engine->desc_lock);
-			pr_info("unable to submit %s, %d.\n", engine->name, rv);
-			goto unmap_sgl;
-		}
+#ifdef __LIBMDLX_DEBUG__
+		transfer_dump(xfer);
+		if (xfer->sgt)
+			sgt_dump(xfer->sgt);
+#endif
+		rv = signal_pending(current) ? -ERESTARTSYS : -ETIMEDOUT;
+		break;
+	}
 
-		/*
-		 * When polling, determine how many descriptors have been queued
-		 * on the engine to determine the writeback value expected
-		 */
-		if (poll_mode) {					// poll mode
-			unsigned int desc_count;
+	transfer_ring_release(engine, xfer);
+	transfer_destroy(engine->mdev, xfer);
 
-			spin_lock_irqsave(&engine->lock, flags);
-			desc_count = xfer->desc_num;
-			spin_unlock_irqrestore(&engine->lock, flags);
-			dbg_tfr("%s poll desc_count=%d\n", engine->name,
-				desc_count);
-			rv = engine_service_poll(engine, desc_count);
-			if (rv < 0) {
-				mutex_unlock(&engine->desc_lock);
-				pr_err("Failed to service polling\n");
-				goto unmap_sgl;
-			}
+	if (rv < 0)
+		return rv;
+	return done;
+}
 
-		} else {							// interrupt mode, sleep process until condition(interrupt)
-			xlx_wait_event_interruptible_timeout(
-				xfer->wq,
-				(xfer->state != TRANSFER_STATE_SUBMITTED),
-				msecs_to_jiffies(timeout_ms));
+/*
+ * map, build, queue and wait for all transfers of one request on an engine,
+ * the caller has validated the engine and accounted it in engine->queued
+ */
+static ssize_t engine_xfer_submit(struct mdlx_engine *engine, u64 ep_addr,
+				  struct sg_table *sgt, bool dma_mapped,
+				  int timeout_ms)
+{
+	struct mdlx_dev *mdev = engine->mdev;
+	int rv = 0;
+	ssize_t done = 0;
+	struct scatterlist *sg = sgt->sgl;
+	unsigned int nents, desc_limit;
+	enum dma_data_direction dir = engine->dir;
+	struct mdlx_request_cb *req = NULL;
+	struct mdlx_transfer *xfer;
+	bool pipeline;
+
+	if (!dma_mapped) {
+		nents = pci_map_sg(mdev->pdev, sg, sgt->orig_nents, dir);
+		if (!nents) {
+			pr_info("map sgl failed, sgt 0x%p.\n", sgt);
+			return -EIO;
+		}
+		sgt->nents = nents;
+	} else {
+		if (!sgt->nents) {
+			pr_err("sg table has invalid number of entries 0x%p.\n",
+			       sgt);
+			return -EIO;
 		}
+	}
 
-		spin_lock_irqsave(&engine->lock, flags);
+	req = mdlx_init_request(sgt, ep_addr);
+	if (!req) {
+		rv = -ENOMEM;
+		goto unmap_sgl;
+	}
 
-		switch (xfer->state) {
-		case TRANSFER_STATE_COMPLETED:
-			spin_unlock_irqrestore(&engine->lock, flags);
+	dbg_tfr("%s, len %u sg cnt %u.\n", engine->name, req->total_len,
+		req->sw_desc_cnt);
+	atomic64_add(req->total_len, &engine->inflight_bytes);
 
-			result = xfer->res_virt;
+	/*
+	 * A request larger than the descriptor ring is double buffered: the
+	 * next chunk is built into the other tfer slot and queued behind the
+	 * running one, so the completion handler restarts the engine on it
+	 * without waiting for this thread. Each chunk gets half of the ring.
+	 */
+	pipeline = !poll_mode && req->sw_desc_cnt > MDLX_TRANSFER_MAX_DESC;
+	desc_limit = pipeline ? MDLX_TRANSFER_MAX_DESC / 2 :
+				MDLX_TRANSFER_MAX_DESC;
 
-			dbg_tfr("transfer %p, %u, ep 0x%llx compl, +%lu.\n",
-				xfer, xfer->len, req->ep_addr - xfer->len,
-				done);
+	nents = req->sw_desc_cnt;
+	mutex_lock(&engine->desc_lock);
 
-			/* For C2H streaming use writeback results */
-			if (engine->streaming && engine->dir == DMA_FROM_DEVICE) {
-				for (i=0; i < xfer->desc_num; i++) {
-					done += result[i].length;
-				}
-			}
-			else
-				done += xfer->len;
+	xfer = &req->tfer[0];
+	rv = transfer_queue_chunk(engine, req, xfer, desc_limit, sgt,
+				  dma_mapped, &nents);
+	if (rv < 0)
+		xfer = NULL;
+
+	while (xfer) {
+		struct mdlx_transfer *next = NULL;
+		ssize_t res;
+
+		/* build and queue the next chunk while this one is running */
+		if (pipeline && nents) {
+			next = xfer == &req->tfer[0] ? &req->tfer[1] :
+						       &req->tfer[0];
+			rv = transfer_queue_chunk(engine, req, next, desc_limit,
+						  sgt, dma_mapped, &nents);
+			if (rv < 0)
+				next = NULL;
+		}
 
-			rv = 0;
-			break;
-		case TRANSFER_STATE_FAILED:
-			pr_info("xfer 0x%p,%u, failed, ep 0x%llx.\n", xfer,
-				xfer->len, req->ep_addr - xfer->len);
-			spin_unlock_irqrestore(&engine->lock, flags);
+		res = transfer_wait(engine, xfer, timeout_ms);
+		if (res < 0)
+			rv = res;
+		else
+			done += res;
 
-#ifdef __LIBMDLX_DEBUG__
-			transfer_dump(xfer);
-			sgt_dump(sgt);
-#endif
-			rv = -EIO;
-			break;
-		default:
-			/* transfer can still be in-flight */
-			pr_info("xfer 0x%p,%u, s 0x%x timed out, ep 0x%llx.\n",
-				xfer, xfer->len, xfer->state, req->ep_addr);
-			rv = engine_status_read(engine, 0, 1);
-			if (rv < 0) {
-				pr_err("Failed to read engine status\n");
-			} else if (rv == 0) {
-				//engine_status_dump(engine);
-				rv = transfer_abort(engine, xfer);
-				if (rv < 0) {
-					pr_err("Failed to stop engine\n");
-				} else if (rv == 0) {
-					rv = mdlx_engine_stop(engine);
-					if (rv < 0)
-						pr_err("Failed to stop engine\n");
-				}
+		if (rv < 0) {
+			/* the request failed, abort the queued chunk too */
+			if (next) {
+				/* an orphaned chunk keeps the request mapped */
+				if (rv == -EREMOTEIO)
+					next->flags &= ~XFER_FLAG_NEED_UNMAP;
+				if (transfer_wait(engine, next, 0) == -EREMOTEIO)
+					rv = -EREMOTEIO;
 			}
-			spin_unlock_irqrestore(&engine->lock, flags);
-
-#ifdef __LIBMDLX_DEBUG__
-			transfer_dump(xfer);
-			sgt_dump(sgt);
-#endif
-			rv = -ERESTARTSYS;
 			break;
 		}
 
-		engine->desc_used -= xfer->desc_num;
-		transfer_destroy(mdev, xfer);
-
-		/* use multiple transfers per request if we could not fit all data within
-		 * single descriptor chain.
-		 */
-		tfer_idx++;
-
-		if (rv < 0) {
-			mutex_unlock(&engine->desc_lock);
-			goto unmap_sgl;
+		if (!next && nents) {
+			next = xfer;
+			rv = transfer_queue_chunk(engine, req, next, desc_limit,
+						  sgt, dma_mapped, &nents);
+			if (rv < 0)
+				break;
 		}
-	} /* while (sg) */
+		xfer = next;
+	}
 	mutex_unlock(&engine->desc_lock);
 
+	/* the engine still owns the request, it stays mapped and allocated */
+	if (rv == -EREMOTEIO)
+		return rv;
+
 unmap_sgl:
 	if (!dma_mapped && sgt->nents) {
 		pci_unmap_sg(mdev->pdev, sgt->sgl, sgt->orig_nents, dir);
 		sgt->nents = 0;
 	}
 
-	if (req)
+	if (req) {
+		atomic64_sub(req->total_len, &engine->inflight_bytes);
 		mdlx_request_free(req);
+	}
 
 	if (rv < 0)
 		return rv;
 
 	return done;
 }
-EXPORT_SYMBOL_GPL(mdlx_xfer_submit);
-
-ssize_t mdlx_xfer_completion(void *cb_hndl, void *dev_hndl, int channel, bool write, u64 ep_addr,
-			struct sg_table *sgt, bool dma_mapped, int timeout_ms)
-{
 
-	struct mdlx_dev *mdev = (struct mdlx_dev *)dev_hndl;
-	struct mdlx_io_cb *cb = (struct mdlx_io_cb *)cb_hndl;
-	struct mdlx_engine *engine;
-	int rv = 0, tfer_idx = 0;
-	ssize_t done = 0;
-	int nents;
-	enum dma_data_direction dir = write ? DMA_TO_DEVICE : DMA_FROM_DEVICE;
-	struct mdlx_request_cb *req = NULL;
-	struct mdlx_transfer *xfer;
+/*
+ * engine_pick - least loaded engine of one direction, by in-flight bytes then
+ * outstanding descriptors. Equally loaded engines are scanned starting from
+ * the channel whose interrupt the submitting CPU takes, else that CPU's
+ * channel number, or from a rotor without xfer_cpu_affinity.
+ * Streaming engines carry separate streams and are never picked.
+ */
+static struct mdlx_engine *engine_pick(struct mdlx_dev *mdev, bool write)
+{
+	struct mdlx_engine *engines = write ? mdev->engine_h2c :
+					      mdev->engine_c2h;
+	int channel_max = write ? mdev->h2c_channel_max :
+				  mdev->c2h_channel_max;
+	struct mdlx_engine *best = NULL;
+	u64 best_bytes = U64_MAX;
+	int best_descs = INT_MAX;
+	unsigned int start;
 	int i;
-	struct mdlx_result *result;
 
-	if (write == 1) {
-			if (channel >= mdev->h2c_channel_max) {
-				pr_warn("H2C channel %d >= %d.\n",
-					channel, mdev->h2c_channel_max);
-				return -EINVAL;
-			}
-			engine = &mdev->engine_h2c[channel];
-		} else if (write == 0) {
-			if (channel >= mdev->c2h_channel_max) {
-				pr_warn("C2H channel %d >= %d.\n",
-					channel, mdev->c2h_channel_max);
-				return -EINVAL;
+	if (!channel_max)
+		return NULL;
+
+	if (xfer_cpu_affinity) {
+		int cpu = raw_smp_processor_id();
+
+		/* the channel completing on this CPU, if there is one */
+		start = cpu;
+		for (i = 0; i < channel_max; i++) {
+			if (engines[i].irq_cpu == cpu) {
+				start = i;
+				break;
 			}
-			engine = &mdev->engine_c2h[channel];
-		} else {
-			pr_warn("write %d, exp. 0|1.\n", write);
-			return -EINVAL;
 		}
-
-	if (!engine) {
-		pr_err("dma engine NULL\n");
-		return -EINVAL;
+	} else {
+		start = atomic_inc_return(&engine_pick_rotor);
 	}
+	for (i = 0; i < channel_max; i++) {
+		struct mdlx_engine *engine =
+			&engines[(start + i) % channel_max];
+		u64 bytes;
+		int descs;
 
-	if (engine->magic != MAGIC_ENGINE) {
-		pr_err("%s has invalid magic number %lx\n", engine->name,
-		       engine->magic);
-		return -EINVAL;
+		if (engine->magic != MAGIC_ENGINE || engine->streaming ||
+		    READ_ONCE(engine->wedged))
+			continue;
+
+		bytes = atomic64_read(&engine->inflight_bytes);
+		descs = READ_ONCE(engine->desc_used);
+		if (bytes < best_bytes ||
+		    (bytes == best_bytes && descs < best_descs)) {
+			best = engine;
+			best_bytes = bytes;
+			best_descs = descs;
+		}
 	}
+	return best;
+}
 
-	mdev = engine->mdev;
-	req = cb->req;
+/*
+ * pio_xfer_len - bytes of a write small enough for the mailbox, 0 if it has
+ * to go through DMA
+ */
+static size_t pio_xfer_len(struct mdlx_dev *mdev, struct sg_table *sgt)
+{
+	size_t max = min(pio_threshold, pio_mbox_size);
+	struct scatterlist *sg;
+	size_t len = 0;
+	int i;
 
-	nents = req->sw_desc_cnt;
-	while (nents) {
-		xfer = &req->tfer[tfer_idx];
-		nents -= xfer->desc_num;
-		switch(xfer->state) {
-			case TRANSFER_STATE_COMPLETED:
+	if (!mdev->pio_mbox)
+		return 0;
 
-				dbg_tfr("transfer %p, %u, ep 0x%llx compl, +%lu.\n",
-						xfer, xfer->len, req->ep_addr - xfer->len, done);
+	for_each_sg(sgt->sgl, sg, sgt->orig_nents, i) {
+		len += sg->length;
+		if (len > max)
+			return 0;
+	}
+	/* same length rule as the descriptors */
+	return (len & 3) ? 0 : len;
+}
 
-				result = xfer->res_virt;
-				dbg_tfr("transfer %p, %u, ep 0x%llx compl, +%lu.\n",
-							xfer, xfer->len, req->ep_addr - xfer->len, done);
-				/* For C2H streaming use writeback results */
-				if (engine->streaming && engine->dir == DMA_FROM_DEVICE) {
-						for (i=0; i < xfer->desc_num; i++) {
-							done += result[i].length;
-						}
-					}
-				else
-					done += xfer->len;
+/*
+ * pio_xfer_submit - write a small payload into the user BAR mailbox and ring
+ * the doorbell, instead of mapping it and running an engine
+ *
+ * After a message failed, the card may still be reading the mailbox: it
+ * is only written again once the doorbell length reads 0, until then
+ * -EAGAIN sends the write through DMA.
+ */
+static ssize_t pio_xfer_submit(struct mdlx_dev *mdev, u64 ep_addr,
+			       struct sg_table *sgt, size_t len, int timeout_ms)
+{
+	void __iomem *db = mdev->bar[mdev->user_bar_idx] + pio_doorbell_offset;
+	u64 irq_count = 0;
+	u32 pending;
+	int rv = 0;
 
-				rv = 0;
-				break;
-			case TRANSFER_STATE_FAILED:
-				pr_info("xfer 0x%p,%u, failed, ep 0x%llx.\n",
-						xfer, xfer->len, req->ep_addr - xfer->len);
+	mutex_lock(&mdev->pio_lock);
+	if (mdev->pio_stale) {
+		if (ioread32(db + PIO_DB_LEN)) {
+			mutex_unlock(&mdev->pio_lock);
+			return -EAGAIN;
+		}
+		mdev->pio_stale = false;
+	}
+	if (pio_irq >= 0)
+		irq_count = mdlx_user_irq_count(mdev, pio_irq);
 
-#ifdef __LIBMDLX_DEBUG__
-				transfer_dump(xfer);
-				sgt_dump(sgt);
-#endif
-				rv = -EIO;
-				break;
-			default:
-				/* transfer can still be in-flight */
-				pr_info("xfer 0x%p,%u, s 0x%x timed out, ep 0x%llx.\n",
-						xfer, xfer->len, xfer->state, req->ep_addr);
-				engine_status_read(engine, 0, 1);
-				engine_status_dump(engine);
-				transfer_abort(engine, xfer);
+	/* whole 64 bit stores, merged by the write-combined mapping */
+	memset(mdev->pio_bounce + round_down(len, 8), 0, 8);
+	sg_copy_to_buffer(sgt->sgl, sgt->orig_nents, mdev->pio_bounce, len);
+	__iowrite64_copy(mdev->pio_mbox, mdev->pio_bounce,
+			 DIV_ROUND_UP(len, 8));
+	/* drain the write-combining buffers before the doorbell */
+	wmb();
 
-				mdlx_engine_stop(engine);
+	iowrite32(lower_32_bits(ep_addr), db + PIO_DB_ADDR_LO);
+	iowrite32(upper_32_bits(ep_addr), db + PIO_DB_ADDR_HI);
+	iowrite32(len, db + PIO_DB_LEN);
 
-#ifdef __LIBMDLX_DEBUG__
+	if (pio_irq >= 0) {
+		rv = mdlx_user_irq_wait(mdev, pio_irq, irq_count, timeout_ms);
+	} else {
+		/* readx_poll_timeout() waits forever on 0, make it the shortest */
+		rv = readx_poll_timeout(ioread32, db + PIO_DB_LEN, pending,
+					!pending, PIO_DB_POLL_US,
+					(u64)max(timeout_ms, 1) * USEC_PER_MSEC);
+	}
+	/* timed out or interrupted, the card may still read the mailbox */
+	if (rv < 0)
+		mdev->pio_stale = true;
+	mutex_unlock(&mdev->pio_lock);
+
+	if (rv < 0) {
+		pr_info("%s, mailbox write %zu, ep 0x%llx, failed %d.\n",
+			dev_name(&mdev->pdev->dev), len, ep_addr, rv);
+		return rv;
+	}
+	return len;
+}
+
+static void pio_mbox_map(struct mdlx_dev *mdev)
+{
+	int bar = mdev->user_bar_idx;
+
+	if (!pio_mbox_size || bar < 0)
+		return;
+
+	if ((pio_mbox_offset & 63) || (pio_mbox_size & 7) ||
+	    (u64)pio_mbox_offset + pio_mbox_size > mdev->bar_len[bar] ||
+	    (pio_doorbell_offset & 3) ||
+	    (u64)pio_doorbell_offset + PIO_DB_LEN + 4 > mdev->bar_len[bar] ||
+	    pio_irq >= mdev->user_max) {
+		pr_warn("%s, mailbox 0x%x+0x%x, doorbell 0x%x, irq %d invalid for BAR %d, mailbox off.\n",
+			dev_name(&mdev->pdev->dev), pio_mbox_offset,
+			pio_mbox_size, pio_doorbell_offset, pio_irq, bar);
+		return;
+	}
+
+	mdev->pio_bounce = kmalloc(pio_mbox_size + 8, GFP_KERNEL);
+	if (!mdev->pio_bounce)
+		return;
+
+	mdev->pio_mbox = ioremap_wc(pci_resource_start(mdev->pdev, bar) +
+				    pio_mbox_offset, pio_mbox_size);
+	if (!mdev->pio_mbox) {
+		pr_warn("%s, mailbox map failed.\n",
+			dev_name(&mdev->pdev->dev));
+		kfree(mdev->pio_bounce);
+		mdev->pio_bounce = NULL;
+		return;
+	}
+
+	pr_info("%s, %u byte mailbox at BAR %d 0x%x.\n",
+		dev_name(&mdev->pdev->dev), pio_mbox_size, bar,
+		pio_mbox_offset);
+}
+
+static void pio_mbox_unmap(struct mdlx_dev *mdev)
+{
+	if (mdev->pio_mbox) {
+		iounmap(mdev->pio_mbox);
+		mdev->pio_mbox = NULL;
+	}
+	kfree(mdev->pio_bounce);
+	mdev->pio_bounce = NULL;
+}
+
+ssize_t mdlx_xfer_submit(void *dev_hndl, int channel, bool write, u64 ep_addr,
+			 struct sg_table *sgt, bool dma_mapped, int timeout_ms)
+{
+	struct mdlx_dev *mdev = (struct mdlx_dev *)dev_hndl;
+	struct mdlx_engine *engine;
+	enum dma_data_direction dir = write ? DMA_TO_DEVICE : DMA_FROM_DEVICE;
+	ssize_t rv;
+
+	if (!dev_hndl)
+		return -EINVAL;
+
+	if (debug_check_dev_hndl(__func__, mdev->pdev, dev_hndl) < 0)
+		return -EINVAL;
+
+	if (channel == (write ? mdev->h2c_channel_max :
+				mdev->c2h_channel_max)) {
+		/* any channel */
+		engine = engine_pick(mdev, write);
+		if (!engine) {
+			pr_err("no %s engine available.\n",
+				write ? "H2C" : "C2H");
+			return -ENODEV;
+		}
+	} else if (write == 1) {
+		if (channel >= mdev->h2c_channel_max) {
+			pr_err("H2C channel %d >= %d.\n", channel,
+				mdev->h2c_channel_max);
+			return -EINVAL;
+		}
+		engine = &mdev->engine_h2c[channel];
+	} else if (write == 0) {
+		if (channel >= mdev->c2h_channel_max) {
+			pr_err("C2H channel %d >= %d.\n", channel,
+				mdev->c2h_channel_max);
+			return -EINVAL;
+		}
+		engine = &mdev->engine_c2h[channel];
+	}
+
+	if (!engine) {
+		pr_err("dma engine NULL\n");
+		return -EINVAL;
+	}
+
+	if (engine->magic != MAGIC_ENGINE) {
+		pr_err("%s has invalid magic number %lx\n", engine->name,
+		       engine->magic);
+		return -EINVAL;
+	}
+
+	mdev = engine->mdev;
+	if (mdlx_device_flag_check(mdev, MDEV_FLAG_OFFLINE)) {
+		pr_info("mdev 0x%p, offline.\n", mdev);
+		return -EBUSY;
+	}
+
+	/* check the direction */
+	if (engine->dir != dir) {
+		pr_info("0x%p, %s, %d, W %d, 0x%x/0x%x mismatch.\n", engine,
+			engine->name, channel, write, engine->dir, dir);
+		return -EINVAL;
+	}
+
+	/* small writes skip mapping and the engine altogether */
+	if (write && !dma_mapped && !engine->streaming &&
+	    !engine->non_incr_addr) {
+		size_t len = pio_xfer_len(mdev, sgt);
+
+		if (len) {
+			rv = pio_xfer_submit(mdev, ep_addr, sgt, len,
+					     timeout_ms);
+			if (rv != -EAGAIN)
+				return rv;
+		}
+	}
+
+	atomic_inc(&engine->queued);
+	rv = engine_xfer_submit(engine, ep_addr, sgt, dma_mapped, timeout_ms);
+	atomic_dec(&engine->queued);
+
+	return rv;
+}
+EXPORT_SYMBOL_GPL(mdlx_xfer_submit);
+
+/*
+ * pick the online engine with the lowest queue depth over all cards, or over
+ * card @card only when >= 0, and account the request against it. Streaming
+ * and non-incremental engines are not interchangeable and never pooled.
+ * Must be called under rcu_read_lock().
+ */
+static struct mdlx_engine *pool_engine_get(bool write, int card)
+{
+	unsigned int start = atomic_inc_return(&mdev_pool_rotor);
+	unsigned int best_key = UINT_MAX;
+	struct mdlx_engine *best = NULL;
+	struct mdlx_dev *mdev;
+	unsigned int n = 0;
+	int i;
+
+	list_for_each_entry_rcu(mdev, &mdev_rcu_list, rcu_node) {
+		struct mdlx_engine *engines;
+		int channel_max;
+
+		if (card >= 0 && mdev->idx != card)
+			continue;
+		if (mdlx_device_flag_check(mdev, MDEV_FLAG_OFFLINE))
+			continue;
+
+		engines = write ? mdev->engine_h2c : mdev->engine_c2h;
+		channel_max = write ? mdev->h2c_channel_max :
+				      mdev->c2h_channel_max;
+		for (i = 0; i < channel_max; i++, n++) {
+			struct mdlx_engine *engine = &engines[i];
+			unsigned int key;
+
+			if (engine->magic != MAGIC_ENGINE ||
+			    engine->streaming || engine->non_incr_addr ||
+			    READ_ONCE(engine->wedged))
+				continue;
+
+			/* queue depth first, then the rotor breaks ties */
+			key = (atomic_read(&engine->queued) << 8) |
+			      ((n - start) & 0xFF);
+			if (key < best_key) {
+				best_key = key;
+				best = engine;
+			}
+		}
+	}
+
+	if (best) {
+		atomic_inc(&best->queued);
+		atomic_inc(&best->mdev->pool_users);
+	}
+	return best;
+}
+
+static void pool_engine_put(struct mdlx_engine *engine)
+{
+	atomic_dec(&engine->queued);
+	if (atomic_dec_and_test(&engine->mdev->pool_users))
+		wake_up(&mdev_pool_wq);
+}
+
+/* no new pool requests reach @mdev once it is offline, wait for the rest */
+static void mdev_pool_drain(struct mdlx_dev *mdev)
+{
+	synchronize_rcu();
+	wait_event(mdev_pool_wq, !atomic_read(&mdev->pool_users));
+}
+
+ssize_t mdlx_pool_xfer_submit(bool write, int card, u64 ep_addr,
+			      struct sg_table *sgt, int timeout_ms,
+			      int *card_used, int *channel_used)
+{
+	struct mdlx_engine *engine;
+	ssize_t rv;
+
+	if (!sgt || !sgt->sgl || !sgt->orig_nents)
+		return -EINVAL;
+
+	rcu_read_lock();
+	engine = pool_engine_get(write, card);
+	rcu_read_unlock();
+	if (!engine) {
+		dbg_tfr("no online %s engine in pool, card %d.\n",
+			write ? "H2C" : "C2H", card);
+		return card >= 0 ? -EBUSY : -ENODEV;
+	}
+
+	/* host and card address must share the engine alignment */
+	if ((sgt->sgl->offset ^ ep_addr) & (engine->addr_align - 1)) {
+		dbg_tfr("%s, misaligned host offset 0x%x, ep 0x%llx.\n",
+			engine->name, sgt->sgl->offset, ep_addr);
+		rv = -EINVAL;
+		goto out;
+	}
+
+	if (card_used)
+		*card_used = engine->mdev->idx;
+	if (channel_used)
+		*channel_used = engine->channel;
+
+	rv = engine_xfer_submit(engine, ep_addr, sgt, false, timeout_ms);
+out:
+	pool_engine_put(engine);
+	return rv;
+}
+EXPORT_SYMBOL_GPL(mdlx_pool_xfer_submit);
+
+ssize_t mdlx_xfer_completion(void *cb_hndl, void *dev_hndl, int channel, bool write, u64 ep_addr,
+			struct sg_table *sgt, bool dma_mapped, int timeout_ms)
+{
+
+	struct mdlx_dev *mdev = (struct mdlx_dev *)dev_hndl;
+	struct mdlx_io_cb *cb = (struct mdlx_io_cb *)cb_hndl;
+	struct mdlx_engine *engine;
+	int rv = 0, tfer_idx = 0;
+	ssize_t done = 0;
+	int nents;
+	enum dma_data_direction dir = write ? DMA_TO_DEVICE : DMA_FROM_DEVICE;
+	struct mdlx_request_cb *req = NULL;
+	struct mdlx_transfer *xfer;
+	int i;
+	struct mdlx_result *result;
+
+	if (write == 1) {
+			if (channel >= mdev->h2c_channel_max) {
+				pr_warn("H2C channel %d >= %d.\n",
+					channel, mdev->h2c_channel_max);
+				return -EINVAL;
+			}
+			engine = &mdev->engine_h2c[channel];
+		} else if (write == 0) {
+			if (channel >= mdev->c2h_channel_max) {
+				pr_warn("C2H channel %d >= %d.\n",
+					channel, mdev->c2h_channel_max);
+				return -EINVAL;
+			}
+			engine = &mdev->engine_c2h[channel];
+		} else {
+			pr_warn("write %d, exp. 0|1.\n", write);
+			return -EINVAL;
+		}
+
+	if (!engine) {
+		pr_err("dma engine NULL\n");
+		return -EINVAL;
+	}
+
+	if (engine->magic != MAGIC_ENGINE) {
+		pr_err("%s has invalid magic number %lx\n", engine->name,
+		       engine->magic);
+		return -EINVAL;
+	}
+
+	mdev = engine->mdev;
+	req = cb->req;
+
+	nents = req->sw_desc_cnt;
+	while (nents) {
+		xfer = &req->tfer[tfer_idx];
+		nents -= xfer->desc_num;
+		switch(xfer->state) {
+			case TRANSFER_STATE_COMPLETED:
+
+				dbg_tfr("transfer %p, %u, ep 0x%llx compl, +%lu.\n",
+						xfer, xfer->len, req->ep_addr - xfer->len, done);
+
+				result = xfer->res_virt;
+				dbg_tfr("transfer %p, %u, ep 0x%llx compl, +%lu.\n",
+							xfer, xfer->len, req->ep_addr - xfer->len, done);
+				/* For C2H streaming use writeback results */
+				if (engine->streaming && engine->dir == DMA_FROM_DEVICE) {
+						for (i=0; i < xfer->desc_num; i++) {
+							done += result[i].length;
+						}
+					}
+				else
+					done += xfer->len;
+
+				rv = 0;
+				break;
+			case TRANSFER_STATE_FAILED:
+				pr_info("xfer 0x%p,%u, failed, ep 0x%llx.\n",
+						xfer, xfer->len, req->ep_addr - xfer->len);
+
+#ifdef __LIBMDLX_DEBUG__
+				transfer_dump(xfer);
+				sgt_dump(sgt);
+#endif
+				rv = -EIO;
+				break;
+			default:
+				/* transfer can still be in-flight */
+				pr_info("xfer 0x%p,%u, s 0x%x timed out, ep 0x%llx.\n",
+						xfer, xfer->len, xfer->state, req->ep_addr);
+				engine_status_read(engine, 0, 1);
+				engine_status_dump(engine);
+				transfer_abort(engine, xfer);
+
+				mdlx_engine_stop(engine);
+
+#ifdef __LIBMDLX_DEBUG__
 				transfer_dump(xfer);
 				sgt_dump(sgt);
 #endif
@@ -3787,7 +4651,7 @@ ssize_t mdlx_xfer_completion(void *cb_hndl, void *dev_hndl, int channel, bool wr
 			}
 
 		transfer_destroy(mdev, xfer);
-		engine->desc_used -= xfer->desc_num;
+		transfer_ring_release(engine, xfer);
 
 		tfer_idx++;
 
@@ -3907,7 +4771,7 @@ ssize_t mdlx_xfer_submit_nowait(void *cb_hndl, void *dev_hndl, int channel, bool
 		/* one transfer at a time */
 		xfer = &req->tfer[tfer_idx];
 		/* build transfer */
-		rv = transfer_init(engine, req, xfer);
+		rv = transfer_init(engine, req, xfer, MDLX_TRANSFER_MAX_DESC);
 		if (rv < 0) {
 			pr_info("transfer_init failed\n");
 
@@ -3979,25 +4843,32 @@ int mdlx_performance_submit(struct mdlx_dev *mdev, struct mdlx_engine *engine)
 	u64 ep_addr = 0;
 	int num_desc_in_a_loop = MDLX_PERF_NUM_DESC;
 	int size_in_desc = engine->mdlx_perf->transfer_size;
-	int size = size_in_desc * num_desc_in_a_loop;
+	int size;
 	int i;
 	int rv = -ENOMEM;
 	unsigned char free_desc = 0;
 
-	if (size_in_desc > max_consistent_size) {
-		pr_err("%s max consistent size %d is more than supported %d\n",
+	if (!size_in_desc || size_in_desc > max_consistent_size) {
+		pr_err("%s transfer size %d invalid, max consistent size %d\n",
 		       engine->name, size_in_desc, max_consistent_size);
 		return -EINVAL;
 	}
 
-	if (size > max_consistent_size) {
-		size = max_consistent_size;
-		num_desc_in_a_loop = size / size_in_desc;
-	}
+	if (engine->mdlx_perf->version >= IOCTL_MDLX_PERF_V2 &&
+	    engine->mdlx_perf->desc_count)
+		num_desc_in_a_loop = min_t(int, engine->mdlx_perf->desc_count,
+					   MDLX_TRANSFER_MAX_DESC);
 
-	engine->perf_buf_virt = dma_alloc_coherent(&mdev->pdev->dev, size_in_desc,
+	/* every descriptor gets its own buffer, as far as memory allows */
+	num_desc_in_a_loop = min_t(int, num_desc_in_a_loop,
+				   max_consistent_size / size_in_desc);
+	size = size_in_desc * num_desc_in_a_loop;
+	engine->mdlx_perf->desc_count = num_desc_in_a_loop;
+
+	engine->perf_buf_virt = dma_alloc_coherent(&mdev->pdev->dev, size,
 						   &engine->perf_buf_bus,
 					 GFP_KERNEL);
+	engine->perf_buf_size = size;
 	if (!engine->perf_buf_virt) {
 		pr_err("dev %s, %s DMA allocation OOM.\n",
 		       dev_name(&mdev->pdev->dev), engine->name);
@@ -4045,8 +4916,8 @@ int mdlx_performance_submit(struct mdlx_dev *mdev, struct mdlx_engine *engine)
 
 	for (i = 0; i < transfer->desc_num; i++) {
 		struct mdlx_desc *desc = transfer->desc_virt + i;
-		dma_addr_t rc_bus_addr = engine->perf_buf_bus/* +
-				(size_in_desc * i)*/;
+		dma_addr_t rc_bus_addr = engine->perf_buf_bus +
+				(size_in_desc * i);
 
 		/* fill in descriptor entry with transfer details */
 		mdlx_desc_set(desc, rc_bus_addr, ep_addr, size_in_desc,
@@ -4097,7 +4968,7 @@ err_engine_desc:
 	transfer = NULL;
 err_engine_transfer:
 	if (engine->perf_buf_virt)
-		dma_free_coherent(&mdev->pdev->dev, size_in_desc, engine->perf_buf_virt,
+		dma_free_coherent(&mdev->pdev->dev, size, engine->perf_buf_virt,
 				  engine->perf_buf_bus);
 	engine->perf_buf_virt = NULL;
 	return rv;
@@ -4122,6 +4993,7 @@ static struct mdlx_dev *alloc_dev_instance(struct pci_dev *pdev)
 		return NULL;
 	}
 	spin_lock_init(&mdev->lock);
+	mutex_init(&mdev->pio_lock);
 
 	mdev->magic = MAGIC_DEVICE;
 	mdev->config_bar_idx = -1;
@@ -4138,13 +5010,20 @@ static struct mdlx_dev *alloc_dev_instance(struct pci_dev *pdev)
 		mdev->user_irq[i].mdev = mdev;
 		spin_lock_init(&mdev->user_irq[i].events_lock);
 		init_waitqueue_head(&mdev->user_irq[i].events_wq);
+		init_waitqueue_head(&mdev->user_irq[i].total_wq);
 		mdev->user_irq[i].handler = NULL;
 		mdev->user_irq[i].user_idx = i; /* 0 based */
+		hrtimer_init(&mdev->user_irq[i].coal_timer, CLOCK_MONOTONIC,
+			HRTIMER_MODE_REL);
+		mdev->user_irq[i].coal_timer.function = user_irq_coal_timeout;
 	}
 
 	engine = mdev->engine_h2c;
 	for (i = 0; i < MDLX_CHANNEL_NUM_MAX; i++, engine++) {
 		spin_lock_init(&engine->lock);
+		spin_lock_init(&engine->ring_lock);
+		spin_lock_init(&engine->perf_lock);
+		spin_lock_init(&engine->bypass_lock);
 		mutex_init(&engine->desc_lock);
 		INIT_LIST_HEAD(&engine->transfer_list);
 #if KERNEL_VERSION(4, 6, 0) <= LINUX_VERSION_CODE
@@ -4159,6 +5038,9 @@ static struct mdlx_dev *alloc_dev_instance(struct pci_dev *pdev)
 	engine = mdev->engine_c2h;
 	for (i = 0; i < MDLX_CHANNEL_NUM_MAX; i++, engine++) {
 		spin_lock_init(&engine->lock);
+		spin_lock_init(&engine->ring_lock);
+		spin_lock_init(&engine->perf_lock);
+		spin_lock_init(&engine->bypass_lock);
 		mutex_init(&engine->desc_lock);
 		INIT_LIST_HEAD(&engine->transfer_list);
 #if KERNEL_VERSION(4, 6, 0) <= LINUX_VERSION_CODE
@@ -4292,6 +5174,12 @@ static void remove_engines(struct mdlx_dev *mdev)
 			dbg_sg("%s, %d removed", engine->name, i);
 		}
 	}
+
+	if (mdev->wb_area) {
+		dma_free_coherent(&mdev->pdev->dev, sizeof(struct mdlx_wb_area),
+				  mdev->wb_area, mdev->wb_area_bus);
+		mdev->wb_area = NULL;
+	}
 }
 
 static int probe_for_engine(struct mdlx_dev *mdev, enum dma_data_direction dir,
@@ -4356,6 +5244,23 @@ static int probe_engines(struct mdlx_dev *mdev)
 		return -EINVAL;
 	}
 
+	/*
+	 * one page for the writebacks of all engines, in interrupt mode as
+	 * well; dma_alloc_coherent() allocates it on the node of the device
+	 */
+	BUILD_BUG_ON(sizeof(struct mdlx_wb_area) > PAGE_SIZE);
+	if (!mdev->wb_area) {
+		mdev->wb_area = dma_alloc_coherent(&mdev->pdev->dev,
+						   sizeof(struct mdlx_wb_area),
+						   &mdev->wb_area_bus,
+						   GFP_KERNEL);
+		if (!mdev->wb_area) {
+			pr_warn("%s, poll writeback area OOM.\n",
+				dev_name(&mdev->pdev->dev));
+			return -ENOMEM;
+		}
+	}
+
 	/* iterate over channels */
 	for (i = 0; i < mdev->h2c_channel_max; i++) {
 		rv = probe_for_engine(mdev, DMA_TO_DEVICE, i);
@@ -4394,35 +5299,83 @@ static void pci_enable_capability(struct pci_dev *pdev, int cap)
 }
 #endif
 
-void *mdlx_device_open(const char *mname, struct pci_dev *pdev, int *user_max,
-		       int *h2c_channel_max, int *c2h_channel_max)
+#ifdef __MDLX_EMU__
+/* bring up an emulated device, there is no PCI function behind it */
+static int emu_device_open(struct mdlx_dev *mdev)
 {
-	struct mdlx_dev *mdev = NULL;
-	int rv = 0;
+	int rv;
 
-	pr_info("%s device %s, 0x%p.\n", mname, dev_name(&pdev->dev), pdev);
+	/* there is no PCI function to disable on close */
+	mdev->regions_in_use = 1;
 
-	/* allocate zeroed device book keeping structure */
-	mdev = alloc_dev_instance(pdev);
-	if (!mdev)
-		return NULL;
-	mdev->mod_name = mname;
-	mdev->user_max = *user_max;
-	mdev->h2c_channel_max = *h2c_channel_max;
-	mdev->c2h_channel_max = *c2h_channel_max;
+	rv = mdlx_emu_map_bars(mdev);
+	if (rv)
+		return rv;
 
-	mdlx_device_flag_set(mdev, MDEV_FLAG_OFFLINE);
-	mdev_list_add(mdev);
+	channel_interrupts_disable(mdev, ~0);
+	user_interrupts_disable(mdev, ~0);
 
-	if (mdev->user_max == 0 || mdev->user_max > MAX_USER_IRQ)
-		mdev->user_max = MAX_USER_IRQ;
-	if (mdev->h2c_channel_max == 0 ||
-	    mdev->h2c_channel_max > MDLX_CHANNEL_NUM_MAX)
+	rv = probe_engines(mdev);
+	if (rv)
+		goto err_engines;
+
+	rv = mdlx_emu_irq_setup(mdev, mdlx_isr);
+	if (rv)
+		goto err_engines;
+
+	if (!poll_mode)
+		channel_interrupts_enable(mdev, ~0);
+
+	pr_info("%s emulated, %d H2C, %d C2H engines.\n",
+		dev_name(&mdev->pdev->dev), mdev->h2c_channel_max,
+		mdev->c2h_channel_max);
+	return 0;
+
+err_engines:
+	remove_engines(mdev);
+	unmap_bars(mdev, mdev->pdev);
+	return rv;
+}
+#endif
+
+void *mdlx_device_open(const char *mname, struct pci_dev *pdev, int *user_max,
+		       int *h2c_channel_max, int *c2h_channel_max)
+{
+	struct mdlx_dev *mdev = NULL;
+	int rv = 0;
+
+	pr_info("%s device %s, 0x%p.\n", mname, dev_name(&pdev->dev), pdev);
+
+	/* allocate zeroed device book keeping structure */
+	mdev = alloc_dev_instance(pdev);
+	if (!mdev)
+		return NULL;
+	mdev->mod_name = mname;
+	mdev->user_max = *user_max;
+	mdev->h2c_channel_max = *h2c_channel_max;
+	mdev->c2h_channel_max = *c2h_channel_max;
+
+	mdlx_device_flag_set(mdev, MDEV_FLAG_OFFLINE);
+	mdev_list_add(mdev);
+
+	if (mdev->user_max == 0 || mdev->user_max > MAX_USER_IRQ)
+		mdev->user_max = MAX_USER_IRQ;
+	if (mdev->h2c_channel_max == 0 ||
+	    mdev->h2c_channel_max > MDLX_CHANNEL_NUM_MAX)
 		mdev->h2c_channel_max = MDLX_CHANNEL_NUM_MAX;
 	if (mdev->c2h_channel_max == 0 ||
 	    mdev->c2h_channel_max > MDLX_CHANNEL_NUM_MAX)
 		mdev->c2h_channel_max = MDLX_CHANNEL_NUM_MAX;
 
+#ifdef __MDLX_EMU__
+	if (mdlx_emu_pdev(pdev)) {
+		rv = emu_device_open(mdev);
+		if (rv)
+			goto err_enable;
+		goto done;
+	}
+#endif
+
 	rv = pci_enable_device(pdev);
 	if (rv) {
 		dbg_init("pci_enable_device() failed, %d.\n", rv);
@@ -4483,6 +5436,11 @@ void *mdlx_device_open(const char *mname, struct pci_dev *pdev, int *user_max,
 	/* Flush writes */
 	read_interrupts(mdev);
 
+	pio_mbox_map(mdev);
+
+#ifdef __MDLX_EMU__
+done:
+#endif
 	*user_max = mdev->user_max;
 	*h2c_channel_max = mdev->h2c_channel_max;
 	*c2h_channel_max = mdev->c2h_channel_max;
@@ -4509,209 +5467,899 @@ err_enable:
 	kfree(mdev);
 	return NULL;
 }
-EXPORT_SYMBOL_GPL(mdlx_device_open);
+EXPORT_SYMBOL_GPL(mdlx_device_open);
+
+void mdlx_device_close(struct pci_dev *pdev, void *dev_hndl)
+{
+	struct mdlx_dev *mdev = (struct mdlx_dev *)dev_hndl;
+	int i;
+
+	dbg_init("pdev 0x%p, mdev 0x%p.\n", pdev, dev_hndl);
+
+	if (!dev_hndl)
+		return;
+
+	if (debug_check_dev_hndl(__func__, pdev, dev_hndl) < 0)
+		return;
+
+	dbg_sg("remove(dev = 0x%p) where pdev->dev.driver_data = 0x%p\n", pdev,
+	       mdev);
+	if (mdev->pdev != pdev) {
+		dbg_sg("pci_dev(0x%lx) != pdev(0x%lx)\n",
+		       (unsigned long)mdev->pdev, (unsigned long)pdev);
+	}
+
+	/* take the card out of the pool before tearing it down */
+	mdlx_device_flag_set(mdev, MDEV_FLAG_OFFLINE);
+	mdev_pool_drain(mdev);
+
+	channel_interrupts_disable(mdev, ~0);
+	user_interrupts_disable(mdev, ~0);
+	read_interrupts(mdev);
+
+	irq_teardown(mdev);
+	disable_msi_msix(mdev, pdev);
+
+	for (i = 0; i < 16; i++) {
+		hrtimer_cancel(&mdev->user_irq[i].coal_timer);
+		if (mdev->user_irq[i].trigger)
+			eventfd_ctx_put(mdev->user_irq[i].trigger);
+	}
+
+	remove_engines(mdev);
+	pio_mbox_unmap(mdev);
+	unmap_bars(mdev, pdev);
+
+	if (mdev->got_regions) {
+		dbg_init("pci_release_regions 0x%p.\n", pdev);
+		pci_release_regions(pdev);
+	}
+
+	if (!mdev->regions_in_use) {
+		dbg_init("pci_disable_device 0x%p.\n", pdev);
+		pci_disable_device(pdev);
+	}
+
+	mdev_list_remove(mdev);
+
+	kfree(mdev);
+}
+EXPORT_SYMBOL_GPL(mdlx_device_close);
+
+void mdlx_device_offline(struct pci_dev *pdev, void *dev_hndl)
+{
+	struct mdlx_dev *mdev = (struct mdlx_dev *)dev_hndl;
+	struct mdlx_engine *engine;
+	int i;
+	int rv;
+
+	if (!dev_hndl)
+		return;
+
+	if (debug_check_dev_hndl(__func__, pdev, dev_hndl) < 0)
+		return;
+
+	pr_info("pdev 0x%p, mdev 0x%p.\n", pdev, mdev);
+	mdlx_device_flag_set(mdev, MDEV_FLAG_OFFLINE);
+
+	/* wait for all engines to be idle */
+	for (i = 0; i < mdev->h2c_channel_max; i++) {
+		unsigned long flags;
+
+		engine = &mdev->engine_h2c[i];
+
+		if (engine->magic == MAGIC_ENGINE) {
+			spin_lock_irqsave(&engine->lock, flags);
+			engine->shutdown |= ENGINE_SHUTDOWN_REQUEST;
+
+			rv = mdlx_engine_stop(engine);
+			if (rv < 0)
+				pr_err("Failed to stop engine\n");
+			else
+				engine->running = 0;
+			spin_unlock_irqrestore(&engine->lock, flags);
+		}
+	}
+
+	for (i = 0; i < mdev->c2h_channel_max; i++) {
+		unsigned long flags;
+
+		engine = &mdev->engine_c2h[i];
+		if (engine->magic == MAGIC_ENGINE) {
+			spin_lock_irqsave(&engine->lock, flags);
+			engine->shutdown |= ENGINE_SHUTDOWN_REQUEST;
+
+			rv = mdlx_engine_stop(engine);
+			if (rv < 0)
+				pr_err("Failed to stop engine\n");
+			else
+				engine->running = 0;
+			spin_unlock_irqrestore(&engine->lock, flags);
+		}
+	}
+
+	/* turn off interrupts */
+	channel_interrupts_disable(mdev, ~0);
+	user_interrupts_disable(mdev, ~0);
+	read_interrupts(mdev);
+	irq_teardown(mdev);
+
+	pr_info("mdev 0x%p, done.\n", mdev);
+}
+EXPORT_SYMBOL_GPL(mdlx_device_offline);
+
+void mdlx_device_online(struct pci_dev *pdev, void *dev_hndl)
+{
+	struct mdlx_dev *mdev = (struct mdlx_dev *)dev_hndl;
+	struct mdlx_engine *engine;
+	unsigned long flags;
+	int i;
+
+	if (!dev_hndl)
+		return;
+
+	if (debug_check_dev_hndl(__func__, pdev, dev_hndl) < 0)
+		return;
+
+	pr_info("pdev 0x%p, mdev 0x%p.\n", pdev, mdev);
+
+	for (i = 0; i < mdev->h2c_channel_max; i++) {
+		engine = &mdev->engine_h2c[i];
+		if (engine->magic == MAGIC_ENGINE) {
+			engine_init_regs(engine);
+			spin_lock_irqsave(&engine->lock, flags);
+			engine->shutdown &= ~ENGINE_SHUTDOWN_REQUEST;
+			spin_unlock_irqrestore(&engine->lock, flags);
+		}
+	}
+
+	for (i = 0; i < mdev->c2h_channel_max; i++) {
+		engine = &mdev->engine_c2h[i];
+		if (engine->magic == MAGIC_ENGINE) {
+			engine_init_regs(engine);
+			spin_lock_irqsave(&engine->lock, flags);
+			engine->shutdown &= ~ENGINE_SHUTDOWN_REQUEST;
+			spin_unlock_irqrestore(&engine->lock, flags);
+		}
+	}
+
+	/* re-write the interrupt table */
+	if (!poll_mode) {
+		irq_setup(mdev, pdev);
+
+		channel_interrupts_enable(mdev, ~0);
+		user_interrupts_enable(mdev, mdev->mask_irq_user);
+		read_interrupts(mdev);
+	}
+
+	mdlx_device_flag_clear(mdev, MDEV_FLAG_OFFLINE);
+	pr_info("mdev 0x%p, done.\n", mdev);
+}
+EXPORT_SYMBOL_GPL(mdlx_device_online);
+
+/*
+ * engine_restart() - Bring a wedged engine back without an offline/online
+ *
+ * New transfers are refused while the engine is stopped and its registers,
+ * writeback address and interrupt enables are programmed again; the rings
+ * and writeback area stay allocated. Transfers of the interrupted run are
+ * completed as far as the engine got and failed from there, transfers
+ * queued behind the run start again on the restarted engine. An engine still
+ * busy on a descriptor after ENGINE_STOP_TIMEOUT_MS is left alone with its
+ * run, it still owns the memory of it.
+ */
+static int engine_restart(struct mdlx_engine *engine)
+{
+	struct mdlx_dev *mdev = engine->mdev;
+	struct mdlx_transfer *transfer, *tmp;
+	enum shutdown_state shutdown;
+	unsigned long flags;
+	bool pending = false;
+	int desc_count = 0;
+	bool in_run;
+	u32 status;
+	int rv = 0;
+
+	if (engine->magic != MAGIC_ENGINE)
+		return -ENODEV;
+	if (engine->cyclic_req || engine->mdlx_perf) {
+		pr_info("%s cyclic or perf run active, not restarted.\n",
+			engine->name);
+		return -EBUSY;
+	}
+
+	/* keep the interrupt handler and held back starts off the engine */
+	if (!poll_mode) {
+		channel_interrupts_disable(mdev, engine->irq_bitmask);
+		pending = cancel_work_sync(&engine->work);
+	}
+	hrtimer_cancel(&engine->coal_timer);
+
+	spin_lock_irqsave(&engine->lock, flags);
+	shutdown = engine->shutdown;
+	engine->shutdown |= ENGINE_SHUTDOWN_REQUEST;
+	if (engine->running)
+		rv = mdlx_engine_stop(engine);
+	spin_unlock_irqrestore(&engine->lock, flags);
+
+	/* the descriptor in flight is waited for out of the lock */
+	if (!rv)
+		rv = readx_poll_timeout(read_register, &engine->regs->status,
+					status, !(status & MDLX_STAT_BUSY),
+					ENGINE_STOP_POLL_US,
+					ENGINE_STOP_TIMEOUT_MS * USEC_PER_MSEC);
+
+	spin_lock_irqsave(&engine->lock, flags);
+	in_run = engine->running;
+	if (!rv && in_run) {
+		desc_count = engine_stop_run(engine);
+		rv = min(desc_count, 0);
+	}
+	if (rv < 0) {
+		/* the run is left to the engine, nothing is released */
+		pr_err("%s does not stop, not restarted, %d.\n", engine->name,
+		       rv);
+		engine->shutdown = shutdown;
+		if (!poll_mode) {
+			channel_interrupts_enable(mdev, engine->irq_bitmask);
+			if (pending)
+				schedule_work(&engine->work);
+		}
+		spin_unlock_irqrestore(&engine->lock, flags);
+		return -EBUSY;
+	}
+
+	list_for_each_entry_safe(transfer, tmp, &engine->transfer_list,
+				 entry) {
+		if (!in_run)
+			break;
+		in_run = transfer != engine->run_last;
+
+		list_del(&transfer->entry);
+		if (desc_count >= transfer->desc_num) {
+			desc_count -= transfer->desc_num;
+			transfer->state = TRANSFER_STATE_COMPLETED;
+		} else {
+			desc_count = 0;
+			transfer->state = TRANSFER_STATE_FAILED;
+		}
+		engine_transfer_completion(engine, transfer);
+	}
+	engine->desc_dequeued = 0;
+	spin_unlock_irqrestore(&engine->lock, flags);
+
+	/* new transfers are still refused */
+	rv = engine_init_regs(engine);
+	if (rv < 0)
+		pr_err("%s failed to reinit, %d.\n", engine->name, rv);
+
+	spin_lock_irqsave(&engine->lock, flags);
+	engine_status_read(engine, 1, 0);
+	if (!poll_mode)
+		channel_interrupts_enable(mdev, engine->irq_bitmask);
+
+	engine->shutdown = shutdown;
+	if (!rv) {
+		engine->wedged = false;
+		rv = engine_service_resume(engine);
+	}
+	spin_unlock_irqrestore(&engine->lock, flags);
+
+	return rv;
+}
+
+int mdlx_device_restart(struct pci_dev *pdev, void *dev_hndl)
+{
+	struct mdlx_dev *mdev = (struct mdlx_dev *)dev_hndl;
+	int rv = 0;
+	int i;
+
+	if (!dev_hndl)
+		return -EINVAL;
+
+	if (debug_check_dev_hndl(__func__, pdev, dev_hndl) < 0)
+		return -EINVAL;
+
+	/* offline has released the interrupts, online restarts the engines */
+	if (mdlx_device_flag_check(mdev, MDEV_FLAG_OFFLINE))
+		return -EBUSY;
+
+	pr_info("pdev 0x%p, mdev 0x%p.\n", pdev, mdev);
+
+	for (i = 0; i < mdev->h2c_channel_max; i++) {
+		int r = engine_restart(&mdev->engine_h2c[i]);
+
+		if (r < 0 && r != -ENODEV)
+			rv = r;
+	}
+	for (i = 0; i < mdev->c2h_channel_max; i++) {
+		int r = engine_restart(&mdev->engine_c2h[i]);
+
+		if (r < 0 && r != -ENODEV)
+			rv = r;
+	}
+
+	/* re-arm the interrupts on the vectors still requested */
+	if (!poll_mode) {
+		if (mdev->msix_enabled) {
+			prog_irq_msix_channel(mdev, 0);
+			prog_irq_msix_user(mdev, 0);
+		}
+		user_interrupts_enable(mdev, mdev->mask_irq_user);
+		read_interrupts(mdev);
+	}
+
+	pr_info("mdev 0x%p, done %d.\n", mdev, rv);
+	return rv;
+}
+EXPORT_SYMBOL_GPL(mdlx_device_restart);
+
+int mdlx_engine_restart(void *dev_hndl, int channel, bool write)
+{
+	struct mdlx_dev *mdev = (struct mdlx_dev *)dev_hndl;
+	struct mdlx_engine *engine;
+
+	if (!dev_hndl)
+		return -EINVAL;
+
+	if (debug_check_dev_hndl(__func__, mdev->pdev, dev_hndl) < 0)
+		return -EINVAL;
+
+	if (mdlx_device_flag_check(mdev, MDEV_FLAG_OFFLINE))
+		return -EBUSY;
+
+	if (channel < 0 || channel >= (write ? mdev->h2c_channel_max :
+					mdev->c2h_channel_max)) {
+		pr_err("channel %d invalid, write %d.\n", channel, write);
+		return -EINVAL;
+	}
+
+	engine = write ? &mdev->engine_h2c[channel] :
+			 &mdev->engine_c2h[channel];
+	if (engine->magic != MAGIC_ENGINE) {
+		pr_err("%s engine %d not present.\n", write ? "h2c" : "c2h",
+			channel);
+		return -ENODEV;
+	}
+
+	return engine_restart(engine);
+}
+EXPORT_SYMBOL_GPL(mdlx_engine_restart);
+
+int mdlx_user_isr_register(void *dev_hndl, unsigned int mask,
+			   irq_handler_t handler, void *dev)
+{
+	struct mdlx_dev *mdev = (struct mdlx_dev *)dev_hndl;
+	int i;
+
+	if (!dev_hndl)
+		return -EINVAL;
+
+	if (debug_check_dev_hndl(__func__, mdev->pdev, dev_hndl) < 0)
+		return -EINVAL;
+
+	for (i = 0; i < mdev->user_max && mask; i++) {
+		unsigned int bit = (1 << i);
+
+		if ((bit & mask) == 0)
+			continue;
+
+		mask &= ~bit;
+		mdev->user_irq[i].handler = handler;
+		mdev->user_irq[i].dev = dev;
+	}
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(mdlx_user_isr_register);
+
+int mdlx_user_isr_enable(void *dev_hndl, unsigned int mask)
+{
+	struct mdlx_dev *mdev = (struct mdlx_dev *)dev_hndl;
+
+	if (!dev_hndl)
+		return -EINVAL;
+
+	if (debug_check_dev_hndl(__func__, mdev->pdev, dev_hndl) < 0)
+		return -EINVAL;
+
+	mdev->mask_irq_user |= mask;
+	/* enable user interrupts */
+	user_interrupts_enable(mdev, mask);
+	read_interrupts(mdev);
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(mdlx_user_isr_enable);
+
+int mdlx_user_isr_disable(void *dev_hndl, unsigned int mask)
+{
+	struct mdlx_dev *mdev = (struct mdlx_dev *)dev_hndl;
+
+	if (!dev_hndl)
+		return -EINVAL;
+
+	if (debug_check_dev_hndl(__func__, mdev->pdev, dev_hndl) < 0)
+		return -EINVAL;
+
+	mdev->mask_irq_user &= ~mask;
+	user_interrupts_disable(mdev, mask);
+	read_interrupts(mdev);
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(mdlx_user_isr_disable);
+
+int mdlx_user_isr_coalesce(void *dev_hndl, unsigned int mask,
+			unsigned int count, unsigned int usecs)
+{
+	struct mdlx_dev *mdev = (struct mdlx_dev *)dev_hndl;
+	unsigned long flags;
+	int i;
+
+	if (!dev_hndl)
+		return -EINVAL;
+
+	if (debug_check_dev_hndl(__func__, mdev->pdev, dev_hndl) < 0)
+		return -EINVAL;
+
+	for (i = 0; i < mdev->user_max && mask; i++) {
+		struct mdlx_user_irq *user_irq = &mdev->user_irq[i];
+		unsigned int bit = (1 << i);
+
+		if ((bit & mask) == 0)
+			continue;
+
+		mask &= ~bit;
+		spin_lock_irqsave(&user_irq->events_lock, flags);
+		user_irq->coal_count = count;
+		user_irq->coal_usecs = usecs;
+		/* do not hold back events pending under the old setting */
+		if (user_irq->events_cnt && !user_irq->events_irq) {
+			user_irq->events_irq = 1;
+			wake_up_interruptible(&user_irq->events_wq);
+		}
+		spin_unlock_irqrestore(&user_irq->events_lock, flags);
+	}
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(mdlx_user_isr_coalesce);
+
+/*
+ * mdlx_engine_coalesce() - Moderate the completion interrupts of an engine
+ *
+ * In interrupt mode an engine run chains up to @count queued transfers and
+ * interrupts once at the end; with @usecs an idle engine also holds back new
+ * aio and persistent transfers until @count are queued or @usecs after the
+ * first, blocking read/write is never held. @count 0 or 1 interrupts on every
+ * transfer. Polled engines ignore the setting.
+ */
+int mdlx_engine_coalesce(struct mdlx_engine *engine, unsigned int count,
+			 unsigned int usecs)
+{
+	unsigned long flags;
+
+	if (!engine || engine->magic != MAGIC_ENGINE)
+		return -EINVAL;
+	if (count > MDLX_TRANSFER_MAX_DESC)
+		return -EINVAL;
+
+	spin_lock_irqsave(&engine->lock, flags);
+	engine->coal_count = count ? count : 1;
+	engine->coal_usecs = usecs;
+	/* do not hold back transfers queued under the old setting */
+	hrtimer_try_to_cancel(&engine->coal_timer);
+	if (!engine->running && !list_empty(&engine->transfer_list) &&
+	    !engine_coal_hold(engine) && !engine_start(engine))
+		pr_err("%s failed to start held back transfers\n",
+		       engine->name);
+	spin_unlock_irqrestore(&engine->lock, flags);
+
+	return 0;
+}
 
-void mdlx_device_close(struct pci_dev *pdev, void *dev_hndl)
+/*
+ * persistent transfers: the descriptors of a request over a pinned buffer and
+ * a fixed card address are built once into a coherent block of their own,
+ * page aligned like the ring, and every start only queues them again
+ */
+
+/* persist_put() - Unlock a transfer from persist_get(), the last user frees */
+static void persist_put(struct mdlx_engine *engine, struct mdlx_persist *p)
 {
-	struct mdlx_dev *mdev = (struct mdlx_dev *)dev_hndl;
+	bool last;
 
-	dbg_init("pdev 0x%p, mdev 0x%p.\n", pdev, dev_hndl);
+	mutex_unlock(&p->lock);
 
-	if (!dev_hndl)
-		return;
+	mutex_lock(&engine->persist_lock);
+	last = !--p->users && p->dead;
+	mutex_unlock(&engine->persist_lock);
+	if (last)
+		persist_free(engine, p);
+}
 
-	if (debug_check_dev_hndl(__func__, pdev, dev_hndl) < 0)
-		return;
+/*
+ * persist_get() - Look up and lock a persistent transfer of @owner
+ *
+ * The transfer is counted as used under persist_lock and only locked after,
+ * p->lock is held across waits. A transfer destroyed meanwhile is not found.
+ */
+static struct mdlx_persist *persist_get(struct mdlx_engine *engine, int id,
+					void *owner)
+{
+	struct mdlx_persist *p = NULL;
+
+	mutex_lock(&engine->persist_lock);
+	if (id >= 0)
+		p = idr_find(&engine->persist_idr, id);
+	if (p && p->owner != owner)
+		p = NULL;
+	if (p)
+		p->users++;
+	mutex_unlock(&engine->persist_lock);
+	if (!p)
+		return NULL;
 
-	dbg_sg("remove(dev = 0x%p) where pdev->dev.driver_data = 0x%p\n", pdev,
-	       mdev);
-	if (mdev->pdev != pdev) {
-		dbg_sg("pci_dev(0x%lx) != pdev(0x%lx)\n",
-		       (unsigned long)mdev->pdev, (unsigned long)pdev);
+	mutex_lock(&p->lock);
+	if (p->dead) {
+		persist_put(engine, p);
+		return NULL;
 	}
 
-	channel_interrupts_disable(mdev, ~0);
-	user_interrupts_disable(mdev, ~0);
-	read_interrupts(mdev);
+	return p;
+}
 
-	irq_teardown(mdev);
-	disable_msi_msix(mdev, pdev);
+/**
+ * mdlx_persist_create() - Build a persistent transfer over @cb
+ *
+ * @cb: pinned buffer with sgt, len and ep_addr set, stays with the transfer
+ * until mdlx_persist_destroy() hands it back
+ * @owner: only calls with the same owner find the transfer
+ *
+ * @return id of the transfer, < 0 on error
+ */
+int mdlx_persist_create(struct mdlx_engine *engine, struct mdlx_io_cb *cb,
+			void *owner)
+{
+	struct mdlx_dev *mdev = engine->mdev;
+	struct sg_table *sgt = &cb->sgt;
+	struct mdlx_request_cb *req;
+	struct mdlx_transfer *xfer;
+	struct mdlx_persist *p;
+	unsigned int nents;
+	int rv;
 
-	remove_engines(mdev);
-	unmap_bars(mdev, pdev);
+	if (engine->magic != MAGIC_ENGINE)
+		return -EINVAL;
 
-	if (mdev->got_regions) {
-		dbg_init("pci_release_regions 0x%p.\n", pdev);
-		pci_release_regions(pdev);
+	nents = pci_map_sg(mdev->pdev, sgt->sgl, sgt->orig_nents, engine->dir);
+	if (!nents) {
+		pr_info("map sgl failed, sgt 0x%p.\n", sgt);
+		return -EIO;
 	}
+	sgt->nents = nents;
 
-	if (!mdev->regions_in_use) {
-		dbg_init("pci_disable_device 0x%p.\n", pdev);
-		pci_disable_device(pdev);
+	req = mdlx_init_request(sgt, cb->ep_addr);
+	if (!req) {
+		rv = -ENOMEM;
+		goto unmap;
+	}
+	/* one transfer, it is never split */
+	if (req->sw_desc_cnt > MDLX_TRANSFER_MAX_DESC) {
+		pr_info("%s persistent xfer of %u desc, max %d.\n",
+			engine->name, req->sw_desc_cnt,
+			MDLX_TRANSFER_MAX_DESC);
+		rv = -E2BIG;
+		goto free_req;
 	}
 
-	mdev_list_remove(mdev);
+	p = kzalloc(sizeof(*p), GFP_KERNEL);
+	if (!p) {
+		rv = -ENOMEM;
+		goto free_req;
+	}
+	mutex_init(&p->lock);
+	p->cb = cb;
+	p->owner = owner;
+
+	/* the descriptors, then the results of C2H streaming */
+	p->size = req->sw_desc_cnt *
+		  (sizeof(struct mdlx_desc) + sizeof(struct mdlx_result));
+	xfer = &p->xfer;
+	xfer->desc_virt = dma_alloc_coherent(&mdev->pdev->dev, p->size,
+					     &xfer->desc_bus, GFP_KERNEL);
+	if (!xfer->desc_virt) {
+		kfree(p);
+		rv = -ENOMEM;
+		goto free_req;
+	}
+	xfer->res_virt = (struct mdlx_result *)(xfer->desc_virt +
+						req->sw_desc_cnt);
+	xfer->res_bus = xfer->desc_bus +
+			req->sw_desc_cnt * sizeof(struct mdlx_desc);
+	xfer->dir = engine->dir;
+#if	LINUX_VERSION_CODE >= KERNEL_VERSION(4,6,0)
+	init_swait_queue_head(&xfer->wq);
+#else
+	init_waitqueue_head(&xfer->wq);
+#endif
 
-	kfree(mdev);
+	transfer_desc_init(xfer, req->sw_desc_cnt);
+	transfer_build(engine, req, xfer, req->sw_desc_cnt);
+	/* the block starts page aligned, like ring slot 0 */
+	xfer->desc_adjacent = mdlx_desc_ring_adjacent(0, req->sw_desc_cnt);
+	mdlx_desc_chain_terminate(xfer->desc_virt, req->sw_desc_cnt);
+	xfer->desc_num = req->sw_desc_cnt;
+	xfer->last_in_request = 1;
+	xfer->sgt = sgt;
+	mdlx_request_free(req);
+
+	mutex_lock(&engine->persist_lock);
+	rv = idr_alloc(&engine->persist_idr, p, 0, 0, GFP_KERNEL);
+	mutex_unlock(&engine->persist_lock);
+	if (rv < 0)
+		persist_free(engine, p);
+
+	dbg_tfr("%s persistent xfer %d, %u bytes, %d desc.\n", engine->name,
+		rv, xfer->len, xfer->desc_num);
+	return rv;
+
+free_req:
+	mdlx_request_free(req);
+unmap:
+	pci_unmap_sg(mdev->pdev, sgt->sgl, sgt->orig_nents, engine->dir);
+	sgt->nents = 0;
+	return rv;
 }
-EXPORT_SYMBOL_GPL(mdlx_device_close);
 
-void mdlx_device_offline(struct pci_dev *pdev, void *dev_hndl)
+/**
+ * mdlx_persist_start() - Queue a persistent transfer again
+ *
+ * @return 0 once queued, -EBUSY while the previous start is in flight
+ */
+int mdlx_persist_start(struct mdlx_engine *engine, int id, void *owner)
 {
-	struct mdlx_dev *mdev = (struct mdlx_dev *)dev_hndl;
-	struct mdlx_engine *engine;
-	int i;
+	struct mdlx_persist *p = persist_get(engine, id, owner);
+	struct mdlx_transfer *xfer;
+	struct mdlx_desc *last;
+	struct sg_table *sgt;
 	int rv;
 
-	if (!dev_hndl)
-		return;
+	if (!p)
+		return -ENOENT;
 
-	if (debug_check_dev_hndl(__func__, pdev, dev_hndl) < 0)
-		return;
+	xfer = &p->xfer;
+	if (READ_ONCE(xfer->state) == TRANSFER_STATE_SUBMITTED) {
+		rv = -EBUSY;
+		goto unlock;
+	}
 
-	pr_info("pdev 0x%p, mdev 0x%p.\n", pdev, mdev);
-	mdlx_device_flag_set(mdev, MDEV_FLAG_OFFLINE);
+	/* a batched run left the last descriptor linked to the next */
+	last = xfer->desc_virt + xfer->desc_num - 1;
+	mdlx_desc_link(last, NULL, 0);
+	mdlx_desc_control_set(last, MDLX_DESC_STOPPED | MDLX_DESC_EOP |
+			      MDLX_DESC_COMPLETED);
+	xfer->desc_skip = 0;
 
-	/* wait for all engines to be idle */
-	for (i = 0; i < mdev->h2c_channel_max; i++) {
-		unsigned long flags;
+	sgt = xfer->sgt;
+	dma_sync_sg_for_device(&engine->mdev->pdev->dev, sgt->sgl,
+			       sgt->orig_nents, engine->dir);
+	rv = transfer_queue(engine, xfer);
 
-		engine = &mdev->engine_h2c[i];
+unlock:
+	persist_put(engine, p);
+	return rv;
+}
 
-		if (engine->magic == MAGIC_ENGINE) {
-			spin_lock_irqsave(&engine->lock, flags);
-			engine->shutdown |= ENGINE_SHUTDOWN_REQUEST;
+/**
+ * mdlx_persist_wait() - Result of the last start of a persistent transfer
+ *
+ * @timeout_ms: 0 only polls, the transfer stays in flight and -EAGAIN is
+ * returned until it is done; otherwise a transfer not done in time is
+ * cancelled like in transfer_wait()
+ *
+ * @return bytes transferred, < 0 on error
+ */
+ssize_t mdlx_persist_wait(struct mdlx_engine *engine, int id, void *owner,
+			  unsigned int timeout_ms)
+{
+	struct mdlx_persist *p = persist_get(engine, id, owner);
+	struct mdlx_transfer *xfer;
+	struct sg_table *sgt;
+	unsigned long flags;
+	ssize_t rv;
+	int i;
 
-			rv = mdlx_engine_stop(engine);
-			if (rv < 0)
-				pr_err("Failed to stop engine\n");
-			else
-				engine->running = 0;
-			spin_unlock_irqrestore(&engine->lock, flags);
-		}
+	if (!p)
+		return -ENOENT;
+
+	xfer = &p->xfer;
+	if (READ_ONCE(xfer->state) == TRANSFER_STATE_NEW) {
+		rv = -EINVAL;
+		goto unlock;
 	}
 
-	for (i = 0; i < mdev->c2h_channel_max; i++) {
-		unsigned long flags;
+	if (READ_ONCE(xfer->state) == TRANSFER_STATE_SUBMITTED) {
+		if (poll_mode && timeout_ms)
+			engine_service_poll(engine, xfer->desc_num);
+		else if (poll_mode)
+			engine_service_poll_try(engine);
+		else if (timeout_ms)
+			xlx_wait_event_interruptible_timeout(
+				xfer->wq,
+				(xfer->state != TRANSFER_STATE_SUBMITTED),
+				msecs_to_jiffies(timeout_ms));
+	}
 
-		engine = &mdev->engine_c2h[i];
-		if (engine->magic == MAGIC_ENGINE) {
-			spin_lock_irqsave(&engine->lock, flags);
-			engine->shutdown |= ENGINE_SHUTDOWN_REQUEST;
+	if (READ_ONCE(xfer->state) == TRANSFER_STATE_SUBMITTED && timeout_ms) {
+		pr_info("persistent xfer %d, %s.\n", id,
+			signal_pending(current) ? "interrupted" : "timed out");
+		rv = transfer_cancel_sync(engine, xfer);
+		if (rv < 0)
+			pr_err("%s failed to cancel xfer %d, %zd.\n",
+			       engine->name, id, rv);
+		if (rv == -EREMOTEIO)
+			goto unlock;
+	}
 
-			rv = mdlx_engine_stop(engine);
-			if (rv < 0)
-				pr_err("Failed to stop engine\n");
-			else
-				engine->running = 0;
-			spin_unlock_irqrestore(&engine->lock, flags);
+	spin_lock_irqsave(&engine->lock, flags);
+
+	switch (xfer->state) {
+	case TRANSFER_STATE_COMPLETED:
+		/* For C2H streaming use writeback results */
+		if (engine->streaming && engine->dir == DMA_FROM_DEVICE) {
+			rv = 0;
+			for (i = 0; i < xfer->desc_num; i++)
+				rv += xfer->res_virt[i].length;
+		} else {
+			rv = xfer->len;
 		}
+		break;
+	case TRANSFER_STATE_SUBMITTED:
+		rv = -EAGAIN;
+		break;
+	case TRANSFER_STATE_FAILED:
+		rv = -EIO;
+		break;
+	default:
+		rv = signal_pending(current) ? -ERESTARTSYS : -ETIMEDOUT;
+		break;
 	}
+	spin_unlock_irqrestore(&engine->lock, flags);
 
-	/* turn off interrupts */
-	channel_interrupts_disable(mdev, ~0);
-	user_interrupts_disable(mdev, ~0);
-	read_interrupts(mdev);
-	irq_teardown(mdev);
+	if (rv > 0) {
+		sgt = xfer->sgt;
+		dma_sync_sg_for_cpu(&engine->mdev->pdev->dev, sgt->sgl,
+				    sgt->orig_nents, engine->dir);
+	}
 
-	pr_info("mdev 0x%p, done.\n", mdev);
+unlock:
+	persist_put(engine, p);
+	return rv;
 }
-EXPORT_SYMBOL_GPL(mdlx_device_offline);
 
-void mdlx_device_online(struct pci_dev *pdev, void *dev_hndl)
+/**
+ * mdlx_persist_destroy() - Cancel and free a persistent transfer
+ *
+ * @id: < 0 picks any transfer of @owner, to drop them all on release
+ *
+ * @return the buffer given to mdlx_persist_create(), ERR_PTR on error
+ */
+struct mdlx_io_cb *mdlx_persist_destroy(struct mdlx_engine *engine, int id,
+					void *owner)
 {
-	struct mdlx_dev *mdev = (struct mdlx_dev *)dev_hndl;
-	struct mdlx_engine *engine;
+	struct mdlx_persist *p;
+	struct mdlx_io_cb *cb;
 	unsigned long flags;
+	bool busy;
 	int i;
 
-	if (!dev_hndl)
-		return;
-
-	if (debug_check_dev_hndl(__func__, pdev, dev_hndl) < 0)
-		return;
-
-	pr_info("pdev 0x%p, mdev 0x%p.\n", pdev, mdev);
-
-	for (i = 0; i < mdev->h2c_channel_max; i++) {
-		engine = &mdev->engine_h2c[i];
-		if (engine->magic == MAGIC_ENGINE) {
-			engine_init_regs(engine);
-			spin_lock_irqsave(&engine->lock, flags);
-			engine->shutdown &= ~ENGINE_SHUTDOWN_REQUEST;
-			spin_unlock_irqrestore(&engine->lock, flags);
-		}
-	}
-
-	for (i = 0; i < mdev->c2h_channel_max; i++) {
-		engine = &mdev->engine_c2h[i];
-		if (engine->magic == MAGIC_ENGINE) {
-			engine_init_regs(engine);
-			spin_lock_irqsave(&engine->lock, flags);
-			engine->shutdown &= ~ENGINE_SHUTDOWN_REQUEST;
-			spin_unlock_irqrestore(&engine->lock, flags);
+	if (id < 0) {
+		mutex_lock(&engine->persist_lock);
+		idr_for_each_entry(&engine->persist_idr, p, i) {
+			if (p->owner == owner)
+				break;
 		}
+		mutex_unlock(&engine->persist_lock);
+		if (!p)
+			return ERR_PTR(-ENOENT);
+		id = i;
 	}
 
-	/* re-write the interrupt table */
-	if (!poll_mode) {
-		irq_setup(mdev, pdev);
+	p = persist_get(engine, id, owner);
+	if (!p)
+		return ERR_PTR(-ENOENT);
 
-		channel_interrupts_enable(mdev, ~0);
-		user_interrupts_enable(mdev, mdev->mask_irq_user);
-		read_interrupts(mdev);
+	if (READ_ONCE(p->xfer.state) == TRANSFER_STATE_SUBMITTED)
+		transfer_cancel_sync(engine, &p->xfer);
+	spin_lock_irqsave(&engine->lock, flags);
+	busy = p->xfer.state == TRANSFER_STATE_SUBMITTED;
+	spin_unlock_irqrestore(&engine->lock, flags);
+	if (busy) {
+		pr_err("%s persistent xfer %d still queued.\n", engine->name,
+		       id);
+		persist_put(engine, p);
+		return ERR_PTR(-EBUSY);
 	}
 
-	mdlx_device_flag_clear(mdev, MDEV_FLAG_OFFLINE);
-	pr_info("mdev 0x%p, done.\n", mdev);
+	mutex_lock(&engine->persist_lock);
+	idr_remove(&engine->persist_idr, id);
+	p->dead = true;
+	mutex_unlock(&engine->persist_lock);
+
+	/* callers still waiting on p->lock find it dead, the last one frees */
+	cb = persist_unmap(engine, p);
+	persist_put(engine, p);
+	return cb;
 }
-EXPORT_SYMBOL_GPL(mdlx_device_online);
 
-int mdlx_device_restart(struct pci_dev *pdev, void *dev_hndl)
+u64 mdlx_user_irq_count(void *dev_hndl, unsigned int user)
 {
 	struct mdlx_dev *mdev = (struct mdlx_dev *)dev_hndl;
+	struct mdlx_user_irq *user_irq;
+	unsigned long flags;
+	u64 count;
 
-	if (!dev_hndl)
-		return -EINVAL;
+	if (!dev_hndl || user >= mdev->user_max)
+		return 0;
 
-	if (debug_check_dev_hndl(__func__, pdev, dev_hndl) < 0)
-		return -EINVAL;
+	user_irq = &mdev->user_irq[user];
+	spin_lock_irqsave(&user_irq->events_lock, flags);
+	count = user_irq->events_total;
+	spin_unlock_irqrestore(&user_irq->events_lock, flags);
 
-	pr_info("NOT implemented, 0x%p.\n", mdev);
-	return -EINVAL;
+	return count;
 }
-EXPORT_SYMBOL_GPL(mdlx_device_restart);
+EXPORT_SYMBOL_GPL(mdlx_user_irq_count);
 
-int mdlx_user_isr_register(void *dev_hndl, unsigned int mask,
-			   irq_handler_t handler, void *dev)
+int mdlx_user_irq_wait(void *dev_hndl, unsigned int user, u64 count,
+		       int timeout_ms)
 {
 	struct mdlx_dev *mdev = (struct mdlx_dev *)dev_hndl;
-	int i;
-
-	if (!dev_hndl)
-		return -EINVAL;
+	struct mdlx_user_irq *user_irq;
+	long rv;
 
-	if (debug_check_dev_hndl(__func__, mdev->pdev, dev_hndl) < 0)
+	if (!dev_hndl || user >= mdev->user_max)
 		return -EINVAL;
 
-	for (i = 0; i < mdev->user_max && mask; i++) {
-		unsigned int bit = (1 << i);
+	user_irq = &mdev->user_irq[user];
+	rv = wait_event_interruptible_timeout(user_irq->total_wq,
+			mdlx_user_irq_count(mdev, user) != count,
+			msecs_to_jiffies(timeout_ms));
+	if (rv < 0)
+		return rv;
+	return rv ? 0 : -ETIMEDOUT;
+}
+EXPORT_SYMBOL_GPL(mdlx_user_irq_wait);
 
-		if ((bit & mask) == 0)
-			continue;
+/* replace the eventfd in *slot, fd < 0 just drops the current one */
+static int eventfd_swap(struct eventfd_ctx **slot, spinlock_t *lock, int fd)
+{
+	struct eventfd_ctx *ctx = NULL;
+	struct eventfd_ctx *old;
+	unsigned long flags;
 
-		mask &= ~bit;
-		mdev->user_irq[i].handler = handler;
-		mdev->user_irq[i].dev = dev;
+	if (fd >= 0) {
+		ctx = eventfd_ctx_fdget(fd);
+		if (IS_ERR(ctx))
+			return PTR_ERR(ctx);
 	}
 
+	spin_lock_irqsave(lock, flags);
+	old = *slot;
+	*slot = ctx;
+	spin_unlock_irqrestore(lock, flags);
+
+	if (old)
+		eventfd_ctx_put(old);
 	return 0;
 }
-EXPORT_SYMBOL_GPL(mdlx_user_isr_register);
 
-int mdlx_user_isr_enable(void *dev_hndl, unsigned int mask)
+int mdlx_user_isr_eventfd(void *dev_hndl, unsigned int user, int fd)
 {
 	struct mdlx_dev *mdev = (struct mdlx_dev *)dev_hndl;
+	struct mdlx_user_irq *user_irq;
 
 	if (!dev_hndl)
 		return -EINVAL;
@@ -4719,18 +6367,20 @@ int mdlx_user_isr_enable(void *dev_hndl, unsigned int mask)
 	if (debug_check_dev_hndl(__func__, mdev->pdev, dev_hndl) < 0)
 		return -EINVAL;
 
-	mdev->mask_irq_user |= mask;
-	/* enable user interrupts */
-	user_interrupts_enable(mdev, mask);
-	read_interrupts(mdev);
+	if (user >= mdev->user_max) {
+		pr_err("user irq %u >= max %d.\n", user, mdev->user_max);
+		return -EINVAL;
+	}
+	user_irq = &mdev->user_irq[user];
 
-	return 0;
+	return eventfd_swap(&user_irq->trigger, &user_irq->events_lock, fd);
 }
-EXPORT_SYMBOL_GPL(mdlx_user_isr_enable);
+EXPORT_SYMBOL_GPL(mdlx_user_isr_eventfd);
 
-int mdlx_user_isr_disable(void *dev_hndl, unsigned int mask)
+int mdlx_engine_eventfd(void *dev_hndl, int channel, bool write, int fd)
 {
 	struct mdlx_dev *mdev = (struct mdlx_dev *)dev_hndl;
+	struct mdlx_engine *engine;
 
 	if (!dev_hndl)
 		return -EINVAL;
@@ -4738,13 +6388,23 @@ int mdlx_user_isr_disable(void *dev_hndl, unsigned int mask)
 	if (debug_check_dev_hndl(__func__, mdev->pdev, dev_hndl) < 0)
 		return -EINVAL;
 
-	mdev->mask_irq_user &= ~mask;
-	user_interrupts_disable(mdev, mask);
-	read_interrupts(mdev);
+	if (channel < 0 || channel >= (write ? mdev->h2c_channel_max :
+					mdev->c2h_channel_max)) {
+		pr_err("channel %d invalid, write %d.\n", channel, write);
+		return -EINVAL;
+	}
 
-	return 0;
+	engine = write ? &mdev->engine_h2c[channel] :
+			 &mdev->engine_c2h[channel];
+	if (engine->magic != MAGIC_ENGINE) {
+		pr_err("%s engine %d not present.\n", write ? "h2c" : "c2h",
+			channel);
+		return -ENODEV;
+	}
+
+	return eventfd_swap(&engine->trigger, &engine->lock, fd);
 }
-EXPORT_SYMBOL_GPL(mdlx_user_isr_disable);
+EXPORT_SYMBOL_GPL(mdlx_engine_eventfd);
 
 #ifdef __LIBMDLX_MOD__
 static int __init mdlx_base_init(void)
@@ -31,9 +31,13 @@
 #include <linux/kernel.h>
 #include <linux/pci.h>
 #include <linux/workqueue.h>
+#include <linux/hrtimer.h>
+#include <linux/eventfd.h>
+#include <linux/idr.h>
 #if	KERNEL_VERSION(4, 6, 0) <= LINUX_VERSION_CODE
 #include <linux/swait.h>
 #endif
+#include "libmdlx_desc.h"
 /*
  *  if the config bar is fixed, the driver does not neeed to search through
  *  all of the bars
@@ -60,20 +64,12 @@
  * .REG_IRQ_OUT	(reg_irq_from_ch[(channel*2) +: 2]),
  */
 #define MDLX_ENG_IRQ_NUM (1)
-#define MAX_EXTRA_ADJ (15)
 #define RX_STATUS_EOP (1)
 
 /* Target internal components on MDLX control BAR */
 #define MDLX_OFS_INT_CTRL	(0x2000UL)
 #define MDLX_OFS_CONFIG		(0x3000UL)
 
-/* maximum number of desc per transfer request */
-#define MDLX_TRANSFER_MAX_DESC (2048)
-
-/* maximum size of a single DMA transfer descriptor */
-#define MDLX_DESC_BLEN_BITS	28
-#define MDLX_DESC_BLEN_MAX	((1 << (MDLX_DESC_BLEN_BITS)) - 1)
-
 /* bits of the SG DMA control register */
 #define MDLX_CTRL_RUN_STOP			(1UL << 0)
 #define MDLX_CTRL_IE_DESC_STOPPED		(1UL << 1)
@@ -147,11 +143,6 @@
 	(MDLX_STAT_COMMON_ERR_MASK | MDLX_STAT_DESC_ERR_MASK | \
 	 MDLX_STAT_C2H_R_ERR_MASK)
 
-/* bits of the SGDMA descriptor control field */
-#define MDLX_DESC_STOPPED	(1UL << 0)
-#define MDLX_DESC_COMPLETED	(1UL << 1)
-#define MDLX_DESC_EOP		(1UL << 4)
-
 #define MDLX_PERF_RUN	(1UL << 0)
 #define MDLX_PERF_CLEAR	(1UL << 1)
 #define MDLX_PERF_AUTO	(1UL << 2)
@@ -166,8 +157,6 @@
 /* for C2H AXI-ST mode */
 #define CYCLIC_RX_PAGES_MAX	256
 
-#define LS_BYTE_MASK 0x000000FFUL
-
 #define BLOCK_ID_MASK 0xFFF00000
 #define BLOCK_ID_HEAD 0x1FC00000
 
@@ -182,8 +171,6 @@
 
 #define MAX_DESC_BUS_ADDR (0xffffffffULL)
 
-#define DESC_MAGIC 0xAD4B0000UL
-
 #define C2H_WB 0x52B4UL
 
 #define MAX_NUM_ENGINES (MDLX_CHANNEL_NUM_MAX * 2)
@@ -194,11 +181,6 @@
 
 #define BYPASS_MODE_SPACING 0x0100
 
-/* obtain the 32 most significant (high) bits of a 32-bit or 64-bit address */
-#define PCI_DMA_H(addr) ((addr >> 16) >> 16)
-/* obtain the 32 least significant (low) bits of a 32-bit or 64-bit address */
-#define PCI_DMA_L(addr) (addr & 0xffffffffUL)
-
 #ifndef VM_RESERVED
 	#define VMEM_FLAGS (VM_IO | VM_DONTEXPAND | VM_DONTDUMP)
 #else
@@ -370,31 +352,23 @@ struct mdlx_poll_wb {
 	u32 reserved_1[7];
 } __packed;
 
-
-/**
- * Descriptor for a single contiguous memory block transfer.
- *
- * Multiple descriptors are linked by means of the next pointer. An additional
- * extra adjacent number gives the amount of extra contiguous descriptors.
- *
- * The descriptors are in root complex memory, and the bytes in the 32-bit
- * words must be in little-endian byte ordering.
+/*
+ * Writeback area of a device, one coherent page for all engines, also used
+ * for the completion counts in interrupt mode. The pending bitmap is the
+ * summary a poller scans before it touches any engine, each writeback word
+ * then sits on a cache line of its own.
  */
-struct mdlx_desc {
-	u32 control;
-	u32 bytes;		/* transfer length in bytes */
-	u32 src_addr_lo;	/* source address (low 32-bit) */
-	u32 src_addr_hi;	/* source address (high 32-bit) */
-	u32 dst_addr_lo;	/* destination address (low 32-bit) */
-	u32 dst_addr_hi;	/* destination address (high 32-bit) */
-	/*
-	 * next descriptor in the single-linked list of descriptors;
-	 * this is the PCIe (bus) address of the next descriptor in the
-	 * root complex memory
-	 */
-	u32 next_lo;		/* next desc address (low 32-bit) */
-	u32 next_hi;		/* next desc address (high 32-bit) */
-} __packed;
+#define MDLX_WB_SLOTS	(2 * MDLX_CHANNEL_NUM_MAX)
+
+struct mdlx_wb_slot {
+	struct mdlx_poll_wb wb;
+} ____cacheline_aligned;
+
+struct mdlx_wb_area {
+	unsigned long pending;	/* bit per slot, engine has transfers queued */
+	struct mdlx_wb_slot slot[MDLX_WB_SLOTS];
+};
+
 
 /* 32 bytes (four 32-bit words) or 64 bytes (eight 32-bit words) */
 struct mdlx_result {
@@ -403,11 +377,6 @@ struct mdlx_result {
 	u32 reserved_1[6];	/* padding */
 } __packed;
 
-struct sw_desc {
-	dma_addr_t addr;
-	unsigned int len;
-};
-
 /* Describes a (SG DMA) single transfer for the engine */
 struct mdlx_transfer {
 	struct list_head entry;		/* queue of non-completed transfers */
@@ -418,6 +387,7 @@ struct mdlx_transfer {
 	int desc_adjacent;		/* adjacent descriptors at desc_bus */
 	int desc_num;			/* number of descriptors in transfer */
 	int desc_index;			/* index for first descriptor in transfer */
+	int desc_skip;			/* leading descriptors already done */
 	enum dma_data_direction dir;
 #if	KERNEL_VERSION(4, 6, 0) <= LINUX_VERSION_CODE
 	struct swait_queue_head wq;
@@ -428,6 +398,8 @@ struct mdlx_transfer {
 	enum transfer_state state;	/* state of the transfer */
 	unsigned int flags;
 #define XFER_FLAG_NEED_UNMAP	0x1
+#define XFER_FLAG_ORPHAN	0x2	/* given up on a wedged engine */
+#define XFER_FLAG_SYNC		0x4	/* its submitter sleeps on it */
 	int cyclic;			/* flag if transfer is cyclic */
 	int last_in_request;		/* flag if last within request */
 	unsigned int len;
@@ -435,6 +407,17 @@ struct mdlx_transfer {
 	struct mdlx_io_cb *cb;
 };
 
+/* a transfer built once and queued again on every start */
+struct mdlx_persist {
+	struct mdlx_transfer xfer;	/* descriptors in their own block */
+	struct mutex lock;		/* serializes start, wait and destroy */
+	size_t size;			/* of the descriptor and result block */
+	struct mdlx_io_cb *cb;		/* pinned buffer, owned by the caller */
+	void *owner;			/* only the owner finds it by id */
+	unsigned int users;		/* persist_get() calls, under persist_lock */
+	bool dead;			/* destroyed, freed by the last user */
+};
+
 struct mdlx_request_cb {
 	struct sg_table *sgt;
 	unsigned int total_len;
@@ -448,6 +431,14 @@ struct mdlx_request_cb {
 	struct sw_desc sdesc[0];
 };
 
+/* engine performance counters over a sampling interval */
+struct mdlx_perf_sample {
+	u64 cycles;		/* engine busy cycles */
+	u64 data;		/* cycles moving data */
+	u64 pending;		/* cycles waiting on pending host requests */
+	u64 elapsed_ns;
+};
+
 struct mdlx_engine {
 	unsigned long magic;	/* structure ID for sanity checks */
 	struct mdlx_dev *mdev;	/* parent device */
@@ -460,9 +451,11 @@ struct mdlx_engine {
 	struct engine_regs *regs;		/* Control reg BAR offset */
 	struct engine_sgdma_regs *sgdma_regs;	/* SGDAM reg BAR offset */
 	u32 bypass_offset;			/* Bypass mode BAR offset */
+	spinlock_t bypass_lock;			/* serializes bypass port bursts */
 
 	/* Engine state, configuration and flags */
 	enum shutdown_state shutdown;	/* engine shutdown mode */
+	bool wedged;		/* did not stop, see transfer_cancel_sync() */
 	enum dma_data_direction dir;
 	int device_open;	/* flag if engine node open, ST mode only */
 	int running;		/* flag if the driver started engine */
@@ -474,6 +467,7 @@ struct mdlx_engine {
 	int channel;		/* engine indices */
 	int max_extra_adj;	/* descriptor prefetch capability */
 	int desc_dequeued;	/* num descriptors of completed transfers */
+	struct mdlx_transfer *run_last;	/* last transfer of the current run */
 	u32 status;		/* last known status of device */
 	/* only used for MSIX mode to store per-engine interrupt mask value */
 	u32 interrupt_enable_mask_value;
@@ -488,6 +482,10 @@ struct mdlx_engine {
 	struct sg_table cyclic_sgt;
     u8 *perf_buf_virt;
     dma_addr_t perf_buf_bus; /* bus address */
+	size_t perf_buf_size;	/* one buffer per descriptor of the loop */
+	u64 perf_start_ns;	/* ktime at perf start */
+	spinlock_t perf_lock;	/* protects perf_last */
+	struct mdlx_perf_sample perf_last;	/* counters at the last sample */
 	u8 eop_found; /* used only for cyclic(rx:c2h) */
 	int eop_count;
 	int rx_tail;	/* follows the HW */
@@ -499,6 +497,8 @@ struct mdlx_engine {
 
 	/* Members associated with polled mode support */
 	u8 *poll_mode_addr_virt;	/* virt addr for descriptor writeback */
+	int wb_slot;			/* slot in mdev->wb_area */
+	unsigned long poll_expires;	/* jiffies, head transfer poll timeout */
 	dma_addr_t poll_mode_bus;	/* bus addr for descriptor writeback */
 
 	/* Members associated with interrupt mode support */
@@ -508,16 +508,31 @@ struct mdlx_engine {
 	wait_queue_head_t shutdown_wq;	/* wait queue for shutdown sync */
 #endif
 	spinlock_t lock;		/* protects concurrent access */
-	int prev_cpu;			/* remember CPU# of (last) locker */
+	int prev_cpu;			/* CPU of the last submitter */
 	int msix_irq_line;		/* MSI-X vector for this engine */
+	int irq_cpu;			/* CPU the vector is pinned to, or -1 */
 	u32 irq_bitmask;		/* IRQ bit mask for this engine */
 	struct work_struct work;	/* Work queue for interrupt handling */
+	/* completion moderation, protected by lock, see mdlx_engine_coalesce */
+	unsigned int coal_count;	/* transfers chained per engine run */
+	unsigned int coal_usecs;	/* an idle engine waits this long */
+	struct hrtimer coal_timer;	/* starts a partial batch */
 
 	struct mutex desc_lock;		/* protects concurrent access */
 	dma_addr_t desc_bus;
 	struct mdlx_desc *desc;
+	/*
+	 * ring slot accounting, held only to reserve or release slots and
+	 * independent of the completion path's engine->lock
+	 */
+	spinlock_t ring_lock;
 	int desc_idx;			/* current descriptor index */
 	int desc_used;			/* total descriptors used */
+	/* chains started, and those with a short first block, under lock */
+	unsigned long prefetch_chains;
+	unsigned long prefetch_degraded;
+	atomic_t queued;		/* requests in submission, queue depth */
+	atomic64_t inflight_bytes;	/* bytes of the requests in submission */
 
 	/* for performance test support */
 	struct mdlx_performance_ioctl *mdlx_perf;	/* perf test control */
@@ -533,17 +548,38 @@ struct mdlx_engine {
 	/* pending work thread list */
 	/* cpu attached to intr_work */
 	unsigned int intr_work_cpu;
+	/* completions serviced by the thread, and over the last interval */
+	unsigned long cmpl_work;
+	unsigned long cmpl_work_last;
+	unsigned long cmpl_load;
+
+	/* signalled on request completion, protected by lock */
+	struct eventfd_ctx *trigger;
+
+	/* struct mdlx_persist by id, see mdlx_persist_create */
+	struct mutex persist_lock;
+	struct idr persist_idr;
 };
 
 struct mdlx_user_irq {
 	struct mdlx_dev *mdev;		/* parent device */
 	u8 user_idx;			/* 0 ~ 15 */
-	u8 events_irq;			/* accumulated IRQs */
+	u8 events_irq;			/* events ready for the reader */
 	spinlock_t events_lock;		/* lock to safely update events_irq */
 	wait_queue_head_t events_wq;	/* wait queue to sync waiting threads */
 	irq_handler_t handler;
 
 	void *dev;
+
+	u64 events_cnt;			/* IRQs since the last read */
+	u64 events_first;		/* ktime_get_ns() of the first of them */
+	u64 events_last;		/* ktime_get_ns() of the last of them */
+	unsigned int coal_count;	/* wake readers after this many IRQs */
+	unsigned int coal_usecs;	/* or this long after the first one */
+	struct hrtimer coal_timer;	/* flushes a partial batch */
+	struct eventfd_ctx *trigger;	/* signalled on every IRQ */
+	u64 events_total;		/* IRQs since probe, never reset */
+	wait_queue_head_t total_wq;	/* woken on every IRQ */
 };
 
 /* MDLX PCIe device specific book-keeping */
@@ -563,12 +599,21 @@ struct mdlx_dev {
 
 	/* PCIe BAR management */
 	void __iomem *bar[MDLX_BAR_NUM];	/* addresses for mapped BARs */
+	resource_size_t bar_len[MDLX_BAR_NUM];	/* lengths of mapped BARs */
 	int user_bar_idx;	/* BAR index of user logic */
 	int config_bar_idx;	/* BAR index of MDLX config logic */
 	int bypass_bar_idx;	/* BAR index of MDLX bypass logic */
 	int regions_in_use;	/* flag if dev was in use during probe() */
 	int got_regions;	/* flag if probe() obtained the regions */
 
+	atomic_t pool_users;	/* pool requests in flight on this card */
+
+	/* small H2C writes through a user BAR mailbox, see pio_mbox_size */
+	void __iomem *pio_mbox;	/* write-combined mailbox mapping */
+	void *pio_bounce;	/* payload gathered from the sg list */
+	struct mutex pio_lock;	/* one mailbox message at a time */
+	bool pio_stale;		/* a message failed, under pio_lock */
+
 	int user_max;
 	int c2h_channel_max;
 	int h2c_channel_max;
@@ -590,6 +635,8 @@ struct mdlx_dev {
 	u32 mask_irq_c2h;
 	struct mdlx_engine engine_h2c[MDLX_CHANNEL_NUM_MAX];
 	struct mdlx_engine engine_c2h[MDLX_CHANNEL_NUM_MAX];
+	struct mdlx_wb_area *wb_area;	/* completion count writebacks */
+	dma_addr_t wb_area_bus;
 
 	/* SD_Accel specific */
 	enum dev_capabilities capabilities;
@@ -643,6 +690,16 @@ static inline void mdlx_device_flag_clear(struct mdlx_dev *mdev, unsigned int f)
 	spin_unlock_irqrestore(&mdev->lock, flags);
 }
 
+/* any transfer queued on a polled engine, read from the device summary */
+static inline int mdlx_engine_poll_pending(struct mdlx_engine *engine)
+{
+	struct mdlx_wb_area *wb_area = engine->mdev->wb_area;
+
+	if (!wb_area)
+		return !list_empty(&engine->transfer_list);
+	return test_bit(engine->wb_slot, &wb_area->pending);
+}
+
 void write_register(u32 value, void *iomem);
 u32 read_register(void *iomem);
 
@@ -655,6 +712,17 @@ int mdlx_performance_submit(struct mdlx_dev *mdev, struct mdlx_engine *engine);
 struct mdlx_transfer *engine_cyclic_stop(struct mdlx_engine *engine);
 void enable_perf(struct mdlx_engine *engine);
 void get_perf_stats(struct mdlx_engine *engine);
+void mdlx_engine_perf_sample(struct mdlx_engine *engine,
+			     struct mdlx_perf_sample *sample);
+int mdlx_engine_coalesce(struct mdlx_engine *engine, unsigned int count,
+			 unsigned int usecs);
+int mdlx_persist_create(struct mdlx_engine *engine, struct mdlx_io_cb *cb,
+			void *owner);
+int mdlx_persist_start(struct mdlx_engine *engine, int id, void *owner);
+ssize_t mdlx_persist_wait(struct mdlx_engine *engine, int id, void *owner,
+			  unsigned int timeout_ms);
+struct mdlx_io_cb *mdlx_persist_destroy(struct mdlx_engine *engine, int id,
+					void *owner);
 
 int mdlx_cyclic_transfer_setup(struct mdlx_engine *engine);
 int mdlx_cyclic_transfer_teardown(struct mdlx_engine *engine);
@@ -662,4 +730,5 @@ ssize_t mdlx_engine_read_cyclic(struct mdlx_engine *engine,
 		char __user *buf, size_t count, int timeout_ms);
 int engine_addrmode_set(struct mdlx_engine *engine, unsigned long arg);
 int engine_service_poll(struct mdlx_engine *engine, u32 expected_desc_count);
+int engine_service_poll_try(struct mdlx_engine *engine);
 #endif /* MDLX_LIB_H */
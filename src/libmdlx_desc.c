@@ -0,0 +1,339 @@
+/*
+ * This file is part of the Medium DMA IP Core driver for Linux
+ *
+ * Copyright (c) 2020-present,  Medium, Inc.
+ * All rights reserved.
+ *
+ * This source code is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ */
+
+#define pr_fmt(fmt)     KBUILD_MODNAME ":%s: " fmt, __func__
+
+#include "libmdlx_desc.h"
+
+/* mdlx_desc_chain_init() - Chains the descriptors as a singly-linked list
+ *
+ * Each descriptor's next * pointer specifies the bus address
+ * of the next descriptor.
+ * Terminates the last descriptor to form a singly-linked list
+ *
+ * @desc_virt first descriptor
+ * @desc_bus bus address of the first descriptor
+ * @count Number of descriptors allocated in continuous PCI bus addressable
+ * memory
+ *
+ * @return 0 on success, EINVAL on failure
+ */
+int mdlx_desc_chain_init(struct mdlx_desc *desc_virt, dma_addr_t desc_bus,
+			 int count)
+{
+	int i;
+	int adj = count - 1;
+	int extra_adj;
+	u32 temp_control;
+
+	if (count > MDLX_TRANSFER_MAX_DESC) {
+		pr_err("Engine cannot transfer more than %d descriptors\n",
+		       MDLX_TRANSFER_MAX_DESC);
+		return -EINVAL;
+	}
+
+	/* create singly-linked list for SG DMA controller */
+	for (i = 0; i < count - 1; i++) {
+		/* increment bus address to next in array */
+		desc_bus += sizeof(struct mdlx_desc);
+
+		/* singly-linked list uses bus addresses */
+		desc_virt[i].next_lo = cpu_to_le32(PCI_DMA_L(desc_bus));
+		desc_virt[i].next_hi = cpu_to_le32(PCI_DMA_H(desc_bus));
+		desc_virt[i].bytes = cpu_to_le32(0);
+
+		/* any adjacent descriptors? */
+		if (adj > 0) {
+			extra_adj = adj - 1;
+			if (extra_adj > MAX_EXTRA_ADJ)
+				extra_adj = MAX_EXTRA_ADJ;
+
+			adj--;
+		} else {
+			extra_adj = 0;
+		}
+
+		temp_control = DESC_MAGIC | (extra_adj << 8);
+
+		desc_virt[i].control = cpu_to_le32(temp_control);
+	}
+	/* { i = number - 1 } */
+	/* zero the last descriptor next pointer */
+	desc_virt[i].next_lo = cpu_to_le32(0);
+	desc_virt[i].next_hi = cpu_to_le32(0);
+	desc_virt[i].bytes = cpu_to_le32(0);
+
+	temp_control = DESC_MAGIC;
+
+	desc_virt[i].control = cpu_to_le32(temp_control);
+
+	return 0;
+}
+
+/* mdlx_desc_link() - Link two descriptors
+ *
+ * Link the first descriptor to a second descriptor, or terminate the first.
+ *
+ * @first first descriptor
+ * @second second descriptor, or NULL if first descriptor must be set as last.
+ * @second_bus bus address of second descriptor
+ */
+void mdlx_desc_link(struct mdlx_desc *first, struct mdlx_desc *second,
+		    dma_addr_t second_bus)
+{
+	/*
+	 * remember reserved control in first descriptor, but zero
+	 * extra_adjacent!
+	 */
+	/* RTO - what's this about?  Shouldn't it be 0x0000c0ffUL? */
+	u32 control = le32_to_cpu(first->control) & 0x0000f0ffUL;
+	/* second descriptor given? */
+	if (second) {
+		/*
+		 * link last descriptor of 1st array to first descriptor of
+		 * 2nd array
+		 */
+		first->next_lo = cpu_to_le32(PCI_DMA_L(second_bus));
+		first->next_hi = cpu_to_le32(PCI_DMA_H(second_bus));
+		WARN_ON(first->next_hi);
+		/* no second descriptor given */
+	} else {
+		/* first descriptor is the last */
+		first->next_lo = 0;
+		first->next_hi = 0;
+	}
+	/* merge magic, extra_adjacent and control field */
+	control |= DESC_MAGIC;
+
+	/* write bytes and next_num */
+	first->control = cpu_to_le32(control);
+}
+
+/* mdlx_desc_adjacent -- Set how many descriptors are adjacent to this one */
+void mdlx_desc_adjacent(struct mdlx_desc *desc, int next_adjacent)
+{
+	int extra_adj = 0;
+	/* remember reserved and control bits */
+	u32 control = le32_to_cpu(desc->control) & 0x0000f0ffUL;
+	u32 max_adj_4k = 0;
+
+	if (next_adjacent > 0) {
+		extra_adj = next_adjacent - 1;
+		if (extra_adj > MAX_EXTRA_ADJ)
+			extra_adj = MAX_EXTRA_ADJ;
+		max_adj_4k = (MDLX_DESC_PAGE_SIZE -
+			      (le32_to_cpu(desc->next_lo) &
+			       (MDLX_DESC_PAGE_SIZE - 1))) / 32 - 1;
+		if (extra_adj > max_adj_4k)
+			extra_adj = max_adj_4k;
+		if (extra_adj < 0) {
+			pr_warn("extra_adj<0, converting it to 0\n");
+			extra_adj = 0;
+		}
+	}
+	/* merge adjacent and control field */
+	control |= DESC_MAGIC | (extra_adj << 8);
+	/* write control and next_adjacent */
+	desc->control = cpu_to_le32(control);
+}
+
+/* mdlx_desc_control -- Set complete control field of a descriptor. */
+int mdlx_desc_control_set(struct mdlx_desc *first, u32 control_field)
+{
+	/* remember magic and adjacent number */
+	u32 control = le32_to_cpu(first->control) & ~(LS_BYTE_MASK);
+
+	if (control_field & ~(LS_BYTE_MASK)) {
+		pr_err("Invalid control field\n");
+		return -EINVAL;
+	}
+	/* merge adjacent and control field */
+	control |= control_field;
+	/* write control and next_adjacent */
+	first->control = cpu_to_le32(control);
+	return 0;
+}
+
+/* mdlx_desc_clear -- Clear bits in control field of a descriptor. */
+int mdlx_desc_control_clear(struct mdlx_desc *first, u32 clear_mask)
+{
+	/* remember magic and adjacent number */
+	u32 control = le32_to_cpu(first->control);
+
+	if (clear_mask & ~(LS_BYTE_MASK)) {
+		pr_err("Invalid clear mask\n");
+		return -EINVAL;
+	}
+
+	/* merge adjacent and control field */
+	control &= (~clear_mask);
+	/* write control and next_adjacent */
+	first->control = cpu_to_le32(control);
+	return 0;
+}
+
+/* mdlx_desc() - Fill a descriptor with the transfer details
+ *
+ * @desc pointer to descriptor to be filled
+ * @addr root complex address
+ * @ep_addr end point address
+ * @len number of bytes, must be a (non-negative) multiple of 4.
+ * @dir, dma direction
+ * is the end point address. If zero, vice versa.
+ *
+ * Does not modify the next pointer
+ */
+void mdlx_desc_set(struct mdlx_desc *desc, dma_addr_t rc_bus_addr,
+		   u64 ep_addr, int len, int dir)
+{
+	/* transfer length */
+	desc->bytes = cpu_to_le32(len);
+	if (dir == DMA_TO_DEVICE) {
+		/* read from root complex memory (source address) */
+		desc->src_addr_lo = cpu_to_le32(PCI_DMA_L(rc_bus_addr));
+		desc->src_addr_hi = cpu_to_le32(PCI_DMA_H(rc_bus_addr));
+		/* write to end point address (destination address) */
+		desc->dst_addr_lo = cpu_to_le32(PCI_DMA_L(ep_addr));
+		desc->dst_addr_hi = cpu_to_le32(PCI_DMA_H(ep_addr));
+	} else {
+		/* read from end point address (source address) */
+		desc->src_addr_lo = cpu_to_le32(PCI_DMA_L(ep_addr));
+		desc->src_addr_hi = cpu_to_le32(PCI_DMA_H(ep_addr));
+		/* write to root complex memory (destination address) */
+		desc->dst_addr_lo = cpu_to_le32(PCI_DMA_L(rc_bus_addr));
+		desc->dst_addr_hi = cpu_to_le32(PCI_DMA_H(rc_bus_addr));
+	}
+}
+
+/* mdlx_desc_build() - Fill chained descriptors from software descriptors
+ *
+ * @ep_addr end point address of the first descriptor, advanced past the
+ * transfer when @incr_addr is set
+ *
+ * @return number of bytes described
+ */
+unsigned int mdlx_desc_build(struct mdlx_desc *desc,
+			     const struct sw_desc *sdesc, unsigned int count,
+			     u64 *ep_addr, int dir, bool incr_addr)
+{
+	unsigned int len = 0;
+	unsigned int i;
+
+	for (i = 0; i < count; i++, desc++, sdesc++) {
+		mdlx_desc_set(desc, sdesc->addr, *ep_addr, sdesc->len, dir);
+		len += sdesc->len;
+
+		/* for non-inc-add mode don't increment ep_addr */
+		if (incr_addr)
+			*ep_addr += sdesc->len;
+	}
+	return len;
+}
+
+/* mdlx_desc_chain_terminate() - Finish a chain built by mdlx_desc_build()
+ *
+ * Stops the engine with EOP and an interrupt on the last descriptor and
+ * fills in the adjacent numbers of all descriptors.
+ */
+int mdlx_desc_chain_terminate(struct mdlx_desc *desc, unsigned int count)
+{
+	unsigned int i;
+	int rv;
+
+	/* stop engine, EOP for AXI ST, req IRQ on last descriptor */
+	rv = mdlx_desc_control_set(desc + count - 1, MDLX_DESC_STOPPED |
+				   MDLX_DESC_EOP | MDLX_DESC_COMPLETED);
+	if (rv < 0)
+		return rv;
+
+	/* fill in adjacent numbers */
+	for (i = 0; i < count; i++)
+		mdlx_desc_adjacent(desc + i, count - i - 1);
+	return 0;
+}
+
+/* mdlx_desc_ring_place() - Ring slot for a chain of @count descriptors
+ *
+ * A chain that fits in the rest of the page at @ring_idx starts there. A
+ * longer one starts at the next MDLX_DESC_SLOT_ALIGN aligned slot, so its
+ * first prefetch block is full and its page crossings fall between blocks;
+ * that skips at most MDLX_DESC_SLOT_ALIGN - 1 slots.
+ */
+unsigned int mdlx_desc_ring_place(unsigned int ring_idx, unsigned int count)
+{
+	unsigned int room = MDLX_DESC_PER_PAGE - ring_idx % MDLX_DESC_PER_PAGE;
+
+	if (count <= room)
+		return ring_idx;
+	ring_idx = (ring_idx + MDLX_DESC_SLOT_ALIGN - 1) &
+		   ~(MDLX_DESC_SLOT_ALIGN - 1);
+	return ring_idx % MDLX_TRANSFER_MAX_DESC;
+}
+
+/* mdlx_desc_ring_span() - Descriptors usable at @ring_idx without wrapping */
+unsigned int mdlx_desc_ring_span(unsigned int ring_idx, unsigned int count)
+{
+	if (ring_idx + count >= MDLX_TRANSFER_MAX_DESC)
+		count = MDLX_TRANSFER_MAX_DESC - ring_idx;
+	return count;
+}
+
+/* mdlx_desc_ring_adjacent() - Adjacent descriptors the engine may prefetch
+ *
+ * Contiguous descriptors cannot cross a page boundary, so the first block of
+ * a chain of @count descriptors starting at ring slot @ring_idx ends at the
+ * page holding that slot. The ring itself starts page aligned.
+ */
+unsigned int mdlx_desc_ring_adjacent(unsigned int ring_idx,
+				     unsigned int count)
+{
+	unsigned int room = MDLX_DESC_PER_PAGE - ring_idx % MDLX_DESC_PER_PAGE;
+
+	return count < room ? count : room;
+}
+
+/* mdlx_sw_desc_count() - Software descriptors needed for one sg entry */
+unsigned int mdlx_sw_desc_count(unsigned int len, unsigned int blen_max)
+{
+	return len / blen_max + !!(len % blen_max);
+}
+
+/* mdlx_sw_desc_split() - Split one sg entry into descriptor sized pieces
+ *
+ * @return number of software descriptors written
+ */
+unsigned int mdlx_sw_desc_split(struct sw_desc *sdesc, dma_addr_t addr,
+				unsigned int len, unsigned int blen_max)
+{
+	unsigned int j = 0;
+
+	while (len) {
+		sdesc[j].addr = addr;
+		if (len > blen_max) {
+			sdesc[j].len = blen_max;
+			addr += blen_max;
+			len -= blen_max;
+		} else {
+			sdesc[j].len = len;
+			len = 0;
+		}
+		j++;
+	}
+	return j;
+}
@@ -0,0 +1,129 @@
+/*
+ * This file is part of the Medium DMA IP Core driver for Linux
+ *
+ * Copyright (c) 2020-present,  Medium, Inc.
+ * All rights reserved.
+ *
+ * This source code is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ */
+
+#ifndef MDLX_DESC_H
+#define MDLX_DESC_H
+/**
+ * @file
+ * @brief SGDMA descriptor chain construction
+ *
+ * Pure descriptor manipulation shared by libmdlx and the host side tools.
+ * Nothing here touches the device, locks or allocates; it only formats
+ * descriptors in memory the caller provides. Outside of the kernel the
+ * kernel types and helpers come from tools/mdlx_kshim.h.
+ */
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/dma-mapping.h>
+#else
+#include "mdlx_kshim.h"
+#endif
+
+#define MAX_EXTRA_ADJ (15)
+
+/* maximum number of desc per transfer request */
+#define MDLX_TRANSFER_MAX_DESC (2048)
+
+/* maximum size of a single DMA transfer descriptor */
+#define MDLX_DESC_BLEN_BITS	28
+#define MDLX_DESC_BLEN_MAX	((1 << (MDLX_DESC_BLEN_BITS)) - 1)
+
+/* bits of the SGDMA descriptor control field */
+#define MDLX_DESC_STOPPED	(1UL << 0)
+#define MDLX_DESC_COMPLETED	(1UL << 1)
+#define MDLX_DESC_EOP		(1UL << 4)
+
+#define LS_BYTE_MASK 0x000000FFUL
+
+#define DESC_MAGIC 0xAD4B0000UL
+
+/* descriptors fetched as one adjacent block may not cross this boundary */
+#define MDLX_DESC_PAGE_SIZE	0x1000
+#define MDLX_DESC_PER_PAGE	(MDLX_DESC_PAGE_SIZE / 32)
+/* one prefetch block, the first descriptor and MAX_EXTRA_ADJ behind it */
+#define MDLX_DESC_SLOT_ALIGN	(MAX_EXTRA_ADJ + 1)
+
+/* obtain the 32 most significant (high) bits of a 32-bit or 64-bit address */
+#define PCI_DMA_H(addr) ((addr >> 16) >> 16)
+/* obtain the 32 least significant (low) bits of a 32-bit or 64-bit address */
+#define PCI_DMA_L(addr) (addr & 0xffffffffUL)
+
+/**
+ * Descriptor for a single contiguous memory block transfer.
+ *
+ * Multiple descriptors are linked by means of the next pointer. An additional
+ * extra adjacent number gives the amount of extra contiguous descriptors.
+ *
+ * The descriptors are in root complex memory, and the bytes in the 32-bit
+ * words must be in little-endian byte ordering.
+ */
+struct mdlx_desc {
+	u32 control;
+	u32 bytes;		/* transfer length in bytes */
+	u32 src_addr_lo;	/* source address (low 32-bit) */
+	u32 src_addr_hi;	/* source address (high 32-bit) */
+	u32 dst_addr_lo;	/* destination address (low 32-bit) */
+	u32 dst_addr_hi;	/* destination address (high 32-bit) */
+	/*
+	 * next descriptor in the single-linked list of descriptors;
+	 * this is the PCIe (bus) address of the next descriptor in the
+	 * root complex memory
+	 */
+	u32 next_lo;		/* next desc address (low 32-bit) */
+	u32 next_hi;		/* next desc address (high 32-bit) */
+} __packed;
+
+struct sw_desc {
+	dma_addr_t addr;
+	unsigned int len;
+};
+
+/* mdlx_desc_done - recycle cache-coherent linked list of descriptors. */
+static inline void mdlx_desc_done(struct mdlx_desc *desc_virt, int count)
+{
+	memset(desc_virt, 0, count * sizeof(struct mdlx_desc));
+}
+
+int mdlx_desc_chain_init(struct mdlx_desc *desc_virt, dma_addr_t desc_bus,
+			 int count);
+void mdlx_desc_link(struct mdlx_desc *first, struct mdlx_desc *second,
+		    dma_addr_t second_bus);
+void mdlx_desc_adjacent(struct mdlx_desc *desc, int next_adjacent);
+int mdlx_desc_control_set(struct mdlx_desc *first, u32 control_field);
+int mdlx_desc_control_clear(struct mdlx_desc *first, u32 clear_mask);
+void mdlx_desc_set(struct mdlx_desc *desc, dma_addr_t rc_bus_addr,
+		   u64 ep_addr, int len, int dir);
+
+unsigned int mdlx_desc_build(struct mdlx_desc *desc,
+			     const struct sw_desc *sdesc, unsigned int count,
+			     u64 *ep_addr, int dir, bool incr_addr);
+int mdlx_desc_chain_terminate(struct mdlx_desc *desc, unsigned int count);
+
+unsigned int mdlx_desc_ring_place(unsigned int ring_idx, unsigned int count);
+unsigned int mdlx_desc_ring_span(unsigned int ring_idx, unsigned int count);
+unsigned int mdlx_desc_ring_adjacent(unsigned int ring_idx,
+				     unsigned int count);
+
+unsigned int mdlx_sw_desc_count(unsigned int len, unsigned int blen_max);
+unsigned int mdlx_sw_desc_split(struct sw_desc *sdesc, dma_addr_t addr,
+				unsigned int len, unsigned int blen_max);
+
+#endif /* MDLX_DESC_H */
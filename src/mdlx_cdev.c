@@ -23,6 +23,11 @@
 
 static struct class *g_mdlx_class;
 
+/* the card pool node, one for the module */
+static dev_t pool_cdevno;
+static struct cdev pool_cdev;
+static struct device *pool_device;
+
 struct kmem_cache *cdev_cache;
 
 enum cdev_type {
@@ -35,6 +40,9 @@ enum cdev_type {
 	CHAR_BYPASS_H2C,
 	CHAR_BYPASS_C2H,
 	CHAR_BYPASS,
+	CHAR_USER_WC,
+	CHAR_MDLX_H2C_ANY,
+	CHAR_MDLX_C2H_ANY,
 };
 
 static const char * const devnode_names[] = {
@@ -47,6 +55,9 @@ static const char * const devnode_names[] = {
 	MDLX_NODE_NAME "%d_bypass_h2c_%d",
 	MDLX_NODE_NAME "%d_bypass_c2h_%d",
 	MDLX_NODE_NAME "%d_bypass",
+	MDLX_NODE_NAME "%d_user_wc",
+	MDLX_NODE_NAME "%d_h2c_any",
+	MDLX_NODE_NAME "%d_c2h_any",
 };
 
 enum mddev_flags_bits {
@@ -56,8 +67,15 @@ enum mddev_flags_bits {
 	XDF_CDEV_EVENT,
 	XDF_CDEV_SG,
 	XDF_CDEV_BYPASS,
+	XDF_CDEV_USER_WC,
+	XDF_CDEV_SG_ANY,
 };
 
+static unsigned int user_bar_wc;
+module_param(user_bar_wc, uint, 0644);
+MODULE_PARM_DESC(user_bar_wc,
+	"Set 1 to create the write-combining user node for a non-prefetchable user BAR, default 0");
+
 static inline void mddev_flag_set(struct mdlx_pci_dev *mddev,
 				enum mddev_flags_bits fbit)
 {
@@ -91,6 +109,184 @@ ssize_t mdlx_dev_instance_show(struct device *dev,
 static DEVICE_ATTR_RO(mdlx_dev_instance);
 #endif
 
+/* parts per thousand, printed as a percentage with one decimal */
+static unsigned int perf_permille(u64 part, u64 whole)
+{
+	return whole ? div64_u64(part * 1000, whole) : 0;
+}
+
+static ssize_t engine_perf_show(struct mdlx_engine *engine, char *buf,
+				ssize_t len)
+{
+	struct mdlx_perf_sample s;
+	unsigned int util, pend;
+
+	if (engine->magic != MAGIC_ENGINE)
+		return len;
+
+	mdlx_engine_perf_sample(engine, &s);
+	util = perf_permille(s.data, s.cycles);
+	pend = perf_permille(s.pending, s.cycles);
+	return len + scnprintf(buf + len, PAGE_SIZE - len,
+			"%-10s %14llu %14llu %14llu %3u.%u%% %3u.%u%% %10llu\n",
+			engine->name, s.cycles, s.data, s.pending,
+			util / 10, util % 10, pend / 10, pend % 10,
+			div_u64(s.elapsed_ns, NSEC_PER_MSEC));
+}
+
+/*
+ * counters of every SGDMA engine since the previous read: a high data ratio
+ * means link bound, a high pending ratio host bound, and low ratios on a
+ * busy engine descriptor bound
+ */
+static ssize_t mdlx_perf_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct mdlx_pci_dev *mddev =
+		(struct mdlx_pci_dev *)dev_get_drvdata(dev);
+	struct mdlx_dev *mdev = mddev->mdev;
+	ssize_t len;
+	int i;
+
+	len = scnprintf(buf, PAGE_SIZE, "%-10s %14s %14s %14s %7s %7s %10s\n",
+			"engine", "cycles", "data", "pending", "data",
+			"pending", "ms");
+	for (i = 0; i < mdev->h2c_channel_max; i++)
+		len = engine_perf_show(&mdev->engine_h2c[i], buf, len);
+	for (i = 0; i < mdev->c2h_channel_max; i++)
+		len = engine_perf_show(&mdev->engine_c2h[i], buf, len);
+	return len;
+}
+
+static DEVICE_ATTR_RO(mdlx_perf);
+
+/*
+ * completion interrupt moderation of every SGDMA engine, set with
+ * "<engine|all> <count> <usecs>", see mdlx_engine_coalesce()
+ */
+static ssize_t mdlx_coalesce_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct mdlx_pci_dev *mddev =
+		(struct mdlx_pci_dev *)dev_get_drvdata(dev);
+	struct mdlx_dev *mdev = mddev->mdev;
+	struct mdlx_engine *engine;
+	ssize_t len;
+	int i;
+
+	len = scnprintf(buf, PAGE_SIZE, "%-10s %6s %6s\n", "engine", "count",
+			"usecs");
+	for (i = 0; i < 2 * MDLX_CHANNEL_NUM_MAX; i++) {
+		engine = i < MDLX_CHANNEL_NUM_MAX ? &mdev->engine_h2c[i] :
+			 &mdev->engine_c2h[i - MDLX_CHANNEL_NUM_MAX];
+		if (engine->magic != MAGIC_ENGINE)
+			continue;
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%-10s %6u %6u\n",
+				 engine->name, engine->coal_count,
+				 engine->coal_usecs);
+	}
+	return len;
+}
+
+static ssize_t mdlx_coalesce_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct mdlx_pci_dev *mddev =
+		(struct mdlx_pci_dev *)dev_get_drvdata(dev);
+	struct mdlx_dev *mdev = mddev->mdev;
+	struct mdlx_engine *engine;
+	unsigned int coal_count, coal_usecs;
+	char name[16];
+	int found = 0;
+	int i, rv;
+
+	if (sscanf(buf, "%15s %u %u", name, &coal_count, &coal_usecs) != 3)
+		return -EINVAL;
+
+	for (i = 0; i < 2 * MDLX_CHANNEL_NUM_MAX; i++) {
+		engine = i < MDLX_CHANNEL_NUM_MAX ? &mdev->engine_h2c[i] :
+			 &mdev->engine_c2h[i - MDLX_CHANNEL_NUM_MAX];
+		if (engine->magic != MAGIC_ENGINE ||
+		    (strcmp(name, "all") && strcmp(name, engine->name)))
+			continue;
+		rv = mdlx_engine_coalesce(engine, coal_count, coal_usecs);
+		if (rv < 0)
+			return rv;
+		found = 1;
+	}
+	return found ? count : -ENODEV;
+}
+
+static DEVICE_ATTR_RW(mdlx_coalesce);
+
+/*
+ * where the completions of every SGDMA engine run: the CPU its MSI-X vector
+ * is pinned to, the CPU of its completion thread when polled, and the CPU of
+ * its last submitter; -1 where there is none
+ */
+static ssize_t mdlx_affinity_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct mdlx_pci_dev *mddev =
+		(struct mdlx_pci_dev *)dev_get_drvdata(dev);
+	struct mdlx_dev *mdev = mddev->mdev;
+	struct mdlx_engine *engine;
+	ssize_t len;
+	int i;
+
+	len = scnprintf(buf, PAGE_SIZE, "%-10s %6s %6s %6s %6s\n", "engine",
+			"irq", "cpu", "thread", "submit");
+	for (i = 0; i < 2 * MDLX_CHANNEL_NUM_MAX; i++) {
+		struct mdlx_kthread *thp;
+
+		engine = i < MDLX_CHANNEL_NUM_MAX ? &mdev->engine_h2c[i] :
+			 &mdev->engine_c2h[i - MDLX_CHANNEL_NUM_MAX];
+		if (engine->magic != MAGIC_ENGINE)
+			continue;
+		thp = READ_ONCE(engine->cmplthp);
+		len += scnprintf(buf + len, PAGE_SIZE - len,
+				 "%-10s %6d %6d %6d %6d\n", engine->name,
+				 engine->msix_irq_line ? engine->msix_irq_line :
+				 mdev->pdev->irq, engine->irq_cpu,
+				 thp ? (int)thp->cpu : -1, engine->prev_cpu);
+	}
+	return len;
+}
+
+static DEVICE_ATTR_RO(mdlx_affinity);
+
+/*
+ * descriptor chains every SGDMA engine started since probe, and how many of
+ * them began with less than a full prefetch block (degraded), see
+ * mdlx_desc_ring_place()
+ */
+static ssize_t mdlx_prefetch_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct mdlx_pci_dev *mddev =
+		(struct mdlx_pci_dev *)dev_get_drvdata(dev);
+	struct mdlx_dev *mdev = mddev->mdev;
+	struct mdlx_engine *engine;
+	ssize_t len;
+	int i;
+
+	len = scnprintf(buf, PAGE_SIZE, "%-10s %14s %14s\n", "engine",
+			"chains", "degraded");
+	for (i = 0; i < 2 * MDLX_CHANNEL_NUM_MAX; i++) {
+		engine = i < MDLX_CHANNEL_NUM_MAX ? &mdev->engine_h2c[i] :
+			 &mdev->engine_c2h[i - MDLX_CHANNEL_NUM_MAX];
+		if (engine->magic != MAGIC_ENGINE)
+			continue;
+		len += scnprintf(buf + len, PAGE_SIZE - len,
+				 "%-10s %14lu %14lu\n", engine->name,
+				 READ_ONCE(engine->prefetch_chains),
+				 READ_ONCE(engine->prefetch_degraded));
+	}
+	return len;
+}
+
+static DEVICE_ATTR_RO(mdlx_prefetch);
+
 static int config_kobject(struct mdlx_cdev *xcdev, enum cdev_type type)
 {
 	int rv = -EINVAL;
@@ -111,6 +307,9 @@ static int config_kobject(struct mdlx_cdev *xcdev, enum cdev_type type)
 		break;
 	case CHAR_BYPASS:
 	case CHAR_USER:
+	case CHAR_USER_WC:
+	case CHAR_MDLX_H2C_ANY:
+	case CHAR_MDLX_C2H_ANY:
 	case CHAR_CTRL:
 	case CHAR_XVC:
 		rv = kobject_set_name(&xcdev->cdev.kobj, devnode_names[type],
@@ -272,6 +471,9 @@ static int destroy_xcdev(struct mdlx_cdev *cdev)
 	if (cdev->sys_device)
 		device_destroy(g_mdlx_class, cdev->cdevno);
 
+	if (cdev->wc)
+		arch_phys_wc_del(cdev->wc_cookie);
+
 	cdev_del(&cdev->cdev);
 
 	return 0;
@@ -321,6 +523,15 @@ static int create_xcdev(struct mdlx_pci_dev *mddev, struct mdlx_cdev *xcdev,
 		minor = type;
 		cdev_ctrl_init(xcdev);
 		break;
+	case CHAR_USER_WC:
+		minor = type;
+		xcdev->wc = 1;
+		/* only effective on systems without PAT */
+		xcdev->wc_cookie = arch_phys_wc_add(
+				pci_resource_start(mdev->pdev, bar),
+				pci_resource_len(mdev->pdev, bar));
+		cdev_ctrl_init(xcdev);
+		break;
 	case CHAR_XVC:
 		/* minor number is type index for non-SGDMA interfaces */
 		minor = type;
@@ -334,6 +545,16 @@ static int create_xcdev(struct mdlx_pci_dev *mddev, struct mdlx_cdev *xcdev,
 		minor = 36 + engine->channel;
 		cdev_sgdma_init(xcdev);
 		break;
+	case CHAR_MDLX_H2C_ANY:
+		minor = 40;
+		xcdev->any_channel = 1;
+		cdev_sgdma_init(xcdev);
+		break;
+	case CHAR_MDLX_C2H_ANY:
+		minor = 41;
+		xcdev->any_channel = 1;
+		cdev_sgdma_init(xcdev);
+		break;
 	case CHAR_EVENTS:
 		minor = 10 + bar;
 		cdev_event_init(xcdev);
@@ -378,6 +599,8 @@ static int create_xcdev(struct mdlx_pci_dev *mddev, struct mdlx_cdev *xcdev,
 del_cdev:
 	cdev_del(&xcdev->cdev);
 unregister_region:
+	if (xcdev->wc)
+		arch_phys_wc_del(xcdev->wc_cookie);
 	unregister_chrdev_region(xcdev->cdevno, MDLX_MINOR_COUNT);
 	return rv;
 }
@@ -389,6 +612,10 @@ void mddev_destroy_interfaces(struct mdlx_pci_dev *mddev)
 #ifdef __MDLX_SYSFS__
 	device_remove_file(&mddev->pdev->dev, &dev_attr_mdlx_dev_instance);
 #endif
+	device_remove_file(&mddev->pdev->dev, &dev_attr_mdlx_perf);
+	device_remove_file(&mddev->pdev->dev, &dev_attr_mdlx_coalesce);
+	device_remove_file(&mddev->pdev->dev, &dev_attr_mdlx_affinity);
+	device_remove_file(&mddev->pdev->dev, &dev_attr_mdlx_prefetch);
 
 	if (mddev_flag_test(mddev, XDF_CDEV_SG)) {
 		/* iterate over channels */
@@ -407,6 +634,21 @@ void mddev_destroy_interfaces(struct mdlx_pci_dev *mddev)
 		}
 	}
 
+	if (mddev_flag_test(mddev, XDF_CDEV_SG_ANY)) {
+		if (mddev->sgdma_h2c_any_cdev.magic == MAGIC_CHAR) {
+			rv = destroy_xcdev(&mddev->sgdma_h2c_any_cdev);
+			if (rv < 0)
+				pr_err("Failed to destroy h2c any xcdev error 0x%x\n",
+						rv);
+		}
+		if (mddev->sgdma_c2h_any_cdev.magic == MAGIC_CHAR) {
+			rv = destroy_xcdev(&mddev->sgdma_c2h_any_cdev);
+			if (rv < 0)
+				pr_err("Failed to destroy c2h any xcdev error 0x%x\n",
+						rv);
+		}
+	}
+
 	if (mddev_flag_test(mddev, XDF_CDEV_EVENT)) {
 		for (i = 0; i < mddev->user_max; i++) {
 			rv = destroy_xcdev(&mddev->events_cdev[i]);
@@ -432,6 +674,13 @@ void mddev_destroy_interfaces(struct mdlx_pci_dev *mddev)
 				i, rv);
 	}
 
+	if (mddev_flag_test(mddev, XDF_CDEV_USER_WC)) {
+		rv = destroy_xcdev(&mddev->user_wc_cdev);
+		if (rv < 0)
+			pr_err("Failed to destroy user wc cdev %d error 0x%x\n",
+				i, rv);
+	}
+
 	if (mddev_flag_test(mddev, XDF_CDEV_XVC)) {
 		rv = destroy_xcdev(&mddev->xvc_cdev);
 		if (rv < 0)
@@ -465,6 +714,22 @@ void mddev_destroy_interfaces(struct mdlx_pci_dev *mddev)
 				MDLX_MINOR_COUNT);
 }
 
+/*
+ * first engine of a direction for the "any" node, which checks direction and
+ * alignment against it. None if there is no memory mapped engine to pick.
+ */
+static struct mdlx_engine *any_channel_engine(struct mdlx_engine *engines,
+		int channel_max)
+{
+	int i;
+
+	for (i = 0; i < channel_max; i++) {
+		if (engines[i].magic == MAGIC_ENGINE && !engines[i].streaming)
+			return &engines[i];
+	}
+	return NULL;
+}
+
 int mddev_create_interfaces(struct mdlx_pci_dev *mddev)
 {
 	struct mdlx_dev *mdev = mddev->mdev;
@@ -526,6 +791,28 @@ int mddev_create_interfaces(struct mdlx_pci_dev *mddev)
 	}
 	mddev_flag_set(mddev, XDF_CDEV_SG);
 
+	/* least loaded channel of each direction, memory mapped engines only */
+	engine = any_channel_engine(mdev->engine_h2c, mddev->h2c_channel_max);
+	if (engine) {
+		rv = create_xcdev(mddev, &mddev->sgdma_h2c_any_cdev, 0, engine,
+				 CHAR_MDLX_H2C_ANY);
+		if (rv < 0) {
+			pr_err("create char h2c any failed, %d.\n", rv);
+			goto fail;
+		}
+		mddev_flag_set(mddev, XDF_CDEV_SG_ANY);
+	}
+	engine = any_channel_engine(mdev->engine_c2h, mddev->c2h_channel_max);
+	if (engine) {
+		rv = create_xcdev(mddev, &mddev->sgdma_c2h_any_cdev, 0, engine,
+				 CHAR_MDLX_C2H_ANY);
+		if (rv < 0) {
+			pr_err("create char c2h any failed, %d.\n", rv);
+			goto fail;
+		}
+		mddev_flag_set(mddev, XDF_CDEV_SG_ANY);
+	}
+
 	/* ??? Bypass */
 	/* Initialize Bypass Character Device */		// Bypass
 	if (mdev->bypass_bar_idx > 0) {
@@ -578,6 +865,18 @@ int mddev_create_interfaces(struct mdlx_pci_dev *mddev)
 		}
 		mddev_flag_set(mddev, XDF_CDEV_USER);
 
+		/* write-combining view of the user BAR for PIO streaming */
+		if (user_bar_wc || (pci_resource_flags(mdev->pdev,
+				mdev->user_bar_idx) & IORESOURCE_PREFETCH)) {
+			rv = create_xcdev(mddev, &mddev->user_wc_cdev,
+					mdev->user_bar_idx, NULL, CHAR_USER_WC);
+			if (rv < 0) {
+				pr_err("create_char(user_wc_cdev) failed\n");
+				goto fail;
+			}
+			mddev_flag_set(mddev, XDF_CDEV_USER_WC);
+		}
+
 		/* xvc */								// xvc(Medium Virtual Cable)
 		rv = create_xcdev(mddev, &mddev->xvc_cdev, mdev->user_bar_idx,
 				 NULL, CHAR_XVC);
@@ -597,6 +896,26 @@ int mddev_create_interfaces(struct mdlx_pci_dev *mddev)
 		goto fail;
 	}
 #endif
+	rv = device_create_file(&mddev->pdev->dev, &dev_attr_mdlx_perf);
+	if (rv) {
+		pr_err("Failed to create perf device file\n");
+		goto fail;
+	}
+	rv = device_create_file(&mddev->pdev->dev, &dev_attr_mdlx_coalesce);
+	if (rv) {
+		pr_err("Failed to create coalesce device file\n");
+		goto fail;
+	}
+	rv = device_create_file(&mddev->pdev->dev, &dev_attr_mdlx_affinity);
+	if (rv) {
+		pr_err("Failed to create affinity device file\n");
+		goto fail;
+	}
+	rv = device_create_file(&mddev->pdev->dev, &dev_attr_mdlx_prefetch);
+	if (rv) {
+		pr_err("Failed to create prefetch device file\n");
+		goto fail;
+	}
 	pr_info("mddev_create_interfaces finished\n");
 
 	return 0;
@@ -607,8 +926,57 @@ fail:
 	return rv;
 }
 
+static int pool_cdev_create(void)
+{
+	int rv;
+
+	rv = alloc_chrdev_region(&pool_cdevno, 0, 1, MDLX_NODE_NAME "_pool");
+	if (rv) {
+		pr_err("unable to allocate pool cdev region %d.\n", rv);
+		return rv;
+	}
+
+	cdev_pool_init(&pool_cdev);
+	pool_cdev.owner = THIS_MODULE;
+	rv = cdev_add(&pool_cdev, pool_cdevno, 1);
+	if (rv < 0) {
+		pr_err("cdev_add(pool) failed %d.\n", rv);
+		goto unregister_region;
+	}
+
+	pool_device = device_create(g_mdlx_class, NULL, pool_cdevno, NULL,
+				    MDLX_NODE_NAME "_pool");
+	if (IS_ERR(pool_device)) {
+		rv = PTR_ERR(pool_device);
+		pool_device = NULL;
+		pr_err("device_create(pool) failed %d.\n", rv);
+		goto del_cdev;
+	}
+	return 0;
+
+del_cdev:
+	cdev_del(&pool_cdev);
+unregister_region:
+	unregister_chrdev_region(pool_cdevno, 1);
+	pool_cdevno = 0;
+	return rv;
+}
+
+static void pool_cdev_destroy(void)
+{
+	if (!pool_cdevno)
+		return;
+	if (pool_device)
+		device_destroy(g_mdlx_class, pool_cdevno);
+	cdev_del(&pool_cdev);
+	unregister_chrdev_region(pool_cdevno, 1);
+	pool_cdevno = 0;
+}
+
 int mdlx_cdev_init(void)
 {
+	int rv;
+
 	g_mdlx_class = class_create(THIS_MODULE, MDLX_NODE_NAME);
 	if (IS_ERR(g_mdlx_class)) {
 		dbg_init(MDLX_NODE_NAME ": failed to create class");
@@ -626,13 +994,16 @@ int mdlx_cdev_init(void)
     	return -ENOMEM;
     }
 
-   	mdlx_threads_create(8);
-
-	return 0;
+	rv = pool_cdev_create();
+	if (rv < 0)
+		mdlx_cdev_cleanup();
+	return rv;
 }
 
 void mdlx_cdev_cleanup(void)
 {
+	pool_cdev_destroy();
+
 	if (cdev_cache)
 		kmem_cache_destroy(cdev_cache);
 
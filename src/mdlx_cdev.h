@@ -41,7 +41,10 @@ void cdev_xvc_init(struct mdlx_cdev *xcdev);
 void cdev_event_init(struct mdlx_cdev *xcdev);
 void cdev_sgdma_init(struct mdlx_cdev *xcdev);
 void cdev_bypass_init(struct mdlx_cdev *xcdev);
+void cdev_pool_init(struct cdev *cdev);
 long char_ctrl_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+int char_sgdma_map_user_buf_to_sgl(struct mdlx_io_cb *cb, bool write);
+void char_sgdma_unmap_user_buf(struct mdlx_io_cb *cb, bool write);
 
 void mddev_destroy_interfaces(struct mdlx_pci_dev *mddev);
 int mddev_create_interfaces(struct mdlx_pci_dev *mddev);
@@ -0,0 +1,747 @@
+/*
+ * This file is part of the Medium DMA IP Core driver for Linux
+ *
+ * Copyright (c) 2020-present,  Medium, Inc.
+ * All rights reserved.
+ *
+ * This source code is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ */
+
+#define pr_fmt(fmt)	KBUILD_MODNAME ":%s: " fmt, __func__
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/highmem.h>
+#include <linux/delay.h>
+#include <linux/ktime.h>
+#include <linux/workqueue.h>
+#include <linux/dma-mapping.h>
+
+#include "mdlx_emu.h"
+
+static unsigned int emu_devices;
+module_param(emu_devices, uint, 0444);
+MODULE_PARM_DESC(emu_devices, "Number of emulated MDLX devices, default 0");
+
+static unsigned int emu_channels = 1;
+module_param(emu_channels, uint, 0444);
+MODULE_PARM_DESC(emu_channels,
+	"H2C and C2H channels per emulated device, default 1");
+
+static unsigned int emu_ddr_mb = 64;
+module_param(emu_ddr_mb, uint, 0444);
+MODULE_PARM_DESC(emu_ddr_mb, "Emulated device memory in MB, default 64");
+
+static unsigned int emu_latency_us = 2;
+module_param(emu_latency_us, uint, 0644);
+MODULE_PARM_DESC(emu_latency_us,
+	"Emulated delay from engine start to first descriptor, default 2 us");
+
+static unsigned int emu_bandwidth_mbps;
+module_param(emu_bandwidth_mbps, uint, 0644);
+MODULE_PARM_DESC(emu_bandwidth_mbps,
+	"Emulated engine bandwidth in MB/s, default 0 (unlimited)");
+
+/* register space backing the emulated config BAR */
+#define EMU_CONFIG_BAR_SIZE	0x10000UL
+#define EMU_USER_BAR_SIZE	0x10000UL
+#define EMU_CONFIG_BAR		1
+#define EMU_USER_BAR		0
+
+/* 250MHz user clock, 64 bytes per data cycle, for the perf counters */
+#define EMU_CLK_MHZ		250
+#define EMU_DATAPATH_BYTES	64
+
+#define EMU_ENGINE_VERSION	0x6
+#define EMU_ALIGNMENTS		((1 << 16) | (1 << 8) | 64)
+
+/* status bits cleared by a status_rc read or a status write */
+#define EMU_STAT_CLEAR_MASK	(~(u32)MDLX_STAT_BUSY)
+
+struct mdlx_emu_dev;
+
+struct mdlx_emu_engine {
+	struct mdlx_emu_dev *edev;
+	struct engine_regs *regs;
+	struct engine_sgdma_regs *sgdma_regs;
+	struct work_struct work;	/* walks the descriptor chain */
+	u32 irq_bit;			/* bit in channel_int_request */
+	bool h2c;
+	unsigned int run_gen;		/* bumped on every RUN rising edge */
+	u64 perf_start_ns;
+	u64 perf_bytes;
+};
+
+struct mdlx_emu_dev {
+	struct pci_dev pdev;
+	struct list_head list;
+	int idx;
+
+	spinlock_t lock;		/* register state */
+	u8 *config_bar;
+	u8 *user_bar;
+	u8 *ddr;
+	size_t ddr_size;
+
+	int engines_num;
+	struct mdlx_emu_engine engine[MAX_NUM_ENGINES];
+
+	struct mdlx_dev *mdev;
+	irq_handler_t isr;
+	struct work_struct irq_work;	/* re-raise after an enable write */
+};
+
+/* only changed by mdlx_emu_init()/mdlx_emu_exit() */
+static LIST_HEAD(emu_list);
+static struct device *emu_root;
+static struct workqueue_struct *emu_wq;
+
+static struct mdlx_emu_dev *emu_find(const void *iomem)
+{
+	struct mdlx_emu_dev *edev;
+
+	list_for_each_entry(edev, &emu_list, list) {
+		if (iomem >= (void *)edev->config_bar &&
+		    iomem < (void *)edev->config_bar + EMU_CONFIG_BAR_SIZE)
+			return edev;
+	}
+	return NULL;
+}
+
+static inline u32 *emu_reg(struct mdlx_emu_dev *edev, unsigned long off)
+{
+	return (u32 *)(edev->config_bar + off);
+}
+
+static struct interrupt_regs *emu_irq_regs(struct mdlx_emu_dev *edev)
+{
+	return (struct interrupt_regs *)(edev->config_bar + MDLX_OFS_INT_CTRL);
+}
+
+static struct mdlx_emu_engine *emu_engine(struct mdlx_emu_dev *edev,
+		unsigned long off)
+{
+	int channel = (off >> 8) & 0xf;
+
+	if (off >= MDLX_OFS_INT_CTRL || channel >= emu_channels)
+		return NULL;
+	if (off >= H2C_CHANNEL_OFFSET)
+		return &edev->engine[emu_channels + channel];
+	return &edev->engine[channel];
+}
+
+/* engine interrupt lines, the engine status gated by its enable mask */
+static u32 emu_channel_pending(struct mdlx_emu_dev *edev)
+{
+	u32 pending = 0;
+	int i;
+
+	for (i = 0; i < edev->engines_num; i++) {
+		struct mdlx_emu_engine *e = &edev->engine[i];
+
+		if (e->regs->status & e->regs->interrupt_enable_mask &
+		    ~MDLX_STAT_BUSY)
+			pending |= e->irq_bit;
+	}
+	return pending;
+}
+
+static u32 emu_channel_request(struct mdlx_emu_dev *edev)
+{
+	return emu_channel_pending(edev) &
+		emu_irq_regs(edev)->channel_int_enable;
+}
+
+/* call the driver's handler the way an interrupt line would */
+static void emu_irq_deliver(struct mdlx_emu_dev *edev)
+{
+	unsigned long flags;
+	u32 request;
+
+	spin_lock_irqsave(&edev->lock, flags);
+	request = emu_channel_request(edev);
+	spin_unlock_irqrestore(&edev->lock, flags);
+
+	if (!request || !edev->isr)
+		return;
+
+	local_irq_save(flags);
+	edev->isr(0, edev->mdev);
+	local_irq_restore(flags);
+}
+
+static void emu_irq_work(struct work_struct *work)
+{
+	emu_irq_deliver(container_of(work, struct mdlx_emu_dev, irq_work));
+}
+
+/* copy between host memory at a bus (physical) address and a kernel buffer */
+static int emu_host_copy(u64 host, void *buf, size_t len, bool from_host)
+{
+	while (len) {
+		unsigned int off = offset_in_page(host);
+		size_t n = min_t(size_t, len, PAGE_SIZE - off);
+		unsigned long pfn = PHYS_PFN(host);
+		u8 *va;
+
+		if (!pfn_valid(pfn))
+			return -EFAULT;
+		va = kmap_atomic(pfn_to_page(pfn));
+		if (from_host)
+			memcpy(buf, va + off, n);
+		else
+			memcpy(va + off, buf, n);
+		kunmap_atomic(va);
+
+		host += n;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* move one descriptor worth of data, returns the status error bits */
+static u32 emu_desc_move(struct mdlx_emu_engine *e, struct mdlx_desc *desc)
+{
+	struct mdlx_emu_dev *edev = e->edev;
+	u64 src = ((u64)le32_to_cpu(desc->src_addr_hi) << 32) |
+		le32_to_cpu(desc->src_addr_lo);
+	u64 dst = ((u64)le32_to_cpu(desc->dst_addr_hi) << 32) |
+		le32_to_cpu(desc->dst_addr_lo);
+	u32 len = le32_to_cpu(desc->bytes);
+	u64 ep = e->h2c ? dst : src;
+	u64 host = e->h2c ? src : dst;
+
+	if (!len || len > MDLX_DESC_BLEN_MAX)
+		return MDLX_STAT_INVALID_LEN;
+	if (ep >= edev->ddr_size || len > edev->ddr_size - ep)
+		return e->h2c ? MDLX_STAT_H2C_W_DECODE_ERR :
+				MDLX_STAT_C2H_R_DECODE_ERR;
+	if (emu_host_copy(host, edev->ddr + ep, len, e->h2c))
+		return e->h2c ? MDLX_STAT_H2C_R_UNSUPP_REQ :
+				MDLX_STAT_DESC_UNSUPP_REQ;
+	return 0;
+}
+
+/* hold the engine back to the configured latency and bandwidth */
+static void emu_pace(u64 deadline_ns)
+{
+	s64 wait = deadline_ns - ktime_get_ns();
+	unsigned long us;
+
+	if (wait <= 0)
+		return;
+	us = div_u64(wait, NSEC_PER_USEC);
+	if (us > 20)
+		usleep_range(us, us + 5);
+	else
+		ndelay(wait);
+}
+
+static void emu_writeback(struct mdlx_emu_engine *e, u32 count)
+{
+	u64 wb = ((u64)e->regs->poll_mode_wb_hi << 32) |
+		e->regs->poll_mode_wb_lo;
+	u32 w = cpu_to_le32(count);
+
+	if (wb && (e->regs->control & MDLX_CTRL_POLL_MODE_WB))
+		emu_host_copy(wb, &w, sizeof(w), false);
+}
+
+static bool emu_engine_stopped(struct mdlx_emu_engine *e, unsigned int gen)
+{
+	unsigned long flags;
+	bool stopped;
+
+	spin_lock_irqsave(&e->edev->lock, flags);
+	stopped = e->run_gen != gen ||
+		!(e->regs->control & MDLX_CTRL_RUN_STOP);
+	spin_unlock_irqrestore(&e->edev->lock, flags);
+	return stopped;
+}
+
+/*
+ * process a started engine: fetch descriptors from first_desc on, following
+ * the next pointers until a descriptor with the STOPPED flag, an error, or
+ * until the driver clears RUN
+ */
+static void emu_engine_work(struct work_struct *work)
+{
+	struct mdlx_emu_engine *e = container_of(work, struct mdlx_emu_engine,
+						work);
+	struct mdlx_emu_dev *edev = e->edev;
+	unsigned long flags;
+	struct mdlx_desc desc;
+	unsigned int gen;
+	u64 addr, start, bytes = 0;
+	u32 count = 0, err = 0, status = 0, control;
+
+	spin_lock_irqsave(&edev->lock, flags);
+	gen = e->run_gen;
+	addr = ((u64)e->sgdma_regs->first_desc_hi << 32) |
+		e->sgdma_regs->first_desc_lo;
+	spin_unlock_irqrestore(&edev->lock, flags);
+
+	start = ktime_get_ns() + (u64)emu_latency_us * NSEC_PER_USEC;
+	emu_pace(start);
+
+	while (!emu_engine_stopped(e, gen)) {
+		if (emu_host_copy(addr, &desc, sizeof(desc), true)) {
+			err = MDLX_STAT_DESC_UNSUPP_REQ;
+			break;
+		}
+		control = le32_to_cpu(desc.control);
+		if ((control & 0xffff0000UL) != DESC_MAGIC) {
+			err = MDLX_STAT_MAGIC_STOPPED;
+			break;
+		}
+		err = emu_desc_move(e, &desc);
+		if (err)
+			break;
+
+		count++;
+		bytes += le32_to_cpu(desc.bytes);
+		if (emu_bandwidth_mbps)
+			emu_pace(start + div_u64(bytes * 1000,
+						 emu_bandwidth_mbps));
+
+		spin_lock_irqsave(&edev->lock, flags);
+		e->perf_bytes += le32_to_cpu(desc.bytes);
+		if (e->run_gen == gen) {
+			e->regs->completed_desc_count = count;
+			if (control & MDLX_DESC_COMPLETED)
+				e->regs->status |= MDLX_STAT_DESC_COMPLETED;
+		}
+		spin_unlock_irqrestore(&edev->lock, flags);
+
+		/* the stop below reports this descriptor as well */
+		if (control & MDLX_DESC_STOPPED) {
+			status = MDLX_STAT_DESC_STOPPED;
+			break;
+		}
+		if (control & MDLX_DESC_COMPLETED) {
+			spin_lock_irqsave(&edev->lock, flags);
+			if (e->run_gen == gen)
+				emu_writeback(e, count);
+			spin_unlock_irqrestore(&edev->lock, flags);
+			emu_irq_deliver(edev);
+		}
+
+		addr = ((u64)le32_to_cpu(desc.next_hi) << 32) |
+			le32_to_cpu(desc.next_lo);
+		cond_resched();
+	}
+
+	spin_lock_irqsave(&edev->lock, flags);
+	if (e->run_gen != gen) {
+		/* restarted meanwhile, the new run owns the state */
+		spin_unlock_irqrestore(&edev->lock, flags);
+		return;
+	}
+	if (err)
+		dbg_tfr("emu engine %d stopped after %u desc, err 0x%x.\n",
+			(int)(e - edev->engine), count, err);
+	e->regs->status = (e->regs->status | status | err) & ~MDLX_STAT_BUSY;
+	emu_writeback(e, count | (err ? WB_ERR_MASK : 0));
+	spin_unlock_irqrestore(&edev->lock, flags);
+
+	emu_irq_deliver(edev);
+}
+
+/* new value of an engine control register, lock held */
+static void emu_engine_control(struct mdlx_emu_engine *e, u32 w)
+{
+	u32 old = e->regs->control;
+
+	e->regs->control = w;
+	if (!(old & MDLX_CTRL_RUN_STOP) && (w & MDLX_CTRL_RUN_STOP)) {
+		e->run_gen++;
+		e->regs->status = MDLX_STAT_BUSY;
+		e->regs->completed_desc_count = 0;
+		queue_work(emu_wq, &e->work);
+	} else if ((old & MDLX_CTRL_RUN_STOP) && !(w & MDLX_CTRL_RUN_STOP)) {
+		/* the work notices RUN is gone between two descriptors */
+		e->regs->status &= ~MDLX_STAT_BUSY;
+	}
+}
+
+static u32 emu_perf_read(struct mdlx_emu_engine *e, unsigned long reg)
+{
+	u64 cycles = 0;
+
+	if (e->regs->perf_ctrl & MDLX_PERF_RUN)
+		cycles = div_u64((ktime_get_ns() - e->perf_start_ns) *
+				 EMU_CLK_MHZ, 1000);
+
+	switch (reg) {
+	case offsetof(struct engine_regs, perf_cyc_lo):
+		return lower_32_bits(cycles);
+	case offsetof(struct engine_regs, perf_cyc_hi):
+		return upper_32_bits(cycles);
+	case offsetof(struct engine_regs, perf_dat_lo):
+		return lower_32_bits(e->perf_bytes / EMU_DATAPATH_BYTES);
+	case offsetof(struct engine_regs, perf_dat_hi):
+		return upper_32_bits(e->perf_bytes / EMU_DATAPATH_BYTES);
+	default:
+		return 0;
+	}
+}
+
+static u32 emu_reg_read(struct mdlx_emu_dev *edev, unsigned long off)
+{
+	struct mdlx_emu_engine *e = emu_engine(edev, off);
+	unsigned long reg = off & 0xff;
+	u32 v;
+
+	if (e) {
+		switch (reg) {
+		case offsetof(struct engine_regs, status_rc):
+			v = e->regs->status;
+			e->regs->status &= ~EMU_STAT_CLEAR_MASK;
+			return v;
+		case offsetof(struct engine_regs, perf_cyc_lo) ...
+		     offsetof(struct engine_regs, perf_pnd_hi):
+			return emu_perf_read(e, reg);
+		}
+	} else if (off == MDLX_OFS_INT_CTRL +
+		   offsetof(struct interrupt_regs, channel_int_request)) {
+		return emu_channel_request(edev);
+	} else if (off == MDLX_OFS_INT_CTRL +
+		   offsetof(struct interrupt_regs, channel_int_pending)) {
+		return emu_channel_pending(edev);
+	}
+
+	return *emu_reg(edev, off);
+}
+
+/* register write, returns true if an interrupt may have become pending */
+static bool emu_reg_write(struct mdlx_emu_dev *edev, unsigned long off, u32 w)
+{
+	struct mdlx_emu_engine *e = emu_engine(edev, off);
+	struct interrupt_regs *irq_regs = emu_irq_regs(edev);
+	unsigned long reg = off & 0xff;
+
+	if (e) {
+		switch (reg) {
+		case offsetof(struct engine_regs, control):
+			emu_engine_control(e, w);
+			return false;
+		case offsetof(struct engine_regs, control_w1s):
+			emu_engine_control(e, e->regs->control | w);
+			return false;
+		case offsetof(struct engine_regs, control_w1c):
+			emu_engine_control(e, e->regs->control & ~w);
+			return false;
+		case offsetof(struct engine_regs, status):
+			e->regs->status &= ~(w & EMU_STAT_CLEAR_MASK);
+			return false;
+		case offsetof(struct engine_regs, interrupt_enable_mask):
+			e->regs->interrupt_enable_mask = w;
+			return true;
+		case offsetof(struct engine_regs, interrupt_enable_mask_w1s):
+			e->regs->interrupt_enable_mask |= w;
+			return true;
+		case offsetof(struct engine_regs, interrupt_enable_mask_w1c):
+			e->regs->interrupt_enable_mask &= ~w;
+			return false;
+		case offsetof(struct engine_regs, perf_ctrl):
+			if (w & MDLX_PERF_CLEAR)
+				e->perf_bytes = 0;
+			if ((w & MDLX_PERF_RUN) &&
+			    !(e->regs->perf_ctrl & MDLX_PERF_RUN))
+				e->perf_start_ns = ktime_get_ns();
+			e->regs->perf_ctrl = w & ~MDLX_PERF_CLEAR;
+			return false;
+		case offsetof(struct engine_regs, identifier):
+		case offsetof(struct engine_regs, status_rc):
+		case offsetof(struct engine_regs, completed_desc_count):
+		case offsetof(struct engine_regs, alignments):
+			return false;
+		}
+	} else if (off >= MDLX_OFS_INT_CTRL &&
+		   off < MDLX_OFS_INT_CTRL + sizeof(*irq_regs)) {
+		switch (off - MDLX_OFS_INT_CTRL) {
+		case offsetof(struct interrupt_regs, user_int_enable_w1s):
+			irq_regs->user_int_enable |= w;
+			return false;
+		case offsetof(struct interrupt_regs, user_int_enable_w1c):
+			irq_regs->user_int_enable &= ~w;
+			return false;
+		case offsetof(struct interrupt_regs, channel_int_enable):
+			irq_regs->channel_int_enable = w;
+			return true;
+		case offsetof(struct interrupt_regs, channel_int_enable_w1s):
+			irq_regs->channel_int_enable |= w;
+			return true;
+		case offsetof(struct interrupt_regs, channel_int_enable_w1c):
+			irq_regs->channel_int_enable &= ~w;
+			return false;
+		case offsetof(struct interrupt_regs, identifier):
+			return false;
+		}
+	}
+
+	*emu_reg(edev, off) = w;
+	return false;
+}
+
+u32 mdlx_emu_read32(void *iomem)
+{
+	struct mdlx_emu_dev *edev = emu_find(iomem);
+	unsigned long flags;
+	u32 v;
+
+	if (!edev)
+		return ioread32(iomem);
+
+	spin_lock_irqsave(&edev->lock, flags);
+	v = emu_reg_read(edev, (u8 *)iomem - edev->config_bar);
+	spin_unlock_irqrestore(&edev->lock, flags);
+	return v;
+}
+
+void mdlx_emu_write32(u32 value, void *iomem)
+{
+	struct mdlx_emu_dev *edev = emu_find(iomem);
+	unsigned long flags;
+	bool raise;
+
+	if (!edev) {
+		iowrite32(value, iomem);
+		return;
+	}
+
+	spin_lock_irqsave(&edev->lock, flags);
+	raise = emu_reg_write(edev, (u8 *)iomem - edev->config_bar, value);
+	if (raise)
+		raise = emu_channel_request(edev) != 0;
+	spin_unlock_irqrestore(&edev->lock, flags);
+
+	/* the driver may hold its own locks here, deliver from a work */
+	if (raise)
+		queue_work(emu_wq, &edev->irq_work);
+}
+
+/* identification registers, as the hardware presents them after reset */
+static void emu_regs_reset(struct mdlx_emu_dev *edev)
+{
+	int i;
+
+	memset(edev->config_bar, 0, EMU_CONFIG_BAR_SIZE);
+
+	*emu_reg(edev, MDLX_OFS_INT_CTRL) = IRQ_BLOCK_ID | EMU_ENGINE_VERSION;
+	*emu_reg(edev, MDLX_OFS_CONFIG) = CONFIG_BLOCK_ID | EMU_ENGINE_VERSION;
+
+	edev->engines_num = emu_channels * 2;
+	for (i = 0; i < edev->engines_num; i++) {
+		struct mdlx_emu_engine *e = &edev->engine[i];
+		int channel = i % emu_channels;
+		unsigned long off = channel * CHANNEL_SPACING;
+
+		e->h2c = i < emu_channels;
+		if (!e->h2c)
+			off += H2C_CHANNEL_OFFSET;
+		e->edev = edev;
+		e->irq_bit = 1 << i;
+		e->regs = (struct engine_regs *)(edev->config_bar + off);
+		e->sgdma_regs = (struct engine_sgdma_regs *)
+			(edev->config_bar + off + SGDMA_OFFSET_FROM_CHANNEL);
+		e->regs->identifier = ((e->h2c ? MDLX_ID_H2C : MDLX_ID_C2H) <<
+				       16) | (channel << 8) | EMU_ENGINE_VERSION;
+		e->regs->alignments = EMU_ALIGNMENTS;
+		e->sgdma_regs->identifier = e->regs->identifier + (4 << 16);
+		INIT_WORK(&e->work, emu_engine_work);
+	}
+}
+
+bool mdlx_emu_pdev(struct pci_dev *pdev)
+{
+	struct mdlx_emu_dev *edev;
+
+	list_for_each_entry(edev, &emu_list, list) {
+		if (&edev->pdev == pdev)
+			return true;
+	}
+	return false;
+}
+
+int mdlx_emu_map_bars(struct mdlx_dev *mdev)
+{
+	struct mdlx_emu_dev *edev = container_of(mdev->pdev,
+						struct mdlx_emu_dev, pdev);
+
+	emu_regs_reset(edev);
+	mdev->bar[EMU_CONFIG_BAR] = (void __iomem *)edev->config_bar;
+	mdev->bar_len[EMU_CONFIG_BAR] = EMU_CONFIG_BAR_SIZE;
+	mdev->config_bar_idx = EMU_CONFIG_BAR;
+	mdev->bar[EMU_USER_BAR] = (void __iomem *)edev->user_bar;
+	mdev->bar_len[EMU_USER_BAR] = EMU_USER_BAR_SIZE;
+	mdev->user_bar_idx = EMU_USER_BAR;
+	edev->mdev = mdev;
+	return 0;
+}
+
+void mdlx_emu_unmap_bars(struct mdlx_dev *mdev)
+{
+	struct mdlx_emu_dev *edev = container_of(mdev->pdev,
+						struct mdlx_emu_dev, pdev);
+	int i;
+
+	/* engines were stopped and destroyed, flush anything still queued */
+	for (i = 0; i < edev->engines_num; i++)
+		cancel_work_sync(&edev->engine[i].work);
+
+	mdev->bar[EMU_CONFIG_BAR] = NULL;
+	mdev->bar_len[EMU_CONFIG_BAR] = 0;
+	mdev->bar[EMU_USER_BAR] = NULL;
+	mdev->bar_len[EMU_USER_BAR] = 0;
+	edev->mdev = NULL;
+}
+
+int mdlx_emu_irq_setup(struct mdlx_dev *mdev, irq_handler_t isr)
+{
+	struct mdlx_emu_dev *edev = container_of(mdev->pdev,
+						struct mdlx_emu_dev, pdev);
+
+	edev->isr = isr;
+	return 0;
+}
+
+void mdlx_emu_irq_teardown(struct mdlx_dev *mdev)
+{
+	struct mdlx_emu_dev *edev = container_of(mdev->pdev,
+						struct mdlx_emu_dev, pdev);
+
+	edev->isr = NULL;
+	cancel_work_sync(&edev->irq_work);
+}
+
+static void emu_dev_release(struct device *dev)
+{
+	struct mdlx_emu_dev *edev = container_of(dev, struct mdlx_emu_dev,
+						pdev.dev);
+
+	vfree(edev->ddr);
+	vfree(edev->user_bar);
+	vfree(edev->config_bar);
+	kfree(edev);
+}
+
+static struct mdlx_emu_dev *emu_dev_create(int idx)
+{
+	struct mdlx_emu_dev *edev;
+	struct pci_dev *pdev;
+	int rv;
+
+	edev = kzalloc(sizeof(*edev), GFP_KERNEL);
+	if (!edev)
+		return NULL;
+
+	edev->idx = idx;
+	spin_lock_init(&edev->lock);
+	INIT_WORK(&edev->irq_work, emu_irq_work);
+	edev->ddr_size = (size_t)emu_ddr_mb << 20;
+	edev->config_bar = vzalloc(EMU_CONFIG_BAR_SIZE);
+	edev->user_bar = vzalloc(EMU_USER_BAR_SIZE);
+	edev->ddr = vzalloc(edev->ddr_size);
+
+	pdev = &edev->pdev;
+	device_initialize(&pdev->dev);
+	pdev->dev.parent = emu_root;
+	pdev->dev.release = emu_dev_release;
+	pdev->vendor = PCI_VENDOR_ID_XILINX;
+	pdev->device = 0x1818;
+	pdev->dev.dma_mask = &pdev->dev.coherent_dma_mask;
+	dev_set_name(&pdev->dev, "mdlx_emu.%d", idx);
+
+	if (!edev->config_bar || !edev->user_bar || !edev->ddr) {
+		pr_err("emu %d, OOM, ddr %u MB.\n", idx, emu_ddr_mb);
+		goto err_out;
+	}
+
+	rv = dma_set_mask_and_coherent(&pdev->dev, DMA_BIT_MASK(64));
+	if (rv)
+		goto err_out;
+
+	rv = device_add(&pdev->dev);
+	if (rv) {
+		pr_err("emu %d, device_add failed %d.\n", idx, rv);
+		goto err_out;
+	}
+	return edev;
+
+err_out:
+	put_device(&pdev->dev);
+	return NULL;
+}
+
+int mdlx_emu_init(int (*probe)(struct pci_dev *, const struct pci_device_id *))
+{
+	struct mdlx_emu_dev *edev;
+	int i;
+
+	if (!emu_devices)
+		return 0;
+
+	if (!emu_channels || emu_channels > MDLX_CHANNEL_NUM_MAX)
+		emu_channels = MDLX_CHANNEL_NUM_MAX;
+
+	emu_wq = alloc_workqueue("mdlx_emu", WQ_UNBOUND | WQ_HIGHPRI, 0);
+	if (!emu_wq)
+		return -ENOMEM;
+
+	emu_root = root_device_register("mdlx_emu");
+	if (IS_ERR(emu_root)) {
+		destroy_workqueue(emu_wq);
+		emu_wq = NULL;
+		return PTR_ERR(emu_root);
+	}
+
+	for (i = 0; i < emu_devices; i++) {
+		edev = emu_dev_create(i);
+		if (!edev)
+			break;
+		list_add_tail(&edev->list, &emu_list);
+
+		if (probe(&edev->pdev, NULL) < 0) {
+			pr_err("emu %d, probe failed.\n", i);
+			list_del(&edev->list);
+			device_unregister(&edev->pdev.dev);
+			break;
+		}
+	}
+
+	pr_info("%d emulated device(s), %u channel(s), ddr %u MB.\n", i,
+		emu_channels, emu_ddr_mb);
+	return 0;
+}
+
+void mdlx_emu_exit(void (*remove)(struct pci_dev *))
+{
+	struct mdlx_emu_dev *edev, *tmp;
+
+	if (!emu_wq)
+		return;
+
+	list_for_each_entry_safe_reverse(edev, tmp, &emu_list, list) {
+		remove(&edev->pdev);
+		list_del(&edev->list);
+		device_unregister(&edev->pdev.dev);
+	}
+
+	root_device_unregister(emu_root);
+	destroy_workqueue(emu_wq);
+	emu_wq = NULL;
+}
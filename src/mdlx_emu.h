@@ -0,0 +1,65 @@
+/*
+ * This file is part of the Medium DMA IP Core driver for Linux
+ *
+ * Copyright (c) 2020-present,  Medium, Inc.
+ * All rights reserved.
+ *
+ * This source code is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ */
+
+#ifndef __MDLX_EMU_H__
+#define __MDLX_EMU_H__
+/**
+ * @file
+ * @brief Software emulated MDLX device, built with "make emu=1"
+ *
+ * The emulator registers fake PCI devices whose config BAR is backed by
+ * memory. libmdlx routes its register accesses through mdlx_emu_read32()/
+ * mdlx_emu_write32(), which model the engine, SGDMA and interrupt blocks.
+ * Started engines walk the descriptor chain in host memory, move data to and
+ * from an in-memory device DDR, and report completion through the status,
+ * completed count, poll mode writeback and the driver's interrupt handler.
+ */
+#include <linux/interrupt.h>
+#include <linux/pci.h>
+#include "libmdlx.h"
+
+#ifdef __MDLX_EMU__
+
+int mdlx_emu_init(int (*probe)(struct pci_dev *, const struct pci_device_id *));
+void mdlx_emu_exit(void (*remove)(struct pci_dev *));
+
+bool mdlx_emu_pdev(struct pci_dev *pdev);
+int mdlx_emu_map_bars(struct mdlx_dev *mdev);
+void mdlx_emu_unmap_bars(struct mdlx_dev *mdev);
+int mdlx_emu_irq_setup(struct mdlx_dev *mdev, irq_handler_t isr);
+void mdlx_emu_irq_teardown(struct mdlx_dev *mdev);
+
+u32 mdlx_emu_read32(void *iomem);
+void mdlx_emu_write32(u32 value, void *iomem);
+
+#else
+
+static inline int mdlx_emu_init(
+		int (*probe)(struct pci_dev *, const struct pci_device_id *))
+{
+	return 0;
+}
+
+static inline void mdlx_emu_exit(void (*remove)(struct pci_dev *))
+{
+}
+
+#endif /* __MDLX_EMU__ */
+
+#endif /* __MDLX_EMU_H__ */
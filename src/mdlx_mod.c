@@ -28,6 +28,7 @@
 #include "libmdlx.h"
 #include "mdlx_mod.h"
 #include "mdlx_cdev.h"
+#include "mdlx_emu.h"
 #include "version.h"
 
 #define DRV_MODULE_NAME		"mdlx"
@@ -367,11 +368,22 @@ static int __init mdlx_mod_init(void)
 	if (rv < 0)
 		return rv;
 
-	return pci_register_driver(&pci_driver);
+	rv = pci_register_driver(&pci_driver);
+	if (rv < 0)
+		return rv;
+
+	rv = mdlx_emu_init(probe_one);
+	if (rv < 0) {
+		pci_unregister_driver(&pci_driver);
+		mdlx_cdev_cleanup();
+	}
+	return rv;
 }
 
 static void __exit mdlx_mod_exit(void)
 {
+	mdlx_emu_exit(remove_one);
+
 	/* unregister this driver from the PCI bus driver */
 	dbg_init("pci_unregister_driver.\n");
 	pci_unregister_driver(&pci_driver);
@@ -68,6 +68,10 @@ struct mdlx_cdev {
 	struct mdlx_engine *engine;	/* engine instance, if needed */
 	struct mdlx_user_irq *user_irq;	/* IRQ value, if needed */
 	struct device *sys_device;	/* sysfs device */
+	int any_channel;		/* submit to the least loaded channel */
+	int wc;				/* map the BAR write-combined */
+	int wc_cookie;			/* arch_phys_wc_add() handle */
+	unsigned int timeout_ms;	/* transfer timeout, 0 for sgdma_timeout */
 	spinlock_t lock;
 };
 
@@ -88,9 +92,12 @@ struct mdlx_pci_dev {
 	struct mdlx_cdev ctrl_cdev;
 	struct mdlx_cdev sgdma_c2h_cdev[MDLX_CHANNEL_NUM_MAX];
 	struct mdlx_cdev sgdma_h2c_cdev[MDLX_CHANNEL_NUM_MAX];
+	struct mdlx_cdev sgdma_c2h_any_cdev;
+	struct mdlx_cdev sgdma_h2c_any_cdev;
 	struct mdlx_cdev events_cdev[16];
 
 	struct mdlx_cdev user_cdev;
+	struct mdlx_cdev user_wc_cdev;
 	struct mdlx_cdev bypass_c2h_cdev[MDLX_CHANNEL_NUM_MAX];
 	struct mdlx_cdev bypass_h2c_cdev[MDLX_CHANNEL_NUM_MAX];
 	struct mdlx_cdev bypass_cdev_base;
@@ -23,11 +23,35 @@
 
 #include <linux/kernel.h>
 #include <linux/slab.h>
+#include <linux/module.h>
+#include <linux/workqueue.h>
 
 
 /* ********************* global variables *********************************** */
+static unsigned int cmpl_threads;
+module_param(cmpl_threads, uint, 0644);
+MODULE_PARM_DESC(cmpl_threads,
+	"Maximum completion status threads in poll mode, default 0 (one per polled engine, at most the CPUs of the card's node)");
+
+static unsigned int cmpl_balance_ms = 1000;
+module_param(cmpl_balance_ms, uint, 0644);
+MODULE_PARM_DESC(cmpl_balance_ms,
+	"Interval in ms at which polled engines are rebalanced over the completion status threads and cmpl_threads is applied, 0 disables, default 1000");
+
+/* one slot per possible CPU, a thread is started when its CPU is needed */
 static struct mdlx_kthread *cs_threads;
 static unsigned int thread_cnt;
+/* polled engines, over all devices */
+static unsigned int engine_cnt;
+/* serializes thread start/stop and engine placement */
+static DEFINE_MUTEX(thread_mutex);
+
+/* empty sweeps spent spinning, then sleeping up to 1 << shift us */
+#define SWEEP_SPINS		64
+#define SWEEP_SLEEP_SHIFT_MAX	6U
+
+static void mdlx_thread_balance_work(struct work_struct *work);
+static DECLARE_DELAYED_WORK(balance_work, mdlx_thread_balance_work);
 
 
 /* ********************* static function definitions ************************ */
@@ -35,26 +59,27 @@ static int mdlx_thread_cmpl_status_pend(struct list_head *work_item)
 {
 	struct mdlx_engine *engine = list_entry(work_item, struct mdlx_engine,
 						cmplthp_list);
-	int pend = 0;
-	unsigned long flags;
 
-	spin_lock_irqsave(&engine->lock, flags);
-		pend = !list_empty(&engine->transfer_list);
-	spin_unlock_irqrestore(&engine->lock, flags);
-
-	return pend;
+	/*
+	 * a hint only, the status proc services the engine under its lock;
+	 * taking engine->lock here for every pass of the thread contends with
+	 * the submitters; the device summary keeps the sweep on one cache
+	 * line per card
+	 */
+	return mdlx_engine_poll_pending(engine);
 }
 
 static int mdlx_thread_cmpl_status_proc(struct list_head *work_item)
 {
 	struct mdlx_engine *engine;
-	struct mdlx_transfer * transfer;
+	int rv;
 
 	engine = list_entry(work_item, struct mdlx_engine, cmplthp_list);
-	transfer = list_entry(engine->transfer_list.next, struct mdlx_transfer,
-			entry);
-	engine_service_poll(engine, transfer->desc_num);
-	return 0;
+	rv = engine_service_poll_try(engine);
+	/* load seen by the balancer */
+	if (rv > 0)
+		engine->cmpl_work++;
+	return rv;
 }
 
 
@@ -90,9 +115,27 @@ static inline void xthread_reschedule(struct mdlx_kthread *thp)
 	}
 }
 
+/*
+ * xthread_backoff - wait between sweeps that found work pending but nothing
+ * complete: spin first, then sleep for an exponentially growing interval
+ */
+static void xthread_backoff(unsigned int idle)
+{
+	unsigned int us;
+
+	if (idle < SWEEP_SPINS) {
+		cpu_relax();
+		return;
+	}
+
+	us = 1U << min(idle - SWEEP_SPINS, SWEEP_SLEEP_SHIFT_MAX);
+	usleep_range(us, us * 2);
+}
+
 static int xthread_main(void *data)
 {
 	struct mdlx_kthread *thp = (struct mdlx_kthread *)data;
+	unsigned int idle = 0;
 
 	pr_debug_thread("%s UP.\n", thp->name);
 
@@ -105,28 +148,34 @@ static int xthread_main(void *data)
 	while (!kthread_should_stop()) {
 
 		struct list_head *work_item, *next;
+		int done = 0;
+		int pending;
 
 		pr_debug_thread("%s interruptible\n", thp->name);
 
-		/* any work to do? */
+		/*
+		 * one sweep over all the work items; fproc never waits, so the
+		 * thread lock is only held for a single pass
+		 */
 		lock_thread(thp);
-		if (!xthread_work_pending(thp)) {
-			unlock_thread(thp);
-			xthread_reschedule(thp);
-			lock_thread(thp);
-		}
 		thp->schedule = 0;
-
-		if (thp->work_cnt) {
-			pr_debug_thread("%s processing %u work items\n",
-					thp->name, thp->work_cnt);
-			/* do work */
-			list_for_each_safe(work_item, next, &thp->work_list) {
-				thp->fproc(work_item);
-			}
+		list_for_each_safe(work_item, next, &thp->work_list) {
+			if (thp->fproc(work_item) > 0)
+				done++;
 		}
+		pending = xthread_work_pending(thp);
 		unlock_thread(thp);
-		schedule();
+
+		if (done) {
+			idle = 0;
+			cond_resched();
+		} else if (pending) {
+			xthread_backoff(idle++);
+		} else {
+			/* nothing queued, sleep until a submitter wakes us */
+			idle = 0;
+			xthread_reschedule(thp);
+		}
 	}
 
 	pr_debug_thread("%s, work done.\n", thp->name);
@@ -205,147 +254,336 @@ int mdlx_kthread_stop(struct mdlx_kthread *thp)
 
 
 
+/* thread_target - number of threads wanted for the polled engines */
+static unsigned int thread_target(void)
+{
+	unsigned int n = engine_cnt;
+
+	if (cmpl_threads && n > cmpl_threads)
+		n = cmpl_threads;
+	return min(n, num_online_cpus());
+}
+
+/*
+ * thread_start_mask - start a thread on a CPU of @mask without one, or on any
+ * online CPU without one when @mask is full and @fallback is set
+ */
+static struct mdlx_kthread *thread_start_mask(const struct cpumask *mask,
+					      bool fallback)
+{
+	struct mdlx_kthread *thp;
+	int cpu;
+
+	if (!cs_threads) {
+		cs_threads = kcalloc(nr_cpu_ids, sizeof(struct mdlx_kthread),
+				     GFP_KERNEL);
+		if (!cs_threads)
+			return NULL;
+	}
+
+	for (;;) {
+		for_each_cpu_and(cpu, mask, cpu_online_mask) {
+			thp = cs_threads + cpu;
+			if (thp->task)
+				continue;
+
+			thp->cpu = cpu;
+			thp->timeout = 0;
+			thp->fproc = mdlx_thread_cmpl_status_proc;
+			thp->fpending = mdlx_thread_cmpl_status_pend;
+			if (mdlx_kthread_start(thp, "cmpl_status_th", cpu) < 0)
+				return NULL;
+			thread_cnt++;
+			pr_info("%s started, node %d, %u threads.\n", thp->name,
+				cpu_to_node(cpu), thread_cnt);
+
+			if (cmpl_balance_ms)
+				mod_delayed_work(system_wq, &balance_work,
+					msecs_to_jiffies(cmpl_balance_ms));
+			return thp;
+		}
+		if (!fallback || mask == cpu_online_mask)
+			return NULL;
+		mask = cpu_online_mask;
+	}
+}
+
+/*
+ * thread_start - start a thread on a CPU of @node without one, or on any
+ * online CPU without one when the node is full
+ */
+static struct mdlx_kthread *thread_start(int node)
+{
+	return thread_start_mask(node == NUMA_NO_NODE ? cpu_online_mask :
+				 cpumask_of_node(node), true);
+}
+
+/*
+ * thread_least_loaded - running thread with the fewest engines, preferring
+ * the threads on @node
+ */
+static struct mdlx_kthread *thread_least_loaded(int node,
+						struct mdlx_kthread *skip)
+{
+	struct mdlx_kthread *best = NULL;
+	bool best_local = false;
+	int cpu;
+
+	if (!cs_threads)
+		return NULL;
+
+	for_each_possible_cpu(cpu) {
+		struct mdlx_kthread *thp = cs_threads + cpu;
+		bool local;
+
+		if (!thp->task || thp == skip)
+			continue;
+
+		local = node == NUMA_NO_NODE || cpu_to_node(cpu) == node;
+		if (!best || (local && !best_local) ||
+		    (local == best_local && thp->work_cnt < best->work_cnt)) {
+			best = thp;
+			best_local = local;
+		}
+	}
+	return best;
+}
+
+static int engine_node(struct mdlx_engine *engine)
+{
+	return dev_to_node(&engine->mdev->pdev->dev);
+}
+
+/* engine_move - move @engine from its thread to @to, thread_mutex held */
+static void engine_move(struct mdlx_engine *engine, struct mdlx_kthread *to)
+{
+	struct mdlx_kthread *from = engine->cmplthp;
+	unsigned long flags;
+
+	if (from) {
+		lock_thread(from);
+		list_del(&engine->cmplthp_list);
+		from->work_cnt--;
+		unlock_thread(from);
+	}
+
+	lock_thread(to);
+	list_add_tail(&engine->cmplthp_list, &to->work_list);
+	to->work_cnt++;
+	unlock_thread(to);
+
+	spin_lock_irqsave(&engine->lock, flags);
+	engine->cmplthp = to;
+	engine->intr_work_cpu = to->cpu;
+	spin_unlock_irqrestore(&engine->lock, flags);
+
+	/* it may have been missed while moving */
+	mdlx_kthread_wakeup(to);
+}
+
+/* thread_stop - move the engines of @thp elsewhere and stop it */
+static int thread_stop(struct mdlx_kthread *thp)
+{
+	struct mdlx_engine *engine, *tmp;
+
+	list_for_each_entry_safe(engine, tmp, &thp->work_list, cmplthp_list) {
+		struct mdlx_kthread *to = thread_least_loaded(
+						engine_node(engine), thp);
+
+		if (!to)
+			return -EBUSY;
+		engine_move(engine, to);
+	}
+
+	mdlx_kthread_stop(thp);
+	thp->fproc = NULL;
+	thread_cnt--;
+	pr_info("%s stopped, %u threads.\n", thp->name, thread_cnt);
+	return 0;
+}
+
+/* thread_resize - grow or shrink the running threads to thread_target() */
+static void thread_resize(int node)
+{
+	unsigned int target = thread_target();
+
+	while (thread_cnt < target && thread_start(node))
+		;
+
+	while (thread_cnt > target) {
+		struct mdlx_kthread *thp = thread_least_loaded(NUMA_NO_NODE,
+							       NULL);
+
+		if (!thp || thread_stop(thp) < 0)
+			break;
+	}
+}
+
 void mdlx_thread_remove_work(struct mdlx_engine *engine)
 {
 	struct mdlx_kthread *cmpl_thread;
 	unsigned long flags;
 
+	mutex_lock(&thread_mutex);
+
 	spin_lock_irqsave(&engine->lock, flags);
 	cmpl_thread = engine->cmplthp;
 	engine->cmplthp = NULL;
-
-//	pr_debug("%s removing from thread %s, %u.\n",
-//		descq->conf.name, cmpl_thread ? cmpl_thread->name : "?",
-//		cpu_idx);
-
 	spin_unlock_irqrestore(&engine->lock, flags);
 
-#if 0
-	if (cpu_idx < cpu_count) {
-		spin_lock(&qcnt_lock);
-		per_cpu_qcnt[cpu_idx]--;
-		spin_unlock(&qcnt_lock);
-	}
-#endif
-
 	if (cmpl_thread) {
 		lock_thread(cmpl_thread);
 		list_del(&engine->cmplthp_list);
 		cmpl_thread->work_cnt--;
 		unlock_thread(cmpl_thread);
+		engine_cnt--;
 	}
 
-
+	thread_resize(NUMA_NO_NODE);
+	mutex_unlock(&thread_mutex);
 }
 
 void mdlx_thread_add_work(struct mdlx_engine *engine)
 {
-	struct mdlx_kthread *thp = cs_threads;
-	unsigned int v = 0;
-	int i, idx = thread_cnt;
-	unsigned long flags;
+	int node = engine_node(engine);
+	struct mdlx_kthread *thp;
 
+	mutex_lock(&thread_mutex);
 
 	/* Polled mode only */
-	for (i = 0; i < thread_cnt; i++, thp++) {
-		lock_thread(thp);
-		if (idx == thread_cnt) {
-			v = thp->work_cnt;
-			idx = i;
-		} else if (!thp->work_cnt) {
-			idx = i;
-			unlock_thread(thp);
-			break;
-		} else if (thp->work_cnt < v)
-			idx = i;
-		unlock_thread(thp);
+	engine_cnt++;
+	thread_resize(node);
+
+	thp = thread_least_loaded(node, NULL);
+	if (!thp) {
+		engine_cnt--;
+		mutex_unlock(&thread_mutex);
+		pr_err("%s, no completion status thread.\n", engine->name);
+		return;
 	}
 
-	thp = cs_threads + idx;
-	lock_thread(thp);
-	list_add_tail(&engine->cmplthp_list, &thp->work_list);
-	engine->intr_work_cpu = idx;
-	thp->work_cnt++;
-	unlock_thread(thp);
+	engine->cmplthp = NULL;
+	engine->cmpl_work_last = engine->cmpl_work;
+	engine_move(engine, thp);
+	mutex_unlock(&thread_mutex);
 
 	pr_info("%s 0x%p assigned to cmpl status thread %s,%u.\n",
 		engine->name, engine, thp->name, thp->work_cnt);
+}
 
-
-	spin_lock_irqsave(&engine->lock, flags);
-	engine->cmplthp = thp;
-	spin_unlock_irqrestore(&engine->lock, flags);
-
+void mdlx_thread_colocate(struct mdlx_engine *engine)
+{
+	struct mdlx_kthread *from, *to;
+	int cpu = engine->irq_cpu;
+
+	mutex_lock(&thread_mutex);
+	from = engine->cmplthp;
+	if (!from || cpu < 0 || from->cpu == cpu || !cpu_online(cpu))
+		goto out;
+
+	to = cs_threads + cpu;
+	/* a thread of its own keeps the thread count as it is */
+	if (!to->task && (from->work_cnt == 1 || thread_cnt < thread_target()))
+		to = thread_start_mask(cpumask_of(cpu), false);
+	if (!to || !to->task)
+		goto out;
+
+	engine_move(engine, to);
+	/* stops the emptied thread if there is one too many now */
+	thread_resize(NUMA_NO_NODE);
+	pr_info("%s moved to cmpl status thread %s with its irq.\n",
+		engine->name, to->name);
+out:
+	mutex_unlock(&thread_mutex);
 }
 
-int mdlx_threads_create(unsigned int num_threads)
+/*
+ * mdlx_thread_balance_work - apply cmpl_threads, then move one engine from
+ * the busiest thread to the idlest when the busiest serviced more than twice
+ * as many completions over the last interval
+ */
+static void mdlx_thread_balance_work(struct work_struct *work)
 {
-	struct mdlx_kthread *thp;
-	int rv;
+	struct mdlx_kthread *busy = NULL, *idle = NULL;
+	unsigned long busy_load = 0, idle_load = ULONG_MAX;
+	struct mdlx_engine *engine, *pick = NULL;
+	unsigned long pick_load = 0;
 	int cpu;
 
-	if (thread_cnt) {
-		pr_warn("threads already created!");
-		return 0;
+	mutex_lock(&thread_mutex);
+	if (!thread_cnt) {
+		mutex_unlock(&thread_mutex);
+		return;
 	}
+	thread_resize(NUMA_NO_NODE);
 
-	pr_info("mdlx_threads_create\n");
+	for_each_possible_cpu(cpu) {
+		struct mdlx_kthread *thp = cs_threads + cpu;
+		unsigned long load = 0;
 
-	cs_threads = kzalloc(num_threads * sizeof(struct mdlx_kthread),
-									GFP_KERNEL);
-                                     
-	if (!cs_threads) {
-		pr_info("cs_threads NG %p\n",cs_threads);  
-    	return -ENOMEM;
-  	}else{
-		pr_info("cs_threads OK %p\n",cs_threads); 
-	} 
-
-	/* N dma writeback monitoring threads */
-	thp = cs_threads;
-	for_each_online_cpu(cpu) {
-		pr_debug("index %d cpu %d online\n", thread_cnt, cpu);
-		thp->cpu = cpu;
-		thp->timeout = 0;
-		thp->fproc = mdlx_thread_cmpl_status_proc;
-		thp->fpending = mdlx_thread_cmpl_status_pend;
-		rv = mdlx_kthread_start(thp, "cmpl_status_th", thread_cnt);
-		if (rv < 0)
-			goto cleanup_threads;
-
-		thread_cnt++;
-		if (thread_cnt == num_threads)
-			break;
-		thp++;
+		if (!thp->task)
+			continue;
+
+		lock_thread(thp);
+		list_for_each_entry(engine, &thp->work_list, cmplthp_list) {
+			engine->cmpl_load = engine->cmpl_work -
+					    engine->cmpl_work_last;
+			engine->cmpl_work_last = engine->cmpl_work;
+			load += engine->cmpl_load;
+		}
+		unlock_thread(thp);
+
+		if (!busy || load > busy_load) {
+			busy = thp;
+			busy_load = load;
+		}
+		if (!idle || load < idle_load) {
+			idle = thp;
+			idle_load = load;
+		}
 	}
 
-  	pr_info("mdlx_threads Finished\n");
-	return 0;
+	if (busy != idle && busy->work_cnt > 1 && busy_load > 2 * idle_load) {
+		/* the engine closest to half of the difference */
+		unsigned long half = (busy_load - idle_load) / 2;
 
-cleanup_threads:
-  	//pr_info("cleanup_threads");
-	kfree(cs_threads);
-	cs_threads = NULL;
-	thread_cnt = 0;
+		list_for_each_entry(engine, &busy->work_list, cmplthp_list) {
+			if (engine->cmpl_load <= half &&
+			    engine->cmpl_load >= pick_load) {
+				pick = engine;
+				pick_load = engine->cmpl_load;
+			}
+		}
+		if (pick) {
+			dbg_tfr("%s moved from %s to %s, load %lu/%lu.\n",
+				pick->name, busy->name, idle->name, busy_load,
+				idle_load);
+			engine_move(pick, idle);
+		}
+	}
 
-	return rv;
+	if (cmpl_balance_ms)
+		schedule_delayed_work(&balance_work,
+				      msecs_to_jiffies(cmpl_balance_ms));
+	mutex_unlock(&thread_mutex);
 }
 
 void mdlx_threads_destroy(void)
 {
-	int i;
-	struct mdlx_kthread *thp;
+	int cpu;
 
-	if (!thread_cnt)
-		return;
+	cancel_delayed_work_sync(&balance_work);
 
-	/* N dma writeback monitoring threads */
-	thp = cs_threads;
-	for (i = 0; i < thread_cnt; i++, thp++)
-		if (thp->fproc)
-			mdlx_kthread_stop(thp);
+	mutex_lock(&thread_mutex);
+	if (cs_threads) {
+		/* dma writeback monitoring threads */
+		for_each_possible_cpu(cpu)
+			if (cs_threads[cpu].task)
+				mdlx_kthread_stop(cs_threads + cpu);
+	}
 
 	kfree(cs_threads);
 	cs_threads = NULL;
 	thread_cnt = 0;
+	mutex_unlock(&thread_mutex);
 }
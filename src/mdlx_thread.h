@@ -102,7 +102,7 @@ struct mdlx_kthread {
 	int (*finit)(struct mdlx_kthread *);
 	/**  thread pending handler */
 	int (*fpending)(struct list_head *);
-	/**  thread peocessing handler */
+	/**  thread processing handler, must not wait, > 0 if it did work */
 	int (*fproc)(struct list_head *);
 	/**  thread done handler */
 	int (*fdone)(struct mdlx_kthread *);
@@ -111,14 +111,8 @@ struct mdlx_kthread {
 
 /*****************************************************************************/
 /**
- * mdlx_threads_create() - create mdlx threads
-*********/
-int mdlx_threads_create(unsigned int num_threads);
-
-/*****************************************************************************/
-/**
- * mdlx_threads_destroy() - destroy all the mdlx threads created
- *                          during system initialization
+ * mdlx_threads_destroy() - destroy all the mdlx threads, they are started
+ *                          on demand by mdlx_thread_add_work()
  *
  * @return	none
  *****************************************************************************/
@@ -136,7 +130,8 @@ void mdlx_thread_remove_work(struct mdlx_engine *engine);
 
 /*****************************************************************************/
 /**
- * mdlx_thread_add_work() - handler to add a work thread
+ * mdlx_thread_add_work() - handler to add a work thread, starting threads
+ *                          on the card's node up to cmpl_threads
  *
  * @param[in]	engine:	pointer to mdlx_engine
  *
@@ -144,4 +139,15 @@ void mdlx_thread_remove_work(struct mdlx_engine *engine);
  *****************************************************************************/
 void mdlx_thread_add_work(struct mdlx_engine *engine);
 
+/*****************************************************************************/
+/**
+ * mdlx_thread_colocate() - move the engine to a thread on engine->irq_cpu,
+ *                          starting one there when the thread count allows
+ *
+ * @param[in]	engine:	pointer to mdlx_engine
+ *
+ * @return	none
+ *****************************************************************************/
+void mdlx_thread_colocate(struct mdlx_engine *engine);
+
 #endif /* #ifndef __MDLX_KTHREAD_H__ */
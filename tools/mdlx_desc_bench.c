@@ -0,0 +1,317 @@
+/*
+ * This file is part of the Medium DMA IP Core driver for Linux
+ *
+ * Copyright (c) 2020-present,  Medium, Inc.
+ * All rights reserved.
+ *
+ * This source code is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ */
+
+/*
+ * mdlx_desc_bench - build SGDMA descriptor chains on the host with the
+ * driver's own src/libmdlx_desc.c, check every chain against the hardware
+ * rules, then time chain construction in ns per descriptor.
+ *
+ *   mdlx_desc_bench [-l layout] [-n iterations] [-s seed]
+ *
+ * Exits non-zero if any chain breaks an invariant.
+ */
+
+#include <getopt.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "libmdlx_desc.h"
+
+/* the descriptor ring of one engine, page aligned like dma_alloc_coherent */
+#define RING_BUS	0x80000000ULL
+#define RING_CHECKS	256
+
+struct layout {
+	const char *name;
+	unsigned int nents;	/* sg entries */
+	unsigned int min_len;	/* sg entry length range, multiple of 4 */
+	unsigned int max_len;
+	unsigned int blen_max;	/* desc_blen_max */
+};
+
+static const struct layout layouts[] = {
+	/* user pages of a pinned buffer */
+	{ "page", 256, 4096, 4096, MDLX_DESC_BLEN_MAX },
+	/* many short fragments, descriptor overhead dominates */
+	{ "small", 1024, 64, 1024, MDLX_DESC_BLEN_MAX },
+	/* partially merged pages split by a reduced desc_blen_max */
+	{ "mixed", 64, 4, 256 * 1024, 64 * 1024 },
+	/* huge pages split into more descriptors than one transfer holds */
+	{ "huge", 16, 1024 * 1024, 1024 * 1024, 4096 },
+};
+
+static struct mdlx_desc ring[MDLX_TRANSFER_MAX_DESC]
+	__attribute__((aligned(MDLX_DESC_PAGE_SIZE)));
+
+struct sg_ent {
+	dma_addr_t addr;
+	unsigned int len;
+};
+
+static int errors;
+
+#define CHECK(cond, fmt, ...) do {					\
+	if (!(cond)) {							\
+		if (errors++ < 10)					\
+			fprintf(stderr, "%s: " fmt "\n", #cond,		\
+				##__VA_ARGS__);				\
+	}								\
+} while (0)
+
+static void make_sg(const struct layout *l, struct sg_ent *sg)
+{
+	dma_addr_t addr = 0x100000000ULL;
+	unsigned int span = (l->max_len - l->min_len) / 4 + 1;
+	unsigned int i;
+
+	for (i = 0; i < l->nents; i++) {
+		sg[i].len = l->min_len + (rand() % span) * 4;
+		/* scattered, sometimes physically contiguous, entries */
+		if (rand() & 1)
+			addr += ((u64)(rand() % 4096) + 1) * 4096;
+		sg[i].addr = addr;
+		addr += sg[i].len;
+	}
+}
+
+static unsigned int split_sg(const struct layout *l, const struct sg_ent *sg,
+			     struct sw_desc *sdesc)
+{
+	unsigned int j = 0;
+	unsigned int i;
+
+	for (i = 0; i < l->nents; i++)
+		j += mdlx_sw_desc_split(sdesc + j, sg[i].addr, sg[i].len,
+					l->blen_max);
+	return j;
+}
+
+static void check_chain(const struct mdlx_desc *desc, unsigned int ring_idx,
+			unsigned int count, unsigned int adjacent,
+			const struct sw_desc *sdesc, u64 ep_addr, int dir,
+			unsigned int blen_max)
+{
+	dma_addr_t bus = RING_BUS + ring_idx * sizeof(struct mdlx_desc);
+	unsigned int first_extra = adjacent ? adjacent - 1 : 0;
+	unsigned int i;
+
+	CHECK(count && ring_idx + count <= MDLX_TRANSFER_MAX_DESC,
+	      "ring %u, count %u", ring_idx, count);
+	CHECK(adjacent && adjacent <= count, "adjacent %u, count %u",
+	      adjacent, count);
+	/* placed by mdlx_desc_ring_place(), the first block is always full */
+	CHECK(adjacent >= (count < MDLX_DESC_SLOT_ALIGN ? count :
+			   MDLX_DESC_SLOT_ALIGN),
+	      "short first block, ring %u, adj %u, count %u", ring_idx,
+	      adjacent, count);
+	if (first_extra > MAX_EXTRA_ADJ)
+		first_extra = MAX_EXTRA_ADJ;
+	CHECK((bus & (MDLX_DESC_PAGE_SIZE - 1)) +
+	      (first_extra + 1) * sizeof(struct mdlx_desc) <=
+	      MDLX_DESC_PAGE_SIZE, "first block crosses page, ring %u, adj %u",
+	      ring_idx, adjacent);
+
+	for (i = 0; i < count; i++, bus += sizeof(struct mdlx_desc)) {
+		u32 control = le32_to_cpu(desc[i].control);
+		u32 extra_adj = (control >> 8) & 0x3f;
+		u64 next = ((u64)le32_to_cpu(desc[i].next_hi) << 32) |
+			   le32_to_cpu(desc[i].next_lo);
+		u64 src = ((u64)le32_to_cpu(desc[i].src_addr_hi) << 32) |
+			  le32_to_cpu(desc[i].src_addr_lo);
+		u64 dst = ((u64)le32_to_cpu(desc[i].dst_addr_hi) << 32) |
+			  le32_to_cpu(desc[i].dst_addr_lo);
+		u32 bytes = le32_to_cpu(desc[i].bytes);
+
+		CHECK((control & 0xffff0000) == DESC_MAGIC,
+		      "desc %u control 0x%x", i, control);
+		CHECK(bytes == sdesc[i].len && bytes && bytes <= blen_max,
+		      "desc %u bytes %u, sw len %u", i, bytes, sdesc[i].len);
+		CHECK((dir == DMA_TO_DEVICE ? src : dst) == sdesc[i].addr,
+		      "desc %u host address 0x%llx", i,
+		      (unsigned long long)sdesc[i].addr);
+		CHECK((dir == DMA_TO_DEVICE ? dst : src) == ep_addr,
+		      "desc %u ep address 0x%llx", i,
+		      (unsigned long long)ep_addr);
+		ep_addr += bytes;
+
+		if (i == count - 1) {
+			CHECK(!next, "last desc %u next 0x%llx", i,
+			      (unsigned long long)next);
+			CHECK(!extra_adj, "last desc %u extra_adj %u", i,
+			      extra_adj);
+			CHECK((control & LS_BYTE_MASK) == (MDLX_DESC_STOPPED |
+			      MDLX_DESC_EOP | MDLX_DESC_COMPLETED),
+			      "last desc %u control 0x%x", i, control);
+			continue;
+		}
+
+		CHECK(next == bus + sizeof(struct mdlx_desc),
+		      "desc %u next 0x%llx", i, (unsigned long long)next);
+		CHECK(!(control & LS_BYTE_MASK), "desc %u control 0x%x", i,
+		      control);
+		/* the prefetch of next plus extra_adj stays within the chain */
+		CHECK(extra_adj <= MAX_EXTRA_ADJ && i + 1 + extra_adj < count,
+		      "desc %u extra_adj %u of %u", i, extra_adj, count);
+		/* and within the page of the next descriptor */
+		CHECK((next & (MDLX_DESC_PAGE_SIZE - 1)) +
+		      (extra_adj + 1) * sizeof(struct mdlx_desc) <=
+		      MDLX_DESC_PAGE_SIZE, "desc %u extra_adj %u crosses page",
+		      i, extra_adj);
+	}
+}
+
+/*
+ * build the chains of one request the way transfer_init() does, starting at
+ * ring slot @ring_idx
+ *
+ * @return number of descriptors built
+ */
+static unsigned int build_request(const struct layout *l,
+				  const struct sw_desc *sdesc,
+				  unsigned int sw_desc_cnt,
+				  unsigned int *ring_idx, int dir, bool check)
+{
+	unsigned int sw_desc_idx = 0;
+	u64 ep_addr = 0;
+
+	while (sw_desc_idx < sw_desc_cnt) {
+		unsigned int idx;
+		unsigned int count = sw_desc_cnt - sw_desc_idx;
+		unsigned int adjacent;
+		u64 ep_start = ep_addr;
+
+		if (count > MDLX_TRANSFER_MAX_DESC)
+			count = MDLX_TRANSFER_MAX_DESC;
+		idx = mdlx_desc_ring_place(*ring_idx, count);
+		count = mdlx_desc_ring_span(idx, count);
+
+		mdlx_desc_chain_init(ring + idx,
+				     RING_BUS + idx * sizeof(struct mdlx_desc),
+				     count);
+		mdlx_desc_build(ring + idx, sdesc + sw_desc_idx, count,
+				&ep_addr, dir, true);
+		adjacent = mdlx_desc_ring_adjacent(idx, count);
+		mdlx_desc_chain_terminate(ring + idx, count);
+
+		if (check)
+			check_chain(ring + idx, idx, count, adjacent,
+				    sdesc + sw_desc_idx, ep_start, dir,
+				    l->blen_max);
+
+		sw_desc_idx += count;
+		*ring_idx = (idx + count) % MDLX_TRANSFER_MAX_DESC;
+	}
+	return sw_desc_cnt;
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int run_layout(const struct layout *l, unsigned int iterations)
+{
+	unsigned int max_sw = 0;
+	struct sw_desc *sdesc;
+	struct sg_ent *sg;
+	unsigned int sw_desc_cnt, ring_idx, i;
+	unsigned long long descs = 0;
+	double start, ns;
+
+	sg = calloc(l->nents, sizeof(*sg));
+	for (i = 0; i < l->nents; i++)
+		max_sw += mdlx_sw_desc_count(l->max_len, l->blen_max);
+	sdesc = calloc(max_sw, sizeof(*sdesc));
+	if (!sg || !sdesc) {
+		fprintf(stderr, "OOM, %u sg, %u sw_desc.\n", l->nents, max_sw);
+		return -1;
+	}
+
+	/* check every layout at many ring offsets, both directions */
+	for (i = 0; i < RING_CHECKS; i++) {
+		make_sg(l, sg);
+		sw_desc_cnt = split_sg(l, sg, sdesc);
+		ring_idx = (i * 37) % MDLX_TRANSFER_MAX_DESC;
+		build_request(l, sdesc, sw_desc_cnt, &ring_idx,
+			      (i & 1) ? DMA_FROM_DEVICE : DMA_TO_DEVICE, true);
+	}
+
+	make_sg(l, sg);
+	sw_desc_cnt = split_sg(l, sg, sdesc);
+	ring_idx = 0;
+	start = now_ns();
+	for (i = 0; i < iterations; i++)
+		descs += build_request(l, sdesc, sw_desc_cnt, &ring_idx,
+				       DMA_TO_DEVICE, false);
+	ns = now_ns() - start;
+
+	printf("%-8s %6u %8u %10u %12llu %10.2f\n", l->name, l->nents,
+	       l->blen_max, sw_desc_cnt, descs, descs ? ns / descs : 0.0);
+
+	free(sdesc);
+	free(sg);
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -l <layout>  page, small, mixed or huge (all)\n"
+		"  -n <count>   timed requests per layout (10000)\n"
+		"  -s <seed>    random seed for the sg layouts (1)\n",
+		name);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *only = NULL;
+	unsigned int iterations = 10000;
+	unsigned int seed = 1;
+	unsigned int i;
+	int c;
+
+	while ((c = getopt(argc, argv, "l:n:s:h")) != -1) {
+		switch (c) {
+		case 'l':
+			only = optarg;
+			break;
+		case 'n':
+			iterations = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	srand(seed);
+
+	printf("%-8s %6s %8s %10s %12s %10s\n", "layout", "sg", "blen",
+	       "descs", "built", "ns/desc");
+	for (i = 0; i < sizeof(layouts) / sizeof(layouts[0]); i++) {
+		if (only && strcmp(only, layouts[i].name))
+			continue;
+		if (run_layout(&layouts[i], iterations) < 0)
+			return 1;
+	}
+
+	if (errors) {
+		fprintf(stderr, "%d descriptor chain errors\n", errors);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,58 @@
+/*
+ * This file is part of the Medium DMA IP Core driver for Linux
+ *
+ * Copyright (c) 2020-present,  Medium, Inc.
+ * All rights reserved.
+ *
+ * This source code is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ */
+
+#ifndef MDLX_KSHIM_H
+#define MDLX_KSHIM_H
+
+/*
+ * Minimal kernel API for building the pure libmdlx sources, such as
+ * src/libmdlx_desc.c, as user-space objects.
+ */
+
+#include <endian.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef uint64_t dma_addr_t;
+
+#define __packed	__attribute__((packed))
+
+#define cpu_to_le32(x)	htole32(x)
+#define le32_to_cpu(x)	le32toh(x)
+
+#ifndef KBUILD_MODNAME
+#define KBUILD_MODNAME	"mdlx"
+#endif
+#ifndef pr_fmt
+#define pr_fmt(fmt)	fmt
+#endif
+#define pr_err(fmt, ...)	fprintf(stderr, pr_fmt(fmt), ##__VA_ARGS__)
+#define pr_warn(fmt, ...)	fprintf(stderr, pr_fmt(fmt), ##__VA_ARGS__)
+#define pr_info(fmt, ...)	fprintf(stdout, pr_fmt(fmt), ##__VA_ARGS__)
+
+#define WARN_ON(cond) ({						\
+	int __c = !!(cond);						\
+	if (__c)							\
+		fprintf(stderr, "WARN_ON(%s) %s:%d\n", #cond,		\
+			__FILE__, __LINE__);				\
+	__c;								\
+})
+
+/* values of enum dma_data_direction */
+#define DMA_TO_DEVICE	1
+#define DMA_FROM_DEVICE	2
+
+#endif /* MDLX_KSHIM_H */
@@ -0,0 +1,144 @@
+/*
+ * This file is part of the Medium DMA IP Core driver for Linux
+ *
+ * Copyright (c) 2020-present,  Medium, Inc.
+ * All rights reserved.
+ *
+ * This source code is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ */
+
+/*
+ * mdlx_perf - sweep transfer sizes and descriptor counts on one SGDMA engine
+ * with the driver's perf ioctls and print a size-vs-throughput table.
+ *
+ *   mdlx_perf -d /dev/mdlx0_h2c_0 [-s min] [-S max] [-n counts] [-t ms]
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "cdev_sgdma.h"
+
+#define MAX_COUNTS	16
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s -d <device> [options]\n"
+		"  -d <device>  SGDMA engine node, e.g. /dev/mdlx0_h2c_0\n"
+		"  -s <bytes>   smallest transfer size per descriptor (4096)\n"
+		"  -S <bytes>   largest transfer size per descriptor (1048576)\n"
+		"  -n <list>    comma separated descriptor counts (128)\n"
+		"  -t <ms>      measurement time per point (1000)\n",
+		name);
+}
+
+static double ratio(uint64_t num, uint64_t den)
+{
+	return den ? (double)num / (double)den : 0.0;
+}
+
+static int run_point(int fd, uint32_t size, uint32_t descs, unsigned int ms,
+		     struct mdlx_performance_ioctl *perf)
+{
+	memset(perf, 0, sizeof(*perf));
+	perf->version = IOCTL_MDLX_PERF_V2;
+	perf->transfer_size = size;
+	perf->desc_count = descs;
+
+	if (ioctl(fd, IOCTL_MDLX_PERF_START, perf) < 0) {
+		fprintf(stderr, "PERF_START size %u, descs %u: %s\n",
+			size, descs, strerror(errno));
+		return -1;
+	}
+	usleep(ms * 1000);
+	if (ioctl(fd, IOCTL_MDLX_PERF_STOP, perf) < 0) {
+		fprintf(stderr, "PERF_STOP size %u, descs %u: %s\n",
+			size, descs, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct mdlx_performance_ioctl perf;
+	const char *dev = NULL;
+	uint32_t min_size = 4096, max_size = 1024 * 1024;
+	uint32_t counts[MAX_COUNTS] = { 128 };
+	int nr_counts = 1;
+	unsigned int ms = 1000;
+	uint32_t size;
+	char *tok;
+	int fd, c, i;
+
+	while ((c = getopt(argc, argv, "d:s:S:n:t:h")) != -1) {
+		switch (c) {
+		case 'd':
+			dev = optarg;
+			break;
+		case 's':
+			min_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'S':
+			max_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			nr_counts = 0;
+			for (tok = strtok(optarg, ","); tok && nr_counts < MAX_COUNTS;
+			     tok = strtok(NULL, ","))
+				counts[nr_counts++] = strtoul(tok, NULL, 0);
+			break;
+		case 't':
+			ms = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (!dev || !min_size || min_size > max_size || !nr_counts) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	fd = open(dev, O_RDWR);
+	if (fd < 0) {
+		fprintf(stderr, "open %s: %s\n", dev, strerror(errno));
+		return 1;
+	}
+
+	printf("%s, %u ms per point\n", dev, ms);
+	printf("%10s %6s %12s %10s %12s %7s %7s\n", "size", "descs",
+	       "iterations", "GB/s", "desc/s", "data", "pending");
+
+	for (size = min_size; size && size <= max_size; size <<= 1) {
+		for (i = 0; i < nr_counts; i++) {
+			if (run_point(fd, size, counts[i], ms, &perf) < 0)
+				continue;
+
+			printf("%10u %6u %12u %10.3f %12.0f %6.1f%% %6.1f%%\n",
+			       size, perf.desc_count, perf.iterations,
+			       ratio(perf.bytes, perf.elapsed_ns),
+			       ratio(perf.iterations, perf.elapsed_ns) * 1e9,
+			       100.0 * ratio(perf.data_cycle_count,
+					     perf.clock_cycle_count),
+			       100.0 * ratio(perf.pending_count,
+					     perf.clock_cycle_count));
+		}
+	}
+
+	close(fd);
+	return 0;
+}